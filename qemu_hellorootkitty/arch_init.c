@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -38,6 +39,13 @@
 #include "hw/audiodev.h"
 #include "kvm.h"
 #include "migration.h"
+#include "qemu-thread.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "bitmap.h"
+#include "postcopy-ram.h"
+#include "multifd.h"
+#include "cpus.h"
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
@@ -87,113 +95,761 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* Set with MEM_SIZE and with each EOS when pages also travel on the
+ * multifd channels.  Reuses the bit of the obsolete RAM_SAVE_FLAG_FULL,
+ * targets with 1k pages have no other one left.  */
+#define RAM_SAVE_FLAG_MULTIFD  0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_POSTCOPY 0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_DISCARD  0x200
 
-static int is_dup_page(uint8_t *page, uint8_t ch)
+/*
+ * Pages still to be sent, one bit per page of the ram_addr_t space.  The
+ * MIGRATION_DIRTY_FLAG bits of the dirty log are folded in once per
+ * iteration, so that ram_save_block can skip clean pages a word at a
+ * time and ram_save_remaining does not scan anything.
+ */
+static unsigned long *migration_bitmap;
+static unsigned long migration_bitmap_pages;
+static uint64_t migration_dirty_pages;
+
+static RAMBlock *last_block;
+static ram_addr_t last_offset;
+/* block of the last page put in the stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_sent_block;
+/* true until the first pass over the RAM is complete */
+static bool ram_bulk_stage;
+static int ram_completed_passes;
+static uint64_t bytes_transferred;
+/* pages sent as a single byte, and pages sent in full */
+static uint64_t dup_mig_pages;
+static uint64_t norm_mig_pages;
+
+/*
+ * Postcopy.  The destination runs the guest and asks for the pages it
+ * faults on; they are queued by the migration return path and sent
+ * before the background scan goes on.
+ */
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static bool ram_postcopy;
+
+/*
+ * Live snapshots.  Once one has completed, the pages written by the guest
+ * keep being tracked with SNAPSHOT_DIRTY_FLAG, so that an incremental
+ * snapshot only saves the pages dirtied since the previous one.
+ */
+static enum {
+    RAM_SNAPSHOT_NONE,
+    RAM_SNAPSHOT_FULL,
+    RAM_SNAPSHOT_INCREMENTAL,
+    RAM_SNAPSHOT_SAVED,         /* the dirty log now tracks the next one */
+} ram_snapshot;
+static bool ram_snapshot_tracking;
+static QSIMPLEQ_HEAD(, RAMPageRequest) ram_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(ram_page_requests);
+
+static void ram_put_page_header(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, int flag)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
-    int i;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    qemu_put_be64(f, offset | cont | flag);
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        last_sent_block = block;
+    }
+}
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val) {
-            return 0;
+/*
+ * Compressed pages.  The I/O thread hands the dirty pages to a pool of
+ * worker threads that deflate them into a private buffer, and puts the
+ * result in the stream when the worker is needed again or when the
+ * stream is flushed.  Pages therefore reach the stream out of order,
+ * which is fine as long as a page is never in flight twice: the scan
+ * of the dirty bitmap flushes the workers every time it wraps around.
+ *
+ * The threads are never stopped (there is no way to join them) so the
+ * pool only grows up to the largest number of threads ever requested.
+ */
+
+enum {
+    COMP_IDLE,
+    COMP_PENDING,
+    COMP_DONE,
+};
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuCond cond;
+    int state;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uLong len;
+    uint8_t *buf;
+} CompressParam;
+
+static CompressParam comp_param[MAX_MIGRATE_THREADS];
+static QemuMutex comp_lock;
+static QemuCond comp_done_cond;
+/* threads created, and threads used by the current migration */
+static int comp_nthreads_max;
+static int comp_nthreads;
+static int comp_level;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    uLong len;
+    int level;
+
+    qemu_mutex_lock(&comp_lock);
+    for (;;) {
+        while (param->state != COMP_PENDING) {
+            qemu_cond_wait(&param->cond, &comp_lock);
         }
+        level = comp_level;
+        qemu_mutex_unlock(&comp_lock);
+
+        len = compressBound(TARGET_PAGE_SIZE);
+        if (compress2(param->buf, &len, param->block->host + param->offset,
+                      TARGET_PAGE_SIZE, level) != Z_OK) {
+            len = 0;
+        }
+
+        qemu_mutex_lock(&comp_lock);
+        param->len = len;
+        param->state = COMP_DONE;
+        qemu_cond_signal(&comp_done_cond);
     }
 
-    return 1;
+    return NULL;
 }
 
-static RAMBlock *last_block;
-static ram_addr_t last_offset;
+static void compress_threads_setup(int nthreads, int level)
+{
+    CompressParam *param;
+
+    if (!comp_nthreads_max) {
+        qemu_mutex_init(&comp_lock);
+        qemu_cond_init(&comp_done_cond);
+    }
+
+    qemu_mutex_lock(&comp_lock);
+    /* drop whatever a cancelled migration left behind */
+    for (param = comp_param; param < comp_param + comp_nthreads_max;
+         param++) {
+        while (param->state == COMP_PENDING) {
+            qemu_cond_wait(&comp_done_cond, &comp_lock);
+        }
+        param->state = COMP_IDLE;
+    }
+    comp_nthreads = nthreads;
+    comp_level = level;
+    qemu_mutex_unlock(&comp_lock);
+
+    while (comp_nthreads_max < nthreads) {
+        param = &comp_param[comp_nthreads_max++];
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        param->state = COMP_IDLE;
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param);
+    }
+}
+
+/* called with comp_lock held */
+static void ram_put_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    if (param->len == 0 || param->len >= TARGET_PAGE_SIZE) {
+        /* incompressible, or zlib failed: send the page as it is now */
+        ram_put_page_header(f, param->block, param->offset,
+                            RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, param->block->host + param->offset,
+                              TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+        norm_mig_pages++;
+    } else {
+        ram_put_page_header(f, param->block, param->offset,
+                            RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_transferred += param->len;
+    }
+    param->state = COMP_IDLE;
+}
+
+static void compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                            ram_addr_t offset)
+{
+    CompressParam *param;
+
+    qemu_mutex_lock(&comp_lock);
+    for (;;) {
+        for (param = comp_param; param < comp_param + comp_nthreads;
+             param++) {
+            if (param->state == COMP_DONE) {
+                ram_put_compressed_page(f, param);
+            }
+            if (param->state == COMP_IDLE) {
+                param->block = block;
+                param->offset = offset;
+                param->state = COMP_PENDING;
+                qemu_cond_signal(&param->cond);
+                qemu_mutex_unlock(&comp_lock);
+                return;
+            }
+        }
+        qemu_cond_wait(&comp_done_cond, &comp_lock);
+    }
+}
 
+static void flush_compressed_data(QEMUFile *f)
+{
+    CompressParam *param;
+
+    if (!comp_nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&comp_lock);
+    for (param = comp_param; param < comp_param + comp_nthreads; param++) {
+        while (param->state == COMP_PENDING) {
+            qemu_cond_wait(&comp_done_cond, &comp_lock);
+        }
+        if (param->state == COMP_DONE) {
+            ram_put_compressed_page(f, param);
+        }
+    }
+    qemu_mutex_unlock(&comp_lock);
+}
+
+/*
+ * XBZRLE.  Once the first pass over the RAM is over, the pages that are
+ * dirtied again are sent as a delta against the copy sent before, which
+ * is kept in an LRU cache.  The destination applies the delta to its
+ * own copy, so the cache must always hold exactly what was sent: pages
+ * are copied before being encoded, a miss sends the cached copy, and a
+ * page sent as a repeated byte updates its cached copy.
+ */
+
+#define ENCODING_FLAG_XBZRLE 0x1
+
+static struct {
+    PageCache *cache;
+    /* the page being encoded and its encoding */
+    uint8_t *current_buf;
+    uint8_t *encoded_buf;
+    /* stream data of ram_load */
+    uint8_t *decoded_buf;
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t cache_hit;
+    uint64_t cache_miss;
+    uint64_t overflow;
+} XBZRLE;
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    if (XBZRLE.cache) {
+        XBZRLE.cache = cache_resize(XBZRLE.cache,
+                                    new_size / TARGET_PAGE_SIZE);
+    }
+
+    return new_size & TARGET_PAGE_MASK;
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return XBZRLE.bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return XBZRLE.pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return XBZRLE.cache_miss;
+}
+
+double xbzrle_mig_cache_hit_rate(void)
+{
+    uint64_t lookups = XBZRLE.cache_hit + XBZRLE.cache_miss;
+
+    return lookups ? (double)XBZRLE.cache_hit / lookups : 0;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return XBZRLE.overflow;
+}
+
+static void xbzrle_setup(void)
+{
+    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE,
+                              TARGET_PAGE_SIZE);
+    XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+    XBZRLE.encoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    XBZRLE.bytes = 0;
+    XBZRLE.pages = 0;
+    XBZRLE.cache_hit = 0;
+    XBZRLE.cache_miss = 0;
+    XBZRLE.overflow = 0;
+}
+
+static void xbzrle_cleanup(void)
+{
+    cache_fini(XBZRLE.cache);
+    XBZRLE.cache = NULL;
+    g_free(XBZRLE.current_buf);
+    XBZRLE.current_buf = NULL;
+    g_free(XBZRLE.encoded_buf);
+    XBZRLE.encoded_buf = NULL;
+}
+
+static void save_xbzrle_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                             ram_addr_t current_addr, uint8_t *p)
+{
+    uint8_t *prev;
+    int len;
+
+    prev = cache_lookup(XBZRLE.cache, current_addr);
+    if (!prev) {
+        XBZRLE.cache_miss++;
+        prev = cache_insert(XBZRLE.cache, current_addr, p);
+        goto send_page;
+    }
+    XBZRLE.cache_hit++;
+
+    memcpy(XBZRLE.current_buf, p, TARGET_PAGE_SIZE);
+    len = xbzrle_encode_buffer(prev, XBZRLE.current_buf, TARGET_PAGE_SIZE,
+                               XBZRLE.encoded_buf, TARGET_PAGE_SIZE);
+    if (len == 0) {
+        /* written to, but back to the contents that were sent */
+        return;
+    }
+    memcpy(prev, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    if (len < 0) {
+        XBZRLE.overflow++;
+        goto send_page;
+    }
+
+    ram_put_page_header(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, len);
+    XBZRLE.pages++;
+    XBZRLE.bytes += len;
+    bytes_transferred += len;
+    return;
+
+send_page:
+    ram_put_page_header(f, block, offset, RAM_SAVE_FLAG_PAGE);
+    qemu_put_buffer(f, prev, TARGET_PAGE_SIZE);
+    bytes_transferred += TARGET_PAGE_SIZE;
+}
+
+static void xbzrle_cache_dup_page(ram_addr_t current_addr, uint8_t ch)
+{
+    uint8_t *prev = cache_lookup(XBZRLE.cache, current_addr);
+
+    if (prev) {
+        memset(prev, ch, TARGET_PAGE_SIZE);
+    }
+}
+
+static bool migration_bitmap_covers(RAMBlock *block)
+{
+    /* blocks registered after the migration started are not migrated */
+    return ((block->offset + block->length) >> TARGET_PAGE_BITS) <=
+           migration_bitmap_pages;
+}
+
+static void migration_bitmap_init(void)
+{
+    RAMBlock *block;
+
+    migration_bitmap_pages = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        migration_bitmap_pages = MAX(migration_bitmap_pages,
+                                     (block->offset + block->length) >>
+                                     TARGET_PAGE_BITS);
+    }
+
+    g_free(migration_bitmap);
+    migration_bitmap = bitmap_new(migration_bitmap_pages);
+    migration_dirty_pages = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        bitmap_set(migration_bitmap, block->offset >> TARGET_PAGE_BITS,
+                   block->length >> TARGET_PAGE_BITS);
+        migration_dirty_pages += block->length >> TARGET_PAGE_BITS;
+    }
+}
+
+/* Only the pages dirtied since the previous live snapshot are sent.  */
+static void migration_bitmap_init_incremental(void)
+{
+    RAMBlock *block;
+    unsigned long page, end;
+
+    migration_dirty_pages = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        page = block->offset >> TARGET_PAGE_BITS;
+        end = page + (block->length >> TARGET_PAGE_BITS);
+        bitmap_clear(migration_bitmap, page, end - page);
+        for (; page < end; page++) {
+            if (ram_list.phys_dirty[page] & SNAPSHOT_DIRTY_FLAG) {
+                set_bit(page, migration_bitmap);
+                migration_dirty_pages++;
+            }
+        }
+    }
+}
+
+static void migration_bitmap_free(void)
+{
+    g_free(migration_bitmap);
+    migration_bitmap = NULL;
+    migration_bitmap_pages = 0;
+}
+
+/* Pages dirtied again since the start of the current measurement period */
+static struct {
+    int64_t start_time;
+    uint64_t start_bytes;
+    uint64_t pages;
+    int high_cnt;
+    /* pages per second over the last complete period */
+    uint64_t pages_rate;
+    uint64_t sync_count;
+} dirty_rate;
+
+/* The guest is stopped: what it writes from now on goes in the next one.  */
+static void ram_snapshot_reset_dirty(void)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        SNAPSHOT_DIRTY_FLAG);
+    }
+}
+
+/* Keep the dirty log enabled between the snapshots of a chain */
+static void ram_dirty_tracking_stop(void)
+{
+    if (!ram_snapshot_tracking) {
+        cpu_physical_memory_set_dirty_tracking(0);
+    }
+}
+
+static void ram_snapshot_forget(void)
+{
+    if (ram_snapshot_tracking) {
+        ram_snapshot_tracking = false;
+        cpu_physical_memory_set_dirty_tracking(0);
+    }
+}
+
+int ram_snapshot_begin(bool incremental)
+{
+    if (incremental && !ram_snapshot_tracking) {
+        return -EINVAL;
+    }
+    ram_snapshot = incremental ? RAM_SNAPSHOT_INCREMENTAL : RAM_SNAPSHOT_FULL;
+    return 0;
+}
+
+/*
+ * A snapshot that fails after its last pass has reset the dirty log breaks
+ * the chain: the next one has to be a full snapshot.
+ */
+void ram_snapshot_end(bool completed)
+{
+    if (!completed && ram_snapshot == RAM_SNAPSHOT_SAVED) {
+        ram_snapshot_forget();
+    }
+    ram_snapshot = RAM_SNAPSHOT_NONE;
+}
+
+/* Fold the MIGRATION_DIRTY_FLAG bits of the dirty log into the bitmap.  */
+static void migration_bitmap_sync(void)
+{
+    const uint64_t mask = 0x0101010101010101ULL * MIGRATION_DIRTY_FLAG;
+    RAMBlock *block;
+    unsigned long page, end;
+    uint64_t flags;
+
+    dirty_rate.sync_count++;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!migration_bitmap_covers(block)) {
+            continue;
+        }
+        page = block->offset >> TARGET_PAGE_BITS;
+        end = page + (block->length >> TARGET_PAGE_BITS);
+        while (page < end) {
+            /* skip eight clean pages at a time */
+            if (page + 8 <= end) {
+                memcpy(&flags, ram_list.phys_dirty + page, sizeof(flags));
+                if (!(flags & mask)) {
+                    page += 8;
+                    continue;
+                }
+            }
+            /* With multi-threaded TCG the vCPUs keep writing, so clear
+               the flag in the same step that reads it.  */
+            if ((ram_list.phys_dirty[page] & MIGRATION_DIRTY_FLAG) &&
+                (__sync_fetch_and_and(&ram_list.phys_dirty[page],
+                                      ~MIGRATION_DIRTY_FLAG) &
+                 MIGRATION_DIRTY_FLAG) &&
+                !test_and_set_bit(page, migration_bitmap)) {
+                migration_dirty_pages++;
+                dirty_rate.pages++;
+            }
+            page++;
+        }
+        /* A write through a stale TLB entry since the flag was cleared hit
+           a page that is in the bitmap and not sent yet.  From here on,
+           writes set the flag again.  */
+        cpu_physical_memory_reset_dirty_tlb(block->offset,
+                                            block->offset + block->length);
+    }
+}
+
+/*
+ * Once per second, measure how fast the guest dirties its memory again.
+ * With auto-converge, compare it with the amount that was sent: each third
+ * period where the guest dirtied more than half of it, throttle the vCPUs
+ * a bit more.
+ */
+#define DIRTY_RATE_PERIOD_MS 1000
+#define DIRTY_RATE_HIGH_PERIODS 3
+#define CPU_THROTTLE_PCT_INITIAL 20
+#define CPU_THROTTLE_PCT_INCREMENT 10
+
+static void dirty_rate_reset(void)
+{
+    dirty_rate.start_time = qemu_get_clock_ms(rt_clock);
+    dirty_rate.start_bytes = bytes_transferred;
+    dirty_rate.pages = 0;
+}
+
+static void ram_update_dirty_rate(void)
+{
+    int64_t elapsed = qemu_get_clock_ms(rt_clock) - dirty_rate.start_time;
+    uint64_t bytes_sent;
+
+    if (elapsed < DIRTY_RATE_PERIOD_MS) {
+        return;
+    }
+    dirty_rate.pages_rate = dirty_rate.pages * 1000 / elapsed;
+
+    bytes_sent = bytes_transferred - dirty_rate.start_bytes;
+    if (migrate_auto_converge() &&
+        dirty_rate.pages * TARGET_PAGE_SIZE > bytes_sent / 2 &&
+        ++dirty_rate.high_cnt >= DIRTY_RATE_HIGH_PERIODS) {
+        dirty_rate.high_cnt = 0;
+        if (cpu_throttle_active()) {
+            cpu_throttle_set(cpu_throttle_get_percentage() +
+                             CPU_THROTTLE_PCT_INCREMENT);
+        } else {
+            cpu_throttle_set(CPU_THROTTLE_PCT_INITIAL);
+        }
+    }
+    dirty_rate_reset();
+}
+
+/* Return the offset of the first dirty page of block at or after start.  */
+static ram_addr_t migration_bitmap_find_dirty(RAMBlock *block,
+                                              ram_addr_t start)
+{
+    unsigned long base = block->offset >> TARGET_PAGE_BITS;
+    unsigned long size = base + (block->length >> TARGET_PAGE_BITS);
+    unsigned long next;
+
+    if (!migration_bitmap_covers(block)) {
+        return block->length;
+    }
+
+    next = find_next_bit(migration_bitmap, size,
+                         base + (start >> TARGET_PAGE_BITS));
+    return (ram_addr_t)(next - base) << TARGET_PAGE_BITS;
+}
+
+/* Put a page in the stream, or hand it to a compression thread.  */
+static void ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t current_addr = block->offset + offset;
+    uint8_t *p = block->host + offset;
+
+    if (test_and_clear_bit(current_addr >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+
+    if (buffer_is_dup(p, TARGET_PAGE_SIZE)) {
+        ram_put_page_header(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+        dup_mig_pages++;
+        if (XBZRLE.cache) {
+            xbzrle_cache_dup_page(current_addr, *p);
+        }
+    } else if (XBZRLE.cache && !ram_bulk_stage) {
+        save_xbzrle_page(f, block, offset, current_addr, p);
+    } else if (multifd_save_active() && multifd_save_page(block, offset)) {
+        bytes_transferred += TARGET_PAGE_SIZE;
+        norm_mig_pages++;
+    } else if (comp_nthreads && !ram_postcopy) {
+        compress_page_with_multi_thread(f, block, offset);
+    } else {
+        /* a write to the page before it is flushed marks it dirty again,
+         * so it can be sent from guest RAM without a copy */
+        ram_put_page_header(f, block, offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+        norm_mig_pages++;
+    }
+}
+
+/*
+ * Put the next dirty page in the stream.  Returns the number of pages
+ * handled, 0 if no page is dirty.
+ */
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
-    ram_addr_t current_addr;
-    int bytes_sent = 0;
+
+    if (!migration_dirty_pages) {
+        return 0;
+    }
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
 
-    current_addr = block->offset + offset;
-
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
-
-            p = block->host + offset;
-
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
-
+    for (;;) {
+        offset = migration_bitmap_find_dirty(block, offset);
+        if (offset < block->length) {
             break;
         }
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        offset = 0;
+        block = QLIST_NEXT(block, next);
+        if (!block) {
+            block = QLIST_FIRST(&ram_list.blocks);
+            /* the pages of the previous pass may be dirtied again */
+            flush_compressed_data(f);
+            ram_bulk_stage = false;
+            ram_completed_passes++;
         }
+    }
 
-        current_addr = block->offset + offset;
-
-    } while (current_addr != last_block->offset + last_offset);
+    ram_save_page(f, block, offset);
 
     last_block = block;
-    last_offset = offset;
+    last_offset = offset + TARGET_PAGE_SIZE;
 
-    return bytes_sent;
+    return 1;
 }
 
-static uint64_t bytes_transferred;
+/* Queue a page the destination faulted on; called from the return path.  */
+int ram_save_queue_page(const char *idstr, uint64_t offset)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
 
-static ram_addr_t ram_save_remaining(void)
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, idstr)) {
+            break;
+        }
+    }
+    if (!block || !migration_bitmap_covers(block) ||
+        offset >= block->length || (offset & ~TARGET_PAGE_MASK)) {
+        return -EINVAL;
+    }
+
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = offset;
+    QSIMPLEQ_INSERT_TAIL(&ram_page_requests, req, next);
+    return 0;
+}
+
+static void ram_save_requested_pages(QEMUFile *f)
+{
+    RAMPageRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&ram_page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&ram_page_requests, next);
+        ram_save_page(f, req->block, req->offset);
+        g_free(req);
+    }
+}
+
+static void ram_postcopy_cleanup(void)
+{
+    RAMPageRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&ram_page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&ram_page_requests, next);
+        g_free(req);
+    }
+    ram_postcopy = false;
+}
+
+/*
+ * Tell the destination which of the pages it already has are stale, as
+ * runs of pages still set in the bitmap.
+ */
+static void ram_save_discard(QEMUFile *f)
 {
     RAMBlock *block;
-    ram_addr_t count = 0;
+    unsigned long base, end, start, stop;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
-            }
+        if (!migration_bitmap_covers(block)) {
+            continue;
+        }
+        base = block->offset >> TARGET_PAGE_BITS;
+        end = base + (block->length >> TARGET_PAGE_BITS);
+        start = find_next_bit(migration_bitmap, end, base);
+        while (start < end) {
+            stop = find_next_zero_bit(migration_bitmap, end, start);
+            ram_put_page_header(f, block,
+                                (ram_addr_t)(start - base) << TARGET_PAGE_BITS,
+                                RAM_SAVE_FLAG_DISCARD);
+            qemu_put_be64(f, (uint64_t)(stop - start) << TARGET_PAGE_BITS);
+            start = find_next_bit(migration_bitmap, end, stop);
         }
     }
+}
+
+int ram_save_completed_passes(void)
+{
+    return ram_completed_passes;
+}
 
-    return count;
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -206,6 +862,31 @@ uint64_t ram_bytes_transferred(void)
     return bytes_transferred;
 }
 
+uint64_t dup_mig_pages_transferred(void)
+{
+    return dup_mig_pages;
+}
+
+uint64_t norm_mig_pages_transferred(void)
+{
+    return norm_mig_pages;
+}
+
+uint64_t norm_mig_bytes_transferred(void)
+{
+    return norm_mig_pages * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_dirty_pages_rate(void)
+{
+    return dirty_rate.pages_rate;
+}
+
+uint64_t ram_dirty_sync_count(void)
+{
+    return dirty_rate.sync_count;
+}
+
 uint64_t ram_bytes_total(void)
 {
     RAMBlock *block;
@@ -252,14 +933,16 @@ static void sort_ram_list(void)
 
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
     int ret;
 
     if (stage < 0) {
-        cpu_physical_memory_set_dirty_tracking(0);
+        ram_dirty_tracking_stop();
+        xbzrle_cleanup();
+        ram_postcopy_cleanup();
+        migration_bitmap_free();
         return 0;
     }
 
@@ -270,26 +953,48 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     if (stage == 1) {
         RAMBlock *block;
+
+        ret = multifd_save_setup(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+
         bytes_transferred = 0;
+        dup_mig_pages = 0;
+        norm_mig_pages = 0;
         last_block = NULL;
         last_offset = 0;
+        last_sent_block = NULL;
+        ram_bulk_stage = true;
+        ram_completed_passes = 0;
+        dirty_rate_reset();
+        dirty_rate.high_cnt = 0;
+        dirty_rate.pages_rate = 0;
+        dirty_rate.sync_count = 0;
+        if (migrate_use_xbzrle()) {
+            xbzrle_setup();
+        }
+        if (migrate_use_compression()) {
+            compress_threads_setup(migrate_compress_threads(),
+                                   migrate_compress_level());
+        } else {
+            comp_nthreads = 0;
+        }
         sort_ram_list();
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+        /* Every page is sent at least once, except by an incremental
+         * snapshot */
+        migration_bitmap_init();
+        if (ram_snapshot == RAM_SNAPSHOT_INCREMENTAL) {
+            migration_bitmap_init_incremental();
         }
 
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE |
+                      (multifd_save_active() ? RAM_SAVE_FLAG_MULTIFD : 0));
 
         QLIST_FOREACH(block, &ram_list.blocks, next) {
             qemu_put_byte(f, strlen(block->idstr));
@@ -298,15 +1003,36 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         }
     }
 
+    migration_bitmap_sync();
+    if (stage == 2 && !ram_postcopy) {
+        ram_update_dirty_rate();
+    }
+    if (stage == 3 && ram_snapshot != RAM_SNAPSHOT_NONE) {
+        ram_snapshot_reset_dirty();
+        ram_snapshot_tracking = true;
+        ram_snapshot = RAM_SNAPSHOT_SAVED;
+    }
+
+    if (stage == QEMU_SAVEVM_STAGE_POSTCOPY) {
+        /* the guest now runs on the destination */
+        cpu_throttle_stop();
+        /* pages still in the compression threads must arrive first */
+        flush_compressed_data(f);
+        xbzrle_cleanup();
+        ram_postcopy = true;
+        qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+        ram_save_discard(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    ram_save_requested_pages(f);
+
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
+    while ((ret = qemu_file_rate_limit(f)) == 0 && !multifd_save_full()) {
+        if (ram_save_block(f) == 0) { /* no more blocks */
             break;
         }
     }
@@ -326,25 +1052,40 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     /* try transferring iterative blocks of memory */
     if (stage == 3) {
-        int bytes_sent;
-
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+        if (multifd_save_active()) {
+            multifd_save_set_rate_limit(INT64_MAX);
         }
-        cpu_physical_memory_set_dirty_tracking(0);
+        while (ram_save_block(f) != 0) {
+            /* nothing */
+        }
+        ram_dirty_tracking_stop();
+        xbzrle_cleanup();
+        ram_postcopy_cleanup();
+        migration_bitmap_free();
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    flush_compressed_data(f);
+    ret = multifd_save_sync();
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS |
+                  (multifd_save_active() ? RAM_SAVE_FLAG_MULTIFD : 0));
+
+    if (ram_postcopy) {
+        /* the downtime is over, finish once every page has been sent */
+        return (stage == 2) && ram_save_remaining() == 0 &&
+               QSIMPLEQ_EMPTY(&ram_page_requests);
+    }
 
     expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
 
     return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -356,22 +1097,237 @@ static inline void *host_from_stream_offset(QEMUFile *f,
             return NULL;
         }
 
-        return block->host + offset;
+        return block;
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return block->host + offset;
+    /* the guest runs in postcopy, and qemu_get_ram_ptr reorders the list */
+    if (postcopy_ram_incoming_active()) {
+        block = postcopy_ram_find_block(id);
+        if (block) {
+            return block;
+        }
+    } else {
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id)))
+                return block;
+        }
     }
 
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = ram_block_from_stream(f, flags);
+
+    return block ? block->host + offset : NULL;
+}
+
+/*
+ * Decompression of RAM pages.  The I/O thread reads the compressed data
+ * into an idle worker's buffer and goes on with the stream while the
+ * worker inflates it into guest memory.  Everything is waited for at the
+ * end of each RAM section; within a section, a page that is still being
+ * inflated is waited for before being written again.
+ */
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuCond cond;
+    bool busy;
+    void *host;
+    uLong len;
+    uint8_t *buf;
+} DecompressParam;
+
+static DecompressParam decomp_param[MAX_MIGRATE_THREADS];
+static QemuMutex decomp_lock;
+static QemuCond decomp_done_cond;
+static int decomp_nthreads;
+static int decomp_error;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    uLong pagesize;
+    int ret;
+
+    qemu_mutex_lock(&decomp_lock);
+    for (;;) {
+        while (!param->busy) {
+            qemu_cond_wait(&param->cond, &decomp_lock);
+        }
+        qemu_mutex_unlock(&decomp_lock);
+
+        pagesize = TARGET_PAGE_SIZE;
+        ret = uncompress(param->host, &pagesize, param->buf, param->len);
+
+        qemu_mutex_lock(&decomp_lock);
+        if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+            decomp_error = -EINVAL;
+        }
+        param->busy = false;
+        qemu_cond_signal(&decomp_done_cond);
+    }
+
+    return NULL;
+}
+
+static void decompress_threads_setup(void)
+{
+    DecompressParam *param;
+    int nthreads = migrate_decompress_threads();
+
+    if (!decomp_nthreads) {
+        qemu_mutex_init(&decomp_lock);
+        qemu_cond_init(&decomp_done_cond);
+    }
+
+    while (decomp_nthreads < nthreads) {
+        param = &decomp_param[decomp_nthreads++];
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param);
+    }
+}
+
+/* called with decomp_lock held */
+static void wait_for_decompress_page(void *host)
+{
+    DecompressParam *param;
+
+    for (param = decomp_param; param < decomp_param + decomp_nthreads;
+         param++) {
+        while (param->busy && param->host == host) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+        }
+    }
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len)
+{
+    DecompressParam *param;
+
+    qemu_mutex_lock(&decomp_lock);
+    wait_for_decompress_page(host);
+    for (;;) {
+        for (param = decomp_param; param < decomp_param + decomp_nthreads;
+             param++) {
+            if (!param->busy) {
+                goto found;
+            }
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+    }
+
+found:
+    /* only this thread makes a worker busy, the buffer is ours */
+    qemu_mutex_unlock(&decomp_lock);
+    qemu_get_buffer(f, param->buf, len);
+
+    qemu_mutex_lock(&decomp_lock);
+    param->host = host;
+    param->len = len;
+    param->busy = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&decomp_lock);
+}
+
+static void ram_load_wait_page(void *host)
+{
+    if (decomp_nthreads) {
+        qemu_mutex_lock(&decomp_lock);
+        wait_for_decompress_page(host);
+        qemu_mutex_unlock(&decomp_lock);
+    }
+}
+
+static int wait_for_decompress_done(void)
+{
+    DecompressParam *param;
+    int ret;
+
+    if (!decomp_nthreads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_lock);
+    for (param = decomp_param; param < decomp_param + decomp_nthreads;
+         param++) {
+        while (param->busy) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_lock);
+        }
+    }
+    ret = decomp_error;
+    decomp_error = 0;
+    qemu_mutex_unlock(&decomp_lock);
+
+    return ret;
+}
+
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    int len;
+
+    if (qemu_get_byte(f) != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -EINVAL;
+    }
+
+    len = qemu_get_be16(f);
+    if (len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -EINVAL;
+    }
+
+    if (!XBZRLE.decoded_buf) {
+        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+    qemu_get_buffer(f, XBZRLE.decoded_buf, len);
+
+    ram_load_wait_page(host);
+    if (xbzrle_decode_buffer(XBZRLE.decoded_buf, len, host,
+                             TARGET_PAGE_SIZE) < 0) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Pages arriving in postcopy are placed atomically, waking up the guest.  */
+static int ram_load_postcopy_page(QEMUFile *f, void *host, int flags)
+{
+    static uint8_t *buf;
+    uint8_t ch;
+
+    if (!buf) {
+        buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        ch = qemu_get_byte(f);
+        if (ch == 0) {
+            return postcopy_ram_place_zero_page(host);
+        }
+        memset(buf, ch, TARGET_PAGE_SIZE);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+    } else {
+        return -EINVAL;
+    }
+
+    return postcopy_ram_place_page(host, buf);
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -388,7 +1344,18 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
+        if ((flags & (RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_EOS)) &&
+            !!(flags & RAM_SAVE_FLAG_MULTIFD) != multifd_load_active()) {
+            fprintf(stderr, "multifd is %s on the source only, cannot "
+                    "accept migration\n",
+                    multifd_load_active() ? "disabled" : "enabled");
+            wait_for_decompress_done();
+            return -EINVAL;
+        }
+
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+            /* the RAM no longer matches the last live snapshot */
+            ram_snapshot_forget();
             if (version_id == 3) {
                 if (addr != ram_bytes_total()) {
                     return -EINVAL;
@@ -427,7 +1394,38 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            error = wait_for_decompress_done();
+            if (error) {
+                fprintf(stderr, "Failed to decompress page\n");
+                return error;
+            }
+            error = postcopy_ram_incoming_init(f);
+            if (error) {
+                return error;
+            }
+        } else if (flags & RAM_SAVE_FLAG_DISCARD) {
+            RAMBlock *block = ram_block_from_stream(f, flags);
+            uint64_t len = qemu_get_be64(f);
+
+            if (!block || addr > block->length ||
+                len > block->length - addr) {
+                fprintf(stderr, "Invalid discard range\n");
+                return -EINVAL;
+            }
+            qemu_madvise(block->host + addr, len, QEMU_MADV_DONTNEED);
+        } else if (postcopy_ram_incoming_active() &&
+                   (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                             RAM_SAVE_FLAG_XBZRLE |
+                             RAM_SAVE_FLAG_COMPRESS_PAGE))) {
+            void *host;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host || ram_load_postcopy_page(f, host, flags) < 0) {
+                fprintf(stderr, "Failed to place postcopy page\n");
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
 
@@ -440,6 +1438,7 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
+            ram_load_wait_page(host);
             memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
             if (ch == 0 &&
@@ -455,15 +1454,46 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             else
                 host = host_from_stream_offset(f, addr, flags);
 
+            ram_load_wait_page(host);
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host || load_xbzrle(f, host) < 0) {
+                wait_for_decompress_done();
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            int len;
+
+            host = host_from_stream_offset(f, addr, flags);
+            len = qemu_get_be32(f);
+            if (!host || len <= 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed page\n");
+                wait_for_decompress_done();
+                return -EINVAL;
+            }
+            if (!decomp_nthreads) {
+                decompress_threads_setup();
+            }
+            decompress_data_with_multi_threads(f, host, len);
         }
         error = qemu_file_get_error(f);
         if (error) {
+            wait_for_decompress_done();
             return error;
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
-    return 0;
+    error = wait_for_decompress_done();
+    if (error) {
+        fprintf(stderr, "Failed to decompress page\n");
+        return error;
+    }
+
+    return multifd_load_sync();
 }
 
 #ifdef HAS_AUDIO
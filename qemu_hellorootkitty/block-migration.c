@@ -27,6 +27,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -68,6 +69,10 @@ typedef struct BlkMigBlock {
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    int zero_blocks;
+    /* chunks sent as a flag only, and chunks sent with their data */
+    uint64_t dup_blocks;
+    uint64_t norm_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
@@ -86,17 +91,27 @@ static BlkMigState block_mig_state;
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (block_mig_state.zero_blocks &&
+        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+        block_mig_state.norm_blocks++;
+    } else {
+        block_mig_state.dup_blocks++;
+    }
 }
 
 int blk_mig_active(void)
@@ -120,6 +135,21 @@ uint64_t blk_mig_bytes_remaining(void)
     return blk_mig_bytes_total() - blk_mig_bytes_transferred();
 }
 
+uint64_t blk_mig_dup_blocks_transferred(void)
+{
+    return block_mig_state.dup_blocks;
+}
+
+uint64_t blk_mig_norm_blocks_transferred(void)
+{
+    return block_mig_state.norm_blocks;
+}
+
+uint64_t blk_mig_norm_bytes_transferred(void)
+{
+    return block_mig_state.norm_blocks * BLOCK_SIZE;
+}
+
 uint64_t blk_mig_bytes_total(void)
 {
     BlkMigDevState *bmds;
@@ -325,6 +355,8 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.dup_blocks = 0;
+    block_mig_state.norm_blocks = 0;
 
     bdrv_iterate(init_blk_migration_it, mon);
 }
@@ -387,7 +419,7 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
         if (bmds_aio_inflight(bmds, sector)) {
-            qemu_aio_flush();
+            bdrv_drain_all();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
 
@@ -689,9 +721,12 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                buf = g_malloc0(BLOCK_SIZE);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
             ret = bdrv_write(bs, addr, buf, nr_sectors);
 
             g_free(buf);
@@ -723,6 +758,7 @@ static void block_set_params(int blk_enable, int shared_base, void *opaque)
 {
     block_mig_state.blk_enable = blk_enable;
     block_mig_state.shared_base = shared_base;
+    block_mig_state.zero_blocks = migrate_use_zero_blocks();
 
     /* shared base means that blk_enable = 1 */
     block_mig_state.blk_enable |= shared_base;
@@ -19,5 +19,8 @@ int blk_mig_active(void);
 uint64_t blk_mig_bytes_transferred(void);
 uint64_t blk_mig_bytes_remaining(void);
 uint64_t blk_mig_bytes_total(void);
+uint64_t blk_mig_dup_blocks_transferred(void);
+uint64_t blk_mig_norm_blocks_transferred(void);
+uint64_t blk_mig_norm_bytes_transferred(void);
 
 #endif /* BLOCK_MIGRATION_H */
@@ -29,6 +29,7 @@
 #include "module.h"
 #include "qjson.h"
 #include "qemu-coroutine.h"
+#include "host-utils.h"
 #include "qmp-commands.h"
 
 #ifdef CONFIG_BSD
@@ -60,10 +61,18 @@ static int coroutine_fn bdrv_co_readv_em(BlockDriverState *bs,
 static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
                                          int64_t sector_num, int nb_sectors,
                                          QEMUIOVector *iov);
+
+typedef enum {
+    /* Don't delay the request for I/O limits, only account for it */
+    BDRV_REQ_NO_THROTTLE = 0x1,
+} BdrvRequestFlags;
+
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
 static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
 static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
@@ -213,9 +222,190 @@ BlockDriverState *bdrv_new(const char *device_name)
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
     bdrv_iostatus_disable(bs);
+    qemu_co_queue_init(&bs->throttled_reqs);
     return bs;
 }
 
+/* Throttled requests wait for this timer to let the next one through */
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+static bool bdrv_io_limits_any(const BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    memset(bs->io_bucket_bytes, 0, sizeof(bs->io_bucket_bytes));
+    memset(bs->io_bucket_ops, 0, sizeof(bs->io_bucket_ops));
+    bs->io_bucket_time = qemu_get_clock_ns(rt_clock);
+
+    if (!bs->block_timer) {
+        bs->block_timer = qemu_new_timer_ns(rt_clock, bdrv_block_timer, bs);
+    }
+    bs->io_limits_enabled = true;
+}
+
+static void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    /* Waiting requests see that the limits are gone once they run */
+    while (qemu_co_queue_next(&bs->throttled_reqs)) {
+        /* do nothing */
+    }
+
+    if (bs->block_timer) {
+        qemu_del_timer(bs->block_timer);
+        qemu_free_timer(bs->block_timer);
+        bs->block_timer = NULL;
+    }
+}
+
+/*
+ * Leaks the buckets for the time elapsed since the last call, and returns how
+ * long a request of @bytes must wait before its buckets are below the burst
+ * allowance again, or 0 if it can go now.
+ */
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, bool is_write,
+                                   double bytes)
+{
+    BlockIOLimit *limits = &bs->io_limits;
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double elapsed = (now - bs->io_bucket_time) / (double)get_ticks_per_sec();
+    double wait = 0;
+    int types[2] = { is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ,
+                     BLOCK_IO_LIMIT_TOTAL };
+    int i, t;
+
+    bs->io_bucket_time = now;
+    for (i = 0; i < 3; i++) {
+        bs->io_bucket_bytes[i] = MAX(bs->io_bucket_bytes[i] -
+                                     limits->bps[i] * elapsed, 0);
+        bs->io_bucket_ops[i] = MAX(bs->io_bucket_ops[i] -
+                                   limits->iops[i] * elapsed, 0);
+    }
+
+    for (i = 0; i < 2; i++) {
+        double burst;
+
+        t = types[i];
+        if (limits->bps[t]) {
+            burst = limits->bps[t] * BLOCK_IO_BURST_NS /
+                    (double)get_ticks_per_sec();
+            burst = MAX(burst, bytes);
+            if (bs->io_bucket_bytes[t] + bytes > burst) {
+                wait = MAX(wait, (bs->io_bucket_bytes[t] + bytes - burst) /
+                                 limits->bps[t]);
+            }
+        }
+        if (limits->iops[t]) {
+            burst = limits->iops[t] * BLOCK_IO_BURST_NS /
+                    (double)get_ticks_per_sec();
+            burst = MAX(burst, 1);
+            if (bs->io_bucket_ops[t] + 1 > burst) {
+                wait = MAX(wait, (bs->io_bucket_ops[t] + 1 - burst) /
+                                 limits->iops[t]);
+            }
+        }
+    }
+
+    return wait * get_ticks_per_sec();
+}
+
+/* Accounts for a request submitted to @bs and returns its start time */
+static int64_t bdrv_io_start(BlockDriverState *bs)
+{
+    int depth = ++bs->in_flight;
+
+    trace_bdrv_io_start(bs, depth);
+    bs->queue_depth_histogram[MIN(63 - clz64(depth),
+                                  BDRV_QUEUE_DEPTH_BUCKETS - 1)]++;
+    return get_clock();
+}
+
+static void bdrv_io_done(BlockDriverState *bs, enum BlockAcctType type,
+                         int64_t start)
+{
+    int64_t ns = get_clock() - start;
+    int bucket = 0;
+
+    if (ns >= (1 << BDRV_LATENCY_MIN_SHIFT)) {
+        bucket = MIN(64 - clz64(ns) - BDRV_LATENCY_MIN_SHIFT,
+                     BDRV_LATENCY_BUCKETS - 1);
+    }
+
+    trace_bdrv_io_done(bs, type, ns);
+    bs->in_flight--;
+    bs->latency_histogram[type][bucket]++;
+}
+
+/*
+ * Charges a request to the buckets of @bs.
+ */
+static void bdrv_io_limits_account(BlockDriverState *bs, bool is_write,
+                                   int nb_sectors)
+{
+    double bytes = (double)nb_sectors * BDRV_SECTOR_SIZE;
+    int type = is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ;
+
+    bs->io_bucket_bytes[type] += bytes;
+    bs->io_bucket_bytes[BLOCK_IO_LIMIT_TOTAL] += bytes;
+    bs->io_bucket_ops[type]++;
+    bs->io_bucket_ops[BLOCK_IO_LIMIT_TOTAL]++;
+}
+
+/*
+ * Delays a request until the limits of @bs allow it.  Requests are let through
+ * in the order they arrived, so a large request isn't starved by small ones.
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+    bool is_write, int nb_sectors)
+{
+    double bytes = (double)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t start = 0;
+    int64_t wait_ns;
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        start = qemu_get_clock_ns(rt_clock);
+        qemu_co_queue_wait(&bs->throttled_reqs);
+    }
+
+    while (bs->io_limits_enabled && !bs->io_limits_draining &&
+           (wait_ns = bdrv_io_limits_wait(bs, is_write, bytes)) > 0) {
+        if (!start) {
+            start = qemu_get_clock_ns(rt_clock);
+        }
+        qemu_mod_timer(bs->block_timer,
+                       qemu_get_clock_ns(rt_clock) + wait_ns);
+        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    }
+
+    if (start) {
+        bs->nr_throttled_ops++;
+        bs->throttled_time_ns += qemu_get_clock_ns(rt_clock) - start;
+    }
+
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_account(bs, is_write, nb_sectors);
+    }
+
+    /* Let the next request check whether it fits as well */
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
 BlockDriver *bdrv_find_format(const char *format_name)
 {
     BlockDriver *drv1;
@@ -755,6 +945,8 @@ void bdrv_delete(BlockDriverState *bs)
         bdrv_delete(bs->file);
     }
 
+    bdrv_io_limits_disable(bs);
+
     assert(bs != bs_snapshots);
     g_free(bs);
 }
@@ -1028,6 +1220,7 @@ typedef struct RwCo {
     int nb_sectors;
     QEMUIOVector *qiov;
     bool is_write;
+    BdrvRequestFlags flags;
     int ret;
 } RwCo;
 
@@ -1037,10 +1230,12 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
 
     if (!rwco->is_write) {
         rwco->ret = bdrv_co_do_readv(rwco->bs, rwco->sector_num,
-                                     rwco->nb_sectors, rwco->qiov);
+                                     rwco->nb_sectors, rwco->qiov,
+                                     rwco->flags);
     } else {
         rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
-                                      rwco->nb_sectors, rwco->qiov);
+                                      rwco->nb_sectors, rwco->qiov,
+                                      rwco->flags);
     }
 }
 
@@ -1071,6 +1266,9 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
     } else {
+        /* qemu_aio_wait() doesn't run the timer that releases throttled
+         * requests, so the request would never complete.  */
+        rwco.flags |= BDRV_REQ_NO_THROTTLE;
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
@@ -1249,9 +1447,12 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
  * Handle a read request in coroutine context
  */
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1260,7 +1461,20 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
-    return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    start = bdrv_io_start(bs);
+
+    if (bs->io_limits_enabled) {
+        if (flags & BDRV_REQ_NO_THROTTLE) {
+            bdrv_io_limits_account(bs, false, nb_sectors);
+        } else {
+            bdrv_io_limits_intercept(bs, false, nb_sectors);
+        }
+    }
+
+    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+
+    bdrv_io_done(bs, BDRV_ACCT_READ, start);
+    return ret;
 }
 
 int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -1268,16 +1482,18 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_co_readv(bs, sector_num, nb_sectors);
 
-    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov);
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov, 0);
 }
 
 /*
  * Handle a write request in coroutine context
  */
 static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
     int ret;
 
     if (!bs->drv) {
@@ -1290,8 +1506,20 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
+    start = bdrv_io_start(bs);
+
+    if (bs->io_limits_enabled) {
+        if (flags & BDRV_REQ_NO_THROTTLE) {
+            bdrv_io_limits_account(bs, true, nb_sectors);
+        } else {
+            bdrv_io_limits_intercept(bs, true, nb_sectors);
+        }
+    }
+
     ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
 
+    bdrv_io_done(bs, BDRV_ACCT_WRITE, start);
+
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
@@ -1308,7 +1536,7 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_co_writev(bs, sector_num, nb_sectors);
 
-    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov);
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov, 0);
 }
 
 /**
@@ -1639,6 +1867,34 @@ BlockErrorAction bdrv_get_on_error(BlockDriverState *bs, int is_read)
     return is_read ? bs->on_read_error : bs->on_write_error;
 }
 
+/*
+ * Sizes in bytes for the metadata caches of formats that have them, taking
+ * effect on the next open.  Zero means the driver default.
+ */
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, uint64_t l2_size,
+                                  uint64_t refcount_size)
+{
+    bs->l2_cache_size = l2_size;
+    bs->refcount_cache_size = refcount_size;
+}
+
+/*
+ * Sets the bytes and operations per second that requests on @bs may use.
+ * A limit of zero is no limit; the total and per-direction limits all apply.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+
+    if (bdrv_io_limits_any(io_limits)) {
+        bdrv_io_limits_enable(bs);
+        /* The first waiting request recomputes its delay */
+        qemu_co_queue_next(&bs->throttled_reqs);
+    } else if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
+}
+
 int bdrv_is_read_only(BlockDriverState *bs)
 {
     return bs->read_only;
@@ -1749,6 +2005,36 @@ const char *bdrv_get_device_name(BlockDriverState *bs)
     return bs->device_name;
 }
 
+/*
+ * Waits for all requests in flight to complete.  Throttled requests are let
+ * through without waiting for their timer, which qemu_aio_flush() wouldn't
+ * run.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+    bool busy;
+
+    do {
+        qemu_aio_flush();
+
+        busy = false;
+        QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+                bs->io_limits_draining = true;
+                while (qemu_co_queue_next(&bs->throttled_reqs)) {
+                    /* do nothing */
+                }
+                busy = true;
+            }
+        }
+    } while (busy);
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bs->io_limits_draining = false;
+    }
+}
+
 void bdrv_flush_all(void)
 {
     BlockDriverState *bs;
@@ -1862,6 +2148,19 @@ BlockInfoList *qmp_query_block(Error **errp)
                 info->value->inserted->has_backing_file = true;
                 info->value->inserted->backing_file = g_strdup(bs->backing_file);
             }
+
+            info->value->inserted->bps =
+                bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
+            info->value->inserted->bps_rd =
+                bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
+            info->value->inserted->bps_wr =
+                bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
+            info->value->inserted->iops =
+                bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
+            info->value->inserted->iops_rd =
+                bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
+            info->value->inserted->iops_wr =
+                bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
         }
 
         /* XXX: waiting for the qapi to support GSList */
@@ -1876,10 +2175,41 @@ BlockInfoList *qmp_query_block(Error **errp)
     return head;
 }
 
+/*
+ * Converts a histogram to the buckets that have requests in them, where bucket
+ * i starts at 2^(i + shift), except for the first one starting at @first.
+ * Returns false if all of the buckets are empty.
+ */
+static bool qmp_query_histogram(const uint64_t *counts, int nb_buckets,
+                                int64_t first, int shift,
+                                BlockHistogramBucketList **list)
+{
+    BlockHistogramBucketList **next = list;
+    int i;
+
+    *list = NULL;
+    for (i = 0; i < nb_buckets; i++) {
+        BlockHistogramBucketList *entry;
+
+        if (!counts[i]) {
+            continue;
+        }
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->start = i == 0 ? first : 1LL << (i + shift);
+        entry->value->count = counts[i];
+        *next = entry;
+        next = &entry->next;
+    }
+
+    return *list != NULL;
+}
+
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
+    BlockCacheStats bcs;
 
     s = g_malloc0(sizeof(*s));
 
@@ -1899,6 +2229,45 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bdrv_get_cache_stats(bs, &bcs) == 0) {
+        s->stats->has_l2_cache_hits = true;
+        s->stats->l2_cache_hits = bcs.l2_hits;
+        s->stats->has_l2_cache_misses = true;
+        s->stats->l2_cache_misses = bcs.l2_misses;
+        s->stats->has_refcount_cache_hits = true;
+        s->stats->refcount_cache_hits = bcs.refcount_hits;
+        s->stats->has_refcount_cache_misses = true;
+        s->stats->refcount_cache_misses = bcs.refcount_misses;
+    }
+
+    if (bs->io_limits_enabled || bs->nr_throttled_ops) {
+        s->stats->has_throttled_operations = true;
+        s->stats->throttled_operations = bs->nr_throttled_ops;
+        s->stats->has_throttled_total_time_ns = true;
+        s->stats->throttled_total_time_ns = bs->throttled_time_ns;
+    }
+
+    s->stats->in_flight = bs->in_flight;
+    s->stats->has_rd_latency_histogram =
+        qmp_query_histogram(bs->latency_histogram[BDRV_ACCT_READ],
+                            BDRV_LATENCY_BUCKETS, 0,
+                            BDRV_LATENCY_MIN_SHIFT - 1,
+                            &s->stats->rd_latency_histogram);
+    s->stats->has_wr_latency_histogram =
+        qmp_query_histogram(bs->latency_histogram[BDRV_ACCT_WRITE],
+                            BDRV_LATENCY_BUCKETS, 0,
+                            BDRV_LATENCY_MIN_SHIFT - 1,
+                            &s->stats->wr_latency_histogram);
+    s->stats->has_flush_latency_histogram =
+        qmp_query_histogram(bs->latency_histogram[BDRV_ACCT_FLUSH],
+                            BDRV_LATENCY_BUCKETS, 0,
+                            BDRV_LATENCY_MIN_SHIFT - 1,
+                            &s->stats->flush_latency_histogram);
+    s->stats->has_queue_depth_histogram =
+        qmp_query_histogram(bs->queue_depth_histogram,
+                            BDRV_QUEUE_DEPTH_BUCKETS, 1, 0,
+                            &s->stats->queue_depth_histogram);
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
@@ -1973,6 +2342,17 @@ int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return drv->bdrv_get_info(bs, bdi);
 }
 
+int bdrv_get_cache_stats(BlockDriverState *bs, BlockCacheStats *bcs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_get_cache_stats)
+        return -ENOTSUP;
+    memset(bcs, 0, sizeof(*bcs));
+    return drv->bdrv_get_cache_stats(bs, bcs);
+}
+
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                       int64_t pos, int size)
 {
@@ -2569,7 +2949,7 @@ typedef struct BlockDriverAIOCBCoroutine {
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 static AIOPool bdrv_em_co_aio_pool = {
@@ -2594,10 +2974,10 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov);
+            acb->req.nb_sectors, acb->req.qiov, 0);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov);
+            acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
     acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
@@ -2780,7 +3160,7 @@ static void coroutine_fn bdrv_flush_co_entry(void *opaque)
     rwco->ret = bdrv_co_flush(rwco->bs);
 }
 
-int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+static int coroutine_fn bdrv_co_do_flush(BlockDriverState *bs)
 {
     if (bs->open_flags & BDRV_O_NO_FLUSH) {
         return 0;
@@ -2817,6 +3197,17 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     }
 }
 
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    int64_t start = bdrv_io_start(bs);
+    int ret;
+
+    ret = bdrv_co_do_flush(bs);
+
+    bdrv_io_done(bs, BDRV_ACCT_FLUSH, start);
+    return ret;
+}
+
 int bdrv_flush(BlockDriverState *bs)
 {
     Coroutine *co;
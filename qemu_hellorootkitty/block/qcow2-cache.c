@@ -27,19 +27,32 @@
 #include "qcow2.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;      /* next entry in the same bucket, -1 at the end */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
+/*
+ * Tables are found through a hash of their offset.  Entries that nobody holds
+ * a reference to sit on an LRU list, and the head of that list is the one to
+ * replace on a miss.  The tables themselves live in one array, so an entry
+ * is found from its table pointer by index.
+ */
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                table_array;
+    int*                    buckets;
+    int                     bucket_bits;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_bits;
     bool                    depends_on_flush;
     bool                    writethrough;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
@@ -51,11 +64,23 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_bits = s->cluster_bits;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables << c->table_bits);
     c->writethrough = writethrough;
 
+    /* At least two buckets per entry keeps the chains short */
+    c->bucket_bits = 1;
+    while ((1 << c->bucket_bits) < 2 * num_tables) {
+        c->bucket_bits++;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) << c->bucket_bits);
+    memset(c->buckets, -1, sizeof(*c->buckets) << c->bucket_bits);
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -67,15 +92,76 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+static void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->table_array + ((size_t)i << c->table_bits);
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - c->table_array;
+    int i = off >> c->table_bits;
+
+    assert(off >= 0 && i < c->size && qcow2_cache_table(c, i) == table);
+    return i;
+}
+
+static int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t hash = (offset >> c->table_bits) * 0x9e3779b97f4a7c15ULL;
+
+    return &c->buckets[hash >> (64 - c->bucket_bits)];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -119,8 +205,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_table(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -183,32 +269,14 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
+    Qcow2CachedTable *entry = QTAILQ_FIRST(&c->lru);
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
-    }
-
-    if (min_index == -1) {
+    if (!entry) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
-    return min_index;
+    return entry - c->entries;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -219,11 +287,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -236,28 +305,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    }
+    *table = qcow2_cache_table(c, i);
     return 0;
 }
 
@@ -275,20 +347,15 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_table_index(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
     assert(c->entries[i].ref >= 0);
+    if (c->entries[i].ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
+    }
 
     if (c->writethrough) {
         return qcow2_cache_entry_flush(bs, c, i);
@@ -299,17 +366,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
-    c->entries[i].dirty = true;
+    c->entries[qcow2_cache_table_index(c, table)].dirty = true;
 }
 
 bool qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
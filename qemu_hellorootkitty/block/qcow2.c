@@ -146,6 +146,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    uint64_t l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -231,8 +232,24 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+    l2_cache_size = L2_CACHE_SIZE;
+    if (bs->l2_cache_size) {
+        l2_cache_size = MAX(bs->l2_cache_size >> s->cluster_bits,
+                            MIN_L2_CACHE_SIZE);
+        /* There is no point in caching more L2 tables than the image has */
+        l2_cache_size = MIN(l2_cache_size, MAX(s->l1_size, L2_CACHE_SIZE));
+    }
+    refcount_cache_size = REFCOUNT_CACHE_SIZE;
+    if (bs->refcount_cache_size) {
+        refcount_cache_size = MAX(bs->refcount_cache_size >> s->cluster_bits,
+                                  MIN_REFCOUNT_CACHE_SIZE);
+        /* Nor more refcount blocks than its refcount table points to */
+        refcount_cache_size = MIN(refcount_cache_size,
+                                  MAX(s->refcount_table_size,
+                                      REFCOUNT_CACHE_SIZE));
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
         writethrough);
 
     s->cluster_cache = g_malloc(s->cluster_size);
@@ -731,7 +748,7 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_ext_header(bs, backing_file, backing_fmt);
 }
 
-static int preallocate(BlockDriverState *bs)
+static int coroutine_fn preallocate(BlockDriverState *bs)
 {
     uint64_t nb_sectors;
     uint64_t offset;
@@ -784,6 +801,22 @@ static int preallocate(BlockDriverState *bs)
     return 0;
 }
 
+typedef struct QCowPreallocCo {
+    BlockDriverState *bs;
+    int ret;
+} QCowPreallocCo;
+
+/* Allocation may drop s->lock for COW, so preallocate() runs like a write */
+static void coroutine_fn preallocate_co_entry(void *opaque)
+{
+    QCowPreallocCo *pco = opaque;
+    BDRVQcowState *s = pco->bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    pco->ret = preallocate(pco->bs);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, int prealloc,
@@ -899,7 +932,21 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
     /* And if we're supposed to preallocate metadata, do that now */
     if (prealloc) {
-        ret = preallocate(bs);
+        QCowPreallocCo pco = {
+            .bs = bs,
+            .ret = -EINPROGRESS,
+        };
+
+        if (qemu_in_coroutine()) {
+            preallocate_co_entry(&pco);
+        } else {
+            Coroutine *co = qemu_coroutine_create(preallocate_co_entry);
+            qemu_coroutine_enter(co, &pco);
+            while (pco.ret == -EINPROGRESS) {
+                qemu_aio_wait();
+            }
+        }
+        ret = pco.ret;
         if (ret < 0) {
             goto out;
         }
@@ -1140,6 +1187,16 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int qcow2_get_cache_stats(BlockDriverState *bs, BlockCacheStats *bcs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &bcs->l2_hits, &bcs->l2_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache, &bcs->refcount_hits,
+                          &bcs->refcount_misses);
+    return 0;
+}
+
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
@@ -1257,6 +1314,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
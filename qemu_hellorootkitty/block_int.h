@@ -44,6 +44,28 @@
 #define BLOCK_OPT_PREALLOC      "preallocation"
 #define BLOCK_OPT_SUBFMT        "subformat"
 
+#define BLOCK_IO_LIMIT_READ     0
+#define BLOCK_IO_LIMIT_WRITE    1
+#define BLOCK_IO_LIMIT_TOTAL    2
+
+/* Throttled requests may run ahead of the limits by this much I/O time */
+#define BLOCK_IO_BURST_NS       100000000LL
+
+/*
+ * Latency bucket i counts the requests that took from 2^(i + 9) ns up to
+ * 2^(i + 10) ns; the first and last buckets are open-ended.  Queue depth
+ * bucket i counts the requests submitted with 2^i up to 2^(i + 1) requests
+ * in flight, including themselves.
+ */
+#define BDRV_LATENCY_BUCKETS        32
+#define BDRV_LATENCY_MIN_SHIFT      10
+#define BDRV_QUEUE_DEPTH_BUCKETS    16
+
+typedef struct BlockIOLimit {
+    int64_t bps[3];
+    int64_t iops[3];
+} BlockIOLimit;
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -111,6 +133,7 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    int (*bdrv_get_cache_stats)(BlockDriverState *bs, BlockCacheStats *bcs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -190,6 +213,24 @@ struct BlockDriverState {
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
 
+    /* Per-request latency and queue depth, for all requests on this node */
+    uint64_t latency_histogram[BDRV_MAX_IOTYPE][BDRV_LATENCY_BUCKETS];
+    uint64_t queue_depth_histogram[BDRV_QUEUE_DEPTH_BUCKETS];
+    int in_flight;
+
+    /* I/O throttling: one leaky bucket per limit, holding the bytes and
+     * operations that have been let through but not yet paid for */
+    BlockIOLimit io_limits;
+    bool io_limits_enabled;
+    bool io_limits_draining;
+    CoQueue throttled_reqs;
+    QEMUTimer *block_timer;
+    double io_bucket_bytes[3];
+    double io_bucket_ops[3];
+    int64_t io_bucket_time;
+    uint64_t nr_throttled_ops;
+    uint64_t throttled_time_ns;
+
     /* Whether the disk can expand beyond total_sectors */
     int growable;
 
@@ -203,6 +244,7 @@ struct BlockDriverState {
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
     BlockErrorAction on_read_error, on_write_error;
+    uint64_t l2_cache_size, refcount_cache_size; /* 0 for driver default */
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
@@ -227,6 +269,8 @@ void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
 
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
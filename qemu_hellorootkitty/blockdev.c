@@ -15,6 +15,7 @@
 #include "qemu-config.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qmp-commands.h"
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
@@ -216,6 +217,24 @@ static int parse_block_error_action(const char *buf, int is_read)
     }
 }
 
+/* Returns the name of the first invalid limit, or NULL if they are fine */
+static const char *check_io_limits(BlockIOLimit *io_limits)
+{
+    static const char *bps_names[3] = { "bps_rd", "bps_wr", "bps" };
+    static const char *iops_names[3] = { "iops_rd", "iops_wr", "iops" };
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0) {
+            return bps_names[i];
+        }
+        if (io_limits->iops[i] < 0) {
+            return iops_names[i];
+        }
+    }
+    return NULL;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -233,6 +252,8 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     int ro = 0;
     int bdrv_flags = 0;
     int on_read_error, on_write_error;
+    uint64_t l2_cache_size, refcount_cache_size;
+    BlockIOLimit io_limits;
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
@@ -379,6 +400,24 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+
+    /* disk I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+        qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+        qemu_opt_get_number(opts, "iops_wr", 0);
+    if ((buf = check_io_limits(&io_limits)) != NULL) {
+        error_report("%s must be a positive number of bytes or operations "
+                     "per second, or 0 for no limit", buf);
+        return NULL;
+    }
+
     if ((devaddr = qemu_opt_get(opts, "addr")) != NULL) {
         if (type != IF_VIRTIO) {
             error_report("addr is not supported by this bus type");
@@ -459,6 +498,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_metadata_cache_size(dinfo->bdrv, l2_cache_size,
+                                 refcount_cache_size);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
     switch(type) {
     case IF_IDE:
@@ -603,7 +645,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -729,7 +771,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -776,3 +818,34 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
+                               int64_t bps_wr, int64_t iops, int64_t iops_rd,
+                               int64_t iops_wr, Error **errp)
+{
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+    const char *invalid;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = bps_rd;
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = iops;
+    io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] = iops_wr;
+
+    invalid = check_io_limits(&io_limits);
+    if (invalid) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, invalid,
+                  "a value of 0 or greater");
+        return;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+}
@@ -16,12 +16,14 @@
 #include "qemu-timer.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
+#include "iov.h"
 
 //#define DEBUG_BUFFERED_FILE
 
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev_buffer;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -168,6 +170,72 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
     return offset;
 }
 
+/*
+ * Write the vector straight from the caller's buffers, which include guest
+ * pages queued by qemu_put_buffer_async.  The rate limit only accounts the
+ * bytes: the producer stops once it is exceeded, so the data is not held
+ * back here.  Only what the backend does not accept is copied, because
+ * the caller reuses or releases its buffers when this returns.
+ */
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    ssize_t ret;
+    int error;
+
+    DPRINTF("putting %zu bytes in %d element(s) at %" PRId64 "\n",
+            size, iovcnt, pos);
+
+    error = qemu_file_get_error(s->file);
+    if (error) {
+        DPRINTF("flush when error, bailing: %s\n", strerror(-error));
+        return error;
+    }
+
+    DPRINTF("unfreezing output\n");
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    /* data buffered earlier goes first */
+    while (!s->freeze_output && s->buffer_size == 0 && iovcnt > 0) {
+        ret = s->writev_buffer(s->opaque, iov, iovcnt);
+        if (ret == -EAGAIN) {
+            DPRINTF("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            break;
+        }
+
+        if (ret <= 0) {
+            DPRINTF("error putting\n");
+            qemu_file_set_error(s->file, ret);
+            return -EINVAL;
+        }
+
+        DPRINTF("put %zd byte(s)\n", ret);
+        s->bytes_xfer += ret;
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (ret > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    for (; iovcnt > 0; iov++, iovcnt--) {
+        DPRINTF("buffering %zu bytes\n", iov->iov_len);
+        buffered_append(s, iov->iov_base, iov->iov_len);
+    }
+
+    return size;
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -263,6 +331,7 @@ static void buffered_rate_tick(void *opaque)
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev_buffer,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -274,6 +343,7 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
     s->put_buffer = put_buffer;
+    s->writev_buffer = writev_buffer;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -281,7 +351,8 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
-			     buffered_get_rate_limit);
+			     buffered_get_rate_limit,
+                             writev_buffer ? buffered_writev_buffer : NULL);
 
     s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
 
@@ -0,0 +1,224 @@
+/*
+ * QHT unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "qht.h"
+
+#define N 1000
+
+static int values[N];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    return obj == userp;
+}
+
+static void *lookup(QHT *ht, int i, uint32_t hash)
+{
+    return qht_lookup(ht, is_equal, &values[i], hash);
+}
+
+static void count_entry(void *obj, uint32_t hash, void *opaque)
+{
+    int *count = opaque;
+
+    fail_unless(*(int *)obj % 7 == hash);
+    (*count)++;
+}
+
+/*
+ * Public Interface test-cases
+ */
+
+START_TEST(qht_insert_lookup_test)
+{
+    QHT ht;
+    int i;
+
+    qht_init(&ht, N);
+    for (i = 0; i < N; i++) {
+        fail_unless(lookup(&ht, i, i) == NULL);
+        fail_unless(qht_insert(&ht, &values[i], i));
+    }
+    fail_unless(ht.n_entries == N);
+
+    for (i = 0; i < N; i++) {
+        fail_unless(lookup(&ht, i, i) == &values[i]);
+        /* the same pointer with a different hash is not found */
+        fail_unless(lookup(&ht, i, i + N) == NULL);
+        /* nor is inserted twice */
+        fail_unless(!qht_insert(&ht, &values[i], i));
+    }
+    fail_unless(ht.n_entries == N);
+
+    qht_destroy(&ht);
+}
+END_TEST
+
+START_TEST(qht_remove_test)
+{
+    QHT ht;
+    int i;
+
+    qht_init(&ht, N);
+    for (i = 0; i < N; i++) {
+        qht_insert(&ht, &values[i], i);
+    }
+
+    for (i = 0; i < N; i += 2) {
+        fail_unless(qht_remove(&ht, &values[i], i));
+    }
+    fail_unless(ht.n_entries == N / 2);
+
+    for (i = 0; i < N; i++) {
+        if (i % 2) {
+            fail_unless(lookup(&ht, i, i) == &values[i]);
+        } else {
+            fail_unless(lookup(&ht, i, i) == NULL);
+            fail_unless(!qht_remove(&ht, &values[i], i));
+        }
+    }
+
+    /* a removed entry can be inserted again */
+    fail_unless(qht_insert(&ht, &values[0], 0));
+    fail_unless(lookup(&ht, 0, 0) == &values[0]);
+
+    qht_destroy(&ht);
+}
+END_TEST
+
+START_TEST(qht_collision_test)
+{
+    QHT ht;
+    QHTStats stats;
+    int i, j;
+
+    /* all the entries land in one chain of overflow buckets */
+    qht_init(&ht, N);
+    for (i = 0; i < 64; i++) {
+        fail_unless(qht_insert(&ht, &values[i], 42));
+    }
+    qht_statistics(&ht, &stats);
+    fail_unless(stats.used_head_buckets == 1);
+    fail_unless(stats.max_chain > 1);
+    fail_unless(stats.entries == 64);
+
+    /* remove from the head, the middle and the tail of the chain */
+    for (i = 0; i < 64; i += 3) {
+        fail_unless(qht_remove(&ht, &values[i], 42));
+        for (j = 0; j < 64; j++) {
+            if (j <= i && j % 3 == 0) {
+                fail_unless(lookup(&ht, j, 42) == NULL);
+            } else {
+                fail_unless(lookup(&ht, j, 42) == &values[j]);
+            }
+        }
+    }
+    for (i = 63; i >= 0; i--) {
+        qht_remove(&ht, &values[i], 42);
+    }
+    fail_unless(ht.n_entries == 0);
+    qht_statistics(&ht, &stats);
+    fail_unless(stats.entries == 0);
+
+    qht_destroy(&ht);
+}
+END_TEST
+
+START_TEST(qht_grow_test)
+{
+    QHT ht;
+    QHTStats stats;
+    size_t head_buckets;
+    int i, count = 0;
+
+    qht_init(&ht, 1);
+    qht_statistics(&ht, &stats);
+    head_buckets = stats.head_buckets;
+
+    for (i = 0; i < N; i++) {
+        values[i] = i;
+        fail_unless(qht_insert(&ht, &values[i], i % 7));
+    }
+    qht_statistics(&ht, &stats);
+    fail_unless(stats.head_buckets > head_buckets);
+    fail_unless(stats.entries == N);
+
+    for (i = 0; i < N; i++) {
+        fail_unless(lookup(&ht, i, i % 7) == &values[i]);
+    }
+    qht_iter(&ht, count_entry, &count);
+    fail_unless(count == N);
+
+    /* entries inserted before the resize can still be removed */
+    for (i = 0; i < N; i++) {
+        fail_unless(qht_remove(&ht, &values[i], i % 7));
+        fail_unless(lookup(&ht, i, i % 7) == NULL);
+    }
+    fail_unless(ht.n_entries == 0);
+
+    qht_destroy(&ht);
+}
+END_TEST
+
+START_TEST(qht_reset_test)
+{
+    QHT ht;
+    int i;
+
+    qht_init(&ht, 1);
+    for (i = 0; i < N; i++) {
+        qht_insert(&ht, &values[i], i);
+    }
+    qht_reset(&ht);
+    fail_unless(ht.n_entries == 0);
+    for (i = 0; i < N; i++) {
+        fail_unless(lookup(&ht, i, i) == NULL);
+    }
+
+    fail_unless(qht_insert(&ht, &values[1], 1));
+    fail_unless(lookup(&ht, 1, 1) == &values[1]);
+
+    qht_destroy(&ht);
+}
+END_TEST
+
+static Suite *qht_suite(void)
+{
+    Suite *s;
+    TCase *qht_public_tcase;
+
+    s = suite_create("QHT test-suite");
+
+    qht_public_tcase = tcase_create("Public Interface");
+    suite_add_tcase(s, qht_public_tcase);
+    tcase_add_test(qht_public_tcase, qht_insert_lookup_test);
+    tcase_add_test(qht_public_tcase, qht_remove_test);
+    tcase_add_test(qht_public_tcase, qht_collision_test);
+    tcase_add_test(qht_public_tcase, qht_grow_test);
+    tcase_add_test(qht_public_tcase, qht_reset_test);
+
+    return s;
+}
+
+int main(void)
+{
+    int nf;
+    Suite *s;
+    SRunner *sr;
+
+    s = qht_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,285 @@
+/*
+ * XBZRLE and page cache unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+#include "page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* Encode new against old, decode into a copy of old and compare with new */
+static int round_trip(const uint8_t *old_buf, const uint8_t *new_buf, int len)
+{
+    uint8_t *enc = g_malloc(len);
+    uint8_t *dec = g_malloc(len);
+    int elen, dlen;
+
+    elen = xbzrle_encode_buffer(old_buf, new_buf, len, enc, len);
+    fail_unless(elen >= 0);
+    memcpy(dec, old_buf, len);
+    dlen = xbzrle_decode_buffer(enc, elen, dec, len);
+    fail_unless(dlen >= 0 && dlen <= len);
+    fail_unless(memcmp(dec, new_buf, len) == 0);
+
+    g_free(enc);
+    g_free(dec);
+    return elen;
+}
+
+/*
+ * XBZRLE test-cases
+ */
+
+START_TEST(xbzrle_identical_test)
+{
+    uint8_t *buf = g_malloc0(PAGE_SIZE);
+    uint8_t enc[16], dec[16];
+
+    memset(buf, 0x5a, PAGE_SIZE);
+    fail_unless(xbzrle_encode_buffer(buf, buf, PAGE_SIZE, enc,
+                                     sizeof(enc)) == 0);
+
+    /* an empty encoding leaves the page alone */
+    memset(dec, 0xa5, sizeof(dec));
+    fail_unless(xbzrle_decode_buffer(enc, 0, dec, sizeof(dec)) == 0);
+    fail_unless(dec[0] == 0xa5 && dec[15] == 0xa5);
+
+    g_free(buf);
+}
+END_TEST
+
+START_TEST(xbzrle_round_trip_test)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE + 1);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE + 1);
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = i * 7;
+    }
+
+    /* first byte, last byte */
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    new_buf[0] ^= 1;
+    fail_unless(round_trip(old_buf, new_buf, PAGE_SIZE) == 3);
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    new_buf[PAGE_SIZE - 1] ^= 1;
+    fail_unless(round_trip(old_buf, new_buf, PAGE_SIZE) == 4);
+
+    /* runs longer than 127 bytes need two-byte lengths */
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    memset(new_buf + 1000, 0, 300);
+    round_trip(old_buf, new_buf, PAGE_SIZE);
+
+    /* scattered changes */
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    for (i = 3; i < PAGE_SIZE; i += 97) {
+        new_buf[i] = ~old_buf[i];
+    }
+    round_trip(old_buf, new_buf, PAGE_SIZE);
+
+    /* buffers that are not word aligned */
+    memcpy(new_buf + 1, old_buf, PAGE_SIZE);
+    memmove(old_buf + 1, old_buf, PAGE_SIZE);
+    new_buf[1 + 17] ^= 0xff;
+    new_buf[1 + 2000] ^= 0xff;
+    round_trip(old_buf + 1, new_buf + 1, PAGE_SIZE);
+
+    g_free(old_buf);
+    g_free(new_buf);
+}
+END_TEST
+
+START_TEST(xbzrle_overflow_test)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *enc = g_malloc(PAGE_SIZE);
+    int i;
+
+    /* every other byte changed: 3 bytes of encoding per changed byte */
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        new_buf[i] = 1;
+    }
+    fail_unless(xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, enc,
+                                     PAGE_SIZE) == -1);
+
+    /* one change that does not fit in a small buffer */
+    memset(new_buf, 0, PAGE_SIZE);
+    memset(new_buf + 100, 1, 64);
+    fail_unless(xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, enc,
+                                     32) == -1);
+    fail_unless(xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, enc,
+                                     PAGE_SIZE) == 2 + 64);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(enc);
+}
+END_TEST
+
+START_TEST(xbzrle_decode_error_test)
+{
+    uint8_t dst[PAGE_SIZE];
+    /* zero run of 16, non-zero run of 2 */
+    uint8_t ok[] = { 0x10, 0x02, 0xaa, 0xbb };
+    /* the zero run length is cut in the middle */
+    uint8_t truncated[] = { 0x80 };
+    /* zero run of 5000 > PAGE_SIZE */
+    uint8_t zero_run[] = { 0x88, 0x27, 0x01, 0x00 };
+    /* non-zero run of 4 with only 2 bytes of data */
+    uint8_t short_data[] = { 0x00, 0x04, 0xaa, 0xbb };
+    /* non-zero run that goes past the end of the page */
+    uint8_t long_run[] = { 0x0f, 0x02, 0xaa, 0xbb };
+
+    memset(dst, 0, sizeof(dst));
+    fail_unless(xbzrle_decode_buffer(ok, sizeof(ok), dst, PAGE_SIZE) == 18);
+    fail_unless(dst[16] == 0xaa && dst[17] == 0xbb && dst[18] == 0);
+
+    fail_unless(xbzrle_decode_buffer(truncated, sizeof(truncated), dst,
+                                     PAGE_SIZE) == -1);
+    /* the non-zero run length is missing */
+    fail_unless(xbzrle_decode_buffer(ok, 1, dst, PAGE_SIZE) == -1);
+    fail_unless(xbzrle_decode_buffer(zero_run, sizeof(zero_run), dst,
+                                     PAGE_SIZE) == -1);
+    fail_unless(xbzrle_decode_buffer(short_data, sizeof(short_data), dst,
+                                     PAGE_SIZE) == -1);
+    fail_unless(xbzrle_decode_buffer(long_run, sizeof(long_run), dst,
+                                     16) == -1);
+}
+END_TEST
+
+/*
+ * Page cache test-cases
+ */
+
+static uint8_t *make_page(uint8_t *page, int val)
+{
+    memset(page, val, PAGE_SIZE);
+    return page;
+}
+
+START_TEST(cache_lru_test)
+{
+    PageCache *cache;
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+    uint64_t addr;
+
+    fail_unless(cache_init(0, PAGE_SIZE) == NULL);
+
+    cache = cache_init(4, PAGE_SIZE);
+    fail_unless(cache_max_num_items(cache) == 4);
+    for (addr = 0; addr < 4; addr++) {
+        cache_insert(cache, addr * PAGE_SIZE, make_page(page, addr));
+    }
+    fail_unless(cache_lookup(cache, 4 * PAGE_SIZE) == NULL);
+
+    /* page 0 becomes the most recently used, page 1 is evicted */
+    data = cache_lookup(cache, 0);
+    fail_unless(data != NULL && data[0] == 0 && data[PAGE_SIZE - 1] == 0);
+    cache_insert(cache, 4 * PAGE_SIZE, make_page(page, 4));
+    fail_unless(cache_lookup(cache, 1 * PAGE_SIZE) == NULL);
+    for (addr = 0; addr < 5; addr++) {
+        if (addr != 1) {
+            data = cache_lookup(cache, addr * PAGE_SIZE);
+            fail_unless(data != NULL && data[0] == addr);
+        }
+    }
+
+    /* inserting a cached page updates it in place */
+    data = cache_insert(cache, 2 * PAGE_SIZE, make_page(page, 0x22));
+    fail_unless(cache_lookup(cache, 2 * PAGE_SIZE) == data);
+    fail_unless(data[0] == 0x22);
+    for (addr = 0; addr < 5; addr++) {
+        fail_unless((cache_lookup(cache, addr * PAGE_SIZE) == NULL) ==
+                    (addr == 1));
+    }
+
+    cache_fini(cache);
+}
+END_TEST
+
+START_TEST(cache_resize_test)
+{
+    PageCache *cache;
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+    uint64_t addr;
+
+    cache = cache_init(8, PAGE_SIZE);
+    for (addr = 0; addr < 8; addr++) {
+        cache_insert(cache, addr * PAGE_SIZE, make_page(page, addr));
+    }
+    cache_lookup(cache, 0);
+
+    /* growing keeps everything */
+    cache = cache_resize(cache, 16);
+    fail_unless(cache_max_num_items(cache) == 16);
+    for (addr = 0; addr < 8; addr++) {
+        data = cache_lookup(cache, addr * PAGE_SIZE);
+        fail_unless(data != NULL && data[PAGE_SIZE - 1] == addr);
+    }
+
+    /* shrinking keeps the most recently used pages: 4..7 */
+    cache = cache_resize(cache, 4);
+    fail_unless(cache_max_num_items(cache) == 4);
+    for (addr = 0; addr < 8; addr++) {
+        data = cache_lookup(cache, addr * PAGE_SIZE);
+        if (addr < 4) {
+            fail_unless(data == NULL);
+        } else {
+            fail_unless(data != NULL && data[0] == addr);
+        }
+    }
+
+    /* an invalid size leaves the cache alone */
+    fail_unless(cache_resize(cache, 0) == cache);
+
+    cache_fini(cache);
+}
+END_TEST
+
+static Suite *xbzrle_suite(void)
+{
+    Suite *s;
+    TCase *xbzrle_tcase, *cache_tcase;
+
+    s = suite_create("XBZRLE test-suite");
+
+    xbzrle_tcase = tcase_create("XBZRLE");
+    suite_add_tcase(s, xbzrle_tcase);
+    tcase_add_test(xbzrle_tcase, xbzrle_identical_test);
+    tcase_add_test(xbzrle_tcase, xbzrle_round_trip_test);
+    tcase_add_test(xbzrle_tcase, xbzrle_overflow_test);
+    tcase_add_test(xbzrle_tcase, xbzrle_decode_error_test);
+
+    cache_tcase = tcase_create("Page cache");
+    suite_add_tcase(s, cache_tcase);
+    tcase_add_test(cache_tcase, cache_lru_test);
+    tcase_add_test(cache_tcase, cache_resize_test);
+
+    return s;
+}
+
+int main(void)
+{
+    int nf;
+    Suite *s;
+    SRunner *sr;
+
+    s = xbzrle_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -516,6 +516,7 @@ extern int mem_prealloc;
 
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
+#define SNAPSHOT_DIRTY_FLAG  0x04
 #define MIGRATION_DIRTY_FLAG 0x08
 
 /* read dirty bit (return 0 or 1) */
@@ -547,10 +548,11 @@ static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
+                                                        ram_addr_t length,
                                                         int dirty_flags)
 {
-    int i, mask, len;
+    ram_addr_t i, len;
+    int mask;
     uint8_t *p;
 
     len = length >> TARGET_PAGE_BITS;
@@ -563,6 +565,7 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_reset_dirty_tlb(ram_addr_t start, ram_addr_t end);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -579,6 +582,8 @@ int cpu_physical_log_stop(target_phys_addr_t start_addr,
                           ram_addr_t size);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int count);
+void tb_profile_enable(bool enable);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
@@ -82,6 +82,24 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+/* The x86 TCG backend loads the index mask from env->tlb_mask, so on
+   those hosts the TLB is resized between CPU_TLB_MIN_BITS and
+   CPU_TLB_MAX_BITS at flush time, starting at CPU_TLB_BITS.  Other
+   backends bake the mask into generated code and keep a fixed size.  */
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_TLB_DYNAMIC
+#define CPU_TLB_MIN_BITS 6
+#define CPU_TLB_MAX_BITS 10
+#else
+#define CPU_TLB_MIN_BITS CPU_TLB_BITS
+#define CPU_TLB_MAX_BITS CPU_TLB_BITS
+#endif
+#define CPU_TLB_MIN_SIZE (1 << CPU_TLB_MIN_BITS)
+#define CPU_TLB_MAX_SIZE (1 << CPU_TLB_MAX_BITS)
+
+/* Small fully associative TLB holding recently evicted entries.  */
+#define CPU_VTLB_SIZE 8
+
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
 #else
@@ -110,16 +128,32 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+#define tlb_size(env) (((env)->tlb_mask >> CPU_TLB_ENTRY_BITS) + 1)
+#define tlb_index(env, addr) \
+    (((addr) >> TARGET_PAGE_BITS) & ((env)->tlb_mask >> CPU_TLB_ENTRY_BITS))
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
-    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_MAX_SIZE];              \
+    target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_MAX_SIZE];           \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index;
+
+/* Preserved by CPU reset, which only clears the entries themselves */
+#define CPU_COMMON_TLB_SIZE \
+    /* (size - 1) << CPU_TLB_ENTRY_BITS for the current TLB size */     \
+    unsigned long tlb_mask;                                             \
+    /* fills since the last flush, drives the resizing policy */        \
+    unsigned int tlb_misses;                                            \
+    unsigned int tlb_quiet_flushes;
 
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_SIZE
 
 #endif
 
@@ -187,6 +221,8 @@ typedef struct CPUWatchpoint {
     QTAILQ_HEAD(breakpoints_head, CPUBreakpoint) breakpoints;            \
     int singlestep_enabled;                                             \
                                                                         \
+    CPU_COMMON_TLB_SIZE                                                 \
+                                                                        \
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;            \
     CPUWatchpoint *watchpoint_hit;                                      \
                                                                         \
@@ -202,7 +238,8 @@ typedef struct CPUWatchpoint {
     int numa_node; /* NUMA node this cpu is belonging to  */            \
     int nr_cores;  /* number of cores within this CPU package */        \
     int nr_threads;/* number of threads within this CPU */              \
-    int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    int running; /* Nonzero if cpu is currently running (usermode and   \
+                    multi-threaded TCG).  */                            \
     int thread_id;                                                      \
     /* user data */                                                     \
     void *opaque;                                                       \
@@ -213,6 +250,7 @@ typedef struct CPUWatchpoint {
     struct QemuThread *thread;                                          \
     struct QemuCond *halt_cond;                                         \
     int thread_kicked;                                                  \
+    int throttle_pending; /* Sleep requested by the vCPU throttle */    \
     struct qemu_work_item *queued_work_first, *queued_work_last;        \
     const char *cpu_model_str;                                          \
     struct KVMState *kvm_state;                                         \
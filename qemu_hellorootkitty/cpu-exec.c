@@ -21,6 +21,10 @@
 #include "disas.h"
 #include "tcg.h"
 #include "qemu-barrier.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "main-loop.h"
+#include "tb-cache.h"
+#endif
 
 int tb_invalidated_flag;
 
@@ -79,57 +83,67 @@ static void cpu_exec_nocache(CPUState *env, int max_cycles,
     tb_free(tb);
 }
 
+typedef struct TBLookupDesc {
+    CPUState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+} TBLookupDesc;
+
+static bool tb_lookup_cmp(const void *p, const void *userp)
+{
+    const TranslationBlock *tb = p;
+    const TBLookupDesc *desc = userp;
+    tb_page_addr_t phys_page2;
+    target_ulong virt_page2;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        }
+        virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+        phys_page2 = get_page_addr_code(desc->env, virt_page2);
+        return tb->page_addr[1] == phys_page2;
+    }
+    return false;
+}
+
 static TranslationBlock *tb_find_slow(CPUState *env,
                                       target_ulong pc,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
+    TBLookupDesc desc;
+    tb_page_addr_t phys_pc;
 
     tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
     phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
-        }
-        ptb1 = &tb->phys_hash_next;
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    tb = qht_lookup(&tb_htable, tb_lookup_cmp, &desc,
+                    tb_hash_func(phys_pc, pc, cs_base, flags));
+#if !defined(CONFIG_USER_ONLY)
+    if (!tb) {
+        /* code saved by a previous run, if the guest code is unchanged */
+        tb = tb_cache_lookup(env, pc, cs_base, flags, phys_pc);
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+#endif
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
     }
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -177,6 +191,26 @@ static void cpu_handle_debug_exception(CPUState *env)
     }
 }
 
+/* With multi-threaded TCG, interrupt delivery runs under the iothread
+   mutex because it talks to the (emulated) interrupt controllers.  */
+static inline void cpu_exec_lock_iothread(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        qemu_mutex_lock_iothread();
+    }
+#endif
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -262,8 +296,15 @@ int cpu_exec(CPUState *env)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+                if (mttcg_enabled) {
+                    /* cpu_exit() from another thread sets this before
+                       exit_request; see gen_icount_start().  */
+                    env->icount_decr.u16.high = 0;
+                    smp_mb();
+                }
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -505,6 +546,7 @@ int cpu_exec(CPUState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -531,6 +573,7 @@ int cpu_exec(CPUState *env)
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
                 spin_lock(&tb_lock);
+                tb_mt_lock();
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -546,12 +589,34 @@ int cpu_exec(CPUState *env)
                              (long)tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
+                if (tcg_superblocks_enabled && next_tb != 0 &&
+                    (next_tb & 3) < 2) {
+                    switch (tb_profile_jump(env,
+                                            (TranslationBlock *)(next_tb & ~3),
+                                            next_tb & 3, tb)) {
+                    case TB_PROFILE_COUNT:
+                        next_tb = 0;
+                        break;
+                    case TB_PROFILE_FORMED:
+                        /* tb may have been freed to make room */
+                        tb = tb_find_fast(env);
+                        tb_invalidated_flag = 0;
+                        next_tb = 0;
+                        break;
+                    }
+                }
+                if (unlikely(tb_profile_enabled)) {
+                    /* keep coming back here to count every execution */
+                    tb->exec_count++;
+                    next_tb = 0;
+                }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
                     tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
                 }
+                tb_mt_unlock();
                 spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
@@ -564,7 +629,12 @@ int cpu_exec(CPUState *env)
                     tc_ptr = tb->tc_ptr;
                 /* execute the generated code */
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
-                    if ((next_tb & 3) == 2) {
+                    if ((next_tb & 3) == 2 && mttcg_enabled) {
+                        /* Exit requested before the TB started.  */
+                        tb = (TranslationBlock *)(long)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        next_tb = 0;
+                    } else if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(long)(next_tb & ~3);
@@ -600,6 +670,7 @@ int cpu_exec(CPUState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            cpu_mt_unwind();
         }
     } /* for(;;) */
 
@@ -34,6 +34,7 @@
 
 #include "qemu-thread.h"
 #include "cpus.h"
+#include "tcg.h"
 #include "main-loop.h"
 
 #ifndef _WIN32
@@ -308,6 +309,15 @@ void configure_icount(const char *option)
     if (!option) {
         return;
     }
+    if (mttcg_enabled) {
+        fprintf(stderr, "-icount is not supported with tcg_threads=multi\n");
+        exit(1);
+    }
+    if (tcg_superblocks_enabled) {
+        /* cpu_io_recompile() would retranslate a superblock linearly */
+        fprintf(stderr, "-icount is not supported with tcg_superblocks\n");
+        exit(1);
+    }
 
     icount_warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
     if (strcmp(option, "auto") != 0) {
@@ -335,6 +345,63 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+void configure_tcg_threads(const char *option)
+{
+    if (!option || !strcmp(option, "single")) {
+        return;
+    }
+    if (strcmp(option, "multi") != 0) {
+        fprintf(stderr, "qemu: invalid tcg_threads option '%s'\n", option);
+        exit(1);
+    }
+    /* Needs real thread-local storage, an x86 host to patch jumps
+       atomically and a target whose atomic instructions go through
+       cpu_mt_atomic_lock.  */
+#if defined(__linux__) && (defined(__i386__) || defined(__x86_64__)) && \
+    defined(TARGET_I386)
+    mttcg_enabled = true;
+#else
+    fprintf(stderr, "qemu: tcg_threads=multi is not supported "
+            "for this host and target\n");
+    exit(1);
+#endif
+}
+
+void configure_tcg_superblocks(bool enable)
+{
+    if (!enable) {
+        return;
+    }
+    /* The target translator must follow tb->sb_trace.  */
+#if defined(TARGET_I386)
+    tcg_superblocks_enabled = true;
+#else
+    fprintf(stderr, "qemu: tcg_superblocks is not supported for this "
+            "target\n");
+    exit(1);
+#endif
+}
+
+void configure_tcg_pinned_globals(const char *option)
+{
+    if (!option || !*option) {
+        return;
+    }
+    if (tcg_pin_globals(&tcg_ctx, option) < 0) {
+        fprintf(stderr, "qemu: at most %d TCG globals can be pinned "
+                "on this host\n", TCG_TARGET_NB_PIN_REGS);
+        exit(1);
+    }
+}
+
+/* The globals are created with the first CPU.  */
+void check_tcg_pinned_globals(void)
+{
+    if (tcg_check_pinned_globals(&tcg_ctx) > 0) {
+        exit(1);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -396,7 +463,7 @@ static void do_vm_stop(RunState state)
         pause_all_vcpus();
         runstate_set(state);
         vm_state_notify(0, state);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
@@ -603,6 +670,7 @@ static void qemu_tcg_init_cpu_signals(void)
 QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
@@ -615,6 +683,14 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Exclusive sections for multi-threaded TCG, see
+   qemu_tcg_start_exclusive.  Protected by qemu_global_mutex.  */
+static bool tcg_exclusive_pending;
+static int tcg_exclusive_running;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume_cond;
+static DEFINE_TLS(bool, tcg_in_exclusive);
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -622,6 +698,8 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
@@ -673,6 +751,88 @@ static void flush_queued_work(CPUState *env)
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+/* vCPU throttling */
+
+/* A throttled vCPU runs for a timeslice, then sleeps long enough for the
+   requested percentage of the time.  */
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_sleep(CPUState *env)
+{
+    double pct = throttle_percentage / 100.0;
+    int64_t sleep_ns;
+
+    if (pct > 0 && !env->stopped) {
+        sleep_ns = pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS;
+        qemu_mutex_unlock(&qemu_global_mutex);
+        usleep(sleep_ns / 1000);
+        qemu_mutex_lock(&qemu_global_mutex);
+    }
+    env->throttle_pending = 0;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (!env->throttle_pending) {
+            env->throttle_pending = 1;
+            qemu_cpu_kick(env);
+        }
+        /* a single thread runs every vCPU, make it sleep only once */
+        if (!kvm_enabled() && !mttcg_enabled) {
+            break;
+        }
+    }
+    pct = throttle_percentage / 100.0;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    bool start = !throttle_percentage;
+
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    throttle_percentage = new_throttle_pct;
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    if (start) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void qemu_wait_io_event_common(CPUState *env)
 {
     if (env->stop) {
@@ -680,6 +840,9 @@ static void qemu_wait_io_event_common(CPUState *env)
         env->stopped = 1;
         qemu_cond_signal(&qemu_pause_cond);
     }
+    if (env->throttle_pending) {
+        cpu_throttle_sleep(env);
+    }
     flush_queued_work(env);
     env->thread_kicked = false;
 }
@@ -720,6 +883,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    get_tls(iothread_locked) = true;
     qemu_thread_get_self(env->thread);
     env->thread_id = qemu_get_thread_id();
 
@@ -759,6 +923,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* signal CPU creation */
     qemu_mutex_lock(&qemu_global_mutex);
+    get_tls(iothread_locked) = true;
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         env->thread_id = qemu_get_thread_id();
         env->created = 1;
@@ -781,6 +946,104 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* With tcg_threads=multi, each VCPU thread executes guest code without
+   qemu_global_mutex.  Operations that must not race with translated
+   code, such as tb_flush, are done in an exclusive section: it waits
+   until every VCPU has left cpu_exec() and keeps them out until
+   qemu_tcg_end_exclusive.  Must be called with qemu_global_mutex held
+   and outside cpu_exec().  */
+void qemu_tcg_start_exclusive(void)
+{
+    CPUState *env;
+
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume_cond, &qemu_global_mutex);
+    }
+    tcg_exclusive_pending = true;
+    tcg_exclusive_running = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->running) {
+            tcg_exclusive_running++;
+            cpu_exit(env);
+        }
+    }
+    while (tcg_exclusive_running > 0) {
+        qemu_cond_wait(&tcg_exclusive_cond, &qemu_global_mutex);
+    }
+    get_tls(tcg_in_exclusive) = true;
+}
+
+void qemu_tcg_end_exclusive(void)
+{
+    get_tls(tcg_in_exclusive) = false;
+    tcg_exclusive_pending = false;
+    qemu_cond_broadcast(&tcg_exclusive_resume_cond);
+}
+
+bool qemu_tcg_in_exclusive(void)
+{
+    return get_tls(tcg_in_exclusive);
+}
+
+static void qemu_tcg_mt_exec_start(CPUState *env)
+{
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_resume_cond, &qemu_global_mutex);
+    }
+    env->running = 1;
+}
+
+static void qemu_tcg_mt_exec_end(CPUState *env)
+{
+    env->running = 0;
+    if (tcg_exclusive_pending && --tcg_exclusive_running == 0) {
+        qemu_cond_signal(&tcg_exclusive_cond);
+    }
+}
+
+static void qemu_tcg_mt_wait_io_event(CPUState *env)
+{
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(env->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(env);
+}
+
+static int tcg_cpu_exec(CPUState *env);
+
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *env = arg;
+    int r;
+
+    qemu_mutex_lock(&qemu_global_mutex);
+    get_tls(iothread_locked) = true;
+    qemu_thread_get_self(env->thread);
+    env->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    env->created = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(env)) {
+            qemu_tcg_mt_exec_start(env);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            qemu_tcg_mt_exec_end(env);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+            tb_flush_if_pending(env);
+        }
+        qemu_tcg_mt_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *env)
 {
 #ifndef _WIN32
@@ -809,6 +1072,9 @@ void qemu_cpu_kick(void *_env)
         qemu_cpu_kick_thread(env);
         env->thread_kicked = true;
     }
+    if (mttcg_enabled) {
+        cpu_exit(env);
+    }
 }
 
 void qemu_cpu_kick_self(void)
@@ -834,7 +1100,7 @@ int qemu_cpu_is_self(void *_env)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (kvm_enabled()) {
+    if (kvm_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -845,13 +1111,20 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    get_tls(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    get_tls(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return get_tls(iothread_locked);
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *penv = first_cpu;
@@ -921,6 +1194,17 @@ static void qemu_tcg_init_vcpu(void *_env)
     }
 }
 
+static void qemu_tcg_mt_start_vcpu(CPUState *env)
+{
+    env->thread = g_malloc0(sizeof(QemuThread));
+    env->halt_cond = g_malloc0(sizeof(QemuCond));
+    qemu_cond_init(env->halt_cond);
+    qemu_thread_create(env->thread, qemu_tcg_mt_cpu_thread_fn, env);
+    while (env->created == 0) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_kvm_start_vcpu(CPUState *env)
 {
     env->thread = g_malloc0(sizeof(QemuThread));
@@ -941,6 +1225,8 @@ void qemu_init_vcpu(void *_env)
     env->stopped = 1;
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
+    } else if (mttcg_enabled) {
+        qemu_tcg_mt_start_vcpu(env);
     } else {
         qemu_tcg_init_vcpu(env);
     }
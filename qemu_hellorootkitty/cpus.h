@@ -6,6 +6,18 @@ void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
+void qemu_tcg_start_exclusive(void);
+void qemu_tcg_end_exclusive(void);
+bool qemu_tcg_in_exclusive(void);
+
+/* Bounds of the share of the time a throttled vCPU spends sleeping */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
 
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
@@ -24,6 +24,9 @@
 #include "qemu-common.h"
 #include "host-utils.h"
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
@@ -416,6 +419,160 @@ int64_t strtosz(const char *nptr, char **end)
     return strtosz_suffix(nptr, end, STRTOSZ_DEFSUFFIX_MB);
 }
 
+/*
+ * Checks whether a buffer is filled with a single byte value.  This is
+ * called on every page sent during migration and on every cluster read
+ * by qemu-img convert, and most buffers that are not filled differ from
+ * the fill value in their first bytes, so those are checked first.  The
+ * rest is scanned with the widest vectors available, several of them
+ * per iteration so that the loads overlap.
+ */
+
+static bool buffer_is_filled_scalar(const void *buf, size_t len, uint8_t c)
+{
+    const unsigned long *p = buf;
+    const unsigned long val = c * (~0UL / 0xff);
+    const uint8_t *tail;
+    size_t i, n = len / sizeof(unsigned long);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        if ((p[i] ^ val) | (p[i + 1] ^ val) |
+            (p[i + 2] ^ val) | (p[i + 3] ^ val)) {
+            return false;
+        }
+    }
+    tail = (const uint8_t *)(p + i);
+    for (i = 0; tail + i < (const uint8_t *)buf + len; i++) {
+        if (tail[i] != c) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+static bool buffer_is_filled_sse2(const void *buf, size_t len, uint8_t c)
+{
+    const __m128i *p = buf;
+    const __m128i *end = p + len / (4 * sizeof(__m128i)) * 4;
+    const __m128i val = _mm_set1_epi8(c);
+    __m128i t;
+
+    if (len < 4 * sizeof(__m128i)) {
+        return buffer_is_filled_scalar(buf, len, c);
+    }
+
+    /* early exit */
+    t = _mm_cmpeq_epi8(_mm_loadu_si128(p), val);
+    if (_mm_movemask_epi8(t) != 0xffff) {
+        return false;
+    }
+
+    for (; p < end; p += 4) {
+        t = _mm_or_si128(
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), val),
+                         _mm_xor_si128(_mm_loadu_si128(p + 1), val)),
+            _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), val),
+                         _mm_xor_si128(_mm_loadu_si128(p + 3), val)));
+        t = _mm_cmpeq_epi8(t, _mm_setzero_si128());
+        if (_mm_movemask_epi8(t) != 0xffff) {
+            return false;
+        }
+    }
+
+    return buffer_is_filled_scalar(end, (const uint8_t *)buf + len -
+                                   (const uint8_t *)end, c);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static bool buffer_is_filled_avx2(const void *buf, size_t len, uint8_t c)
+{
+    const __m256i *p = buf;
+    const __m256i *end = p + len / (4 * sizeof(__m256i)) * 4;
+    const __m256i val = _mm256_set1_epi8(c);
+    __m256i t;
+
+    if (len < 4 * sizeof(__m256i)) {
+        return buffer_is_filled_scalar(buf, len, c);
+    }
+
+    /* early exit */
+    t = _mm256_xor_si256(_mm256_loadu_si256(p), val);
+    if (!_mm256_testz_si256(t, t)) {
+        return false;
+    }
+
+    for (; p < end; p += 4) {
+        t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p), val),
+                            _mm256_xor_si256(_mm256_loadu_si256(p + 1), val)),
+            _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p + 2), val),
+                            _mm256_xor_si256(_mm256_loadu_si256(p + 3), val)));
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+
+    return buffer_is_filled_scalar(end, (const uint8_t *)buf + len -
+                                   (const uint8_t *)end, c);
+}
+
+static bool host_has_avx2(void)
+{
+    unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* the OS must save the YMM registers */
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+}
+#pragma GCC pop_options
+#endif
+
+static bool (*buffer_is_filled_fn)(const void *, size_t, uint8_t) =
+#ifdef __SSE2__
+    buffer_is_filled_sse2;
+#else
+    buffer_is_filled_scalar;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_buffer_is_filled(void)
+{
+    if (host_has_avx2()) {
+        buffer_is_filled_fn = buffer_is_filled_avx2;
+    }
+}
+#endif
+
+/* Return true if the len bytes at buf are all zero.  */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_is_filled_fn(buf, len, 0);
+}
+
+/* Return true if the len bytes at buf all have the value of the first.  */
+bool buffer_is_dup(const void *buf, size_t len)
+{
+    return len == 0 || buffer_is_filled_fn(buf, len, *(const uint8_t *)buf);
+}
+
 int qemu_parse_fd(const char *param)
 {
     int fd;
@@ -427,3 +584,39 @@ int qemu_parse_fd(const char *param)
     }
     return fd;
 }
+
+/*
+ * Encode n as unsigned LEB128 into out, which must have room for 5 bytes.
+ * Returns the number of bytes written.
+ */
+int uleb128_encode(uint8_t *out, uint32_t n)
+{
+    int i = 0;
+
+    while (n >= 0x80) {
+        out[i++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    out[i++] = n;
+    return i;
+}
+
+/*
+ * Decode an unsigned LEB128 number from the first len bytes of in.
+ * Returns the number of bytes read, or -1 if the encoding is truncated
+ * or does not fit in 32 bits.
+ */
+int uleb128_decode(const uint8_t *in, int len, uint32_t *n)
+{
+    uint32_t val = 0;
+    int i;
+
+    for (i = 0; i < len && i < 5; i++) {
+        val |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *n = val;
+            return i + 1;
+        }
+    }
+    return -1;
+}
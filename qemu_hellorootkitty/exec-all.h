@@ -21,6 +21,7 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#include "qht.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 #define DEBUG_DISAS
@@ -102,12 +103,14 @@ void tlb_flush(CPUState *env, int flush_global);
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+int tlb_victim_hit(CPUState *env, int mmu_idx, int index, size_t elt_ofs,
+                   target_ulong addr);
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial capacity of the physical TB hash table, it grows as needed */
+#define CODE_GEN_HTABLE_SIZE        (1 << 15)
 
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
 
@@ -137,8 +140,6 @@ struct TranslationBlock {
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -159,6 +160,29 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* set by tb_phys_invalidate; the TB stays allocated until its code
+       region is recycled */
+    uint8_t invalid;
+    /* loaded from the persistent TB cache and not linked yet */
+    uint8_t cache_pending;
+    /* host code relocations, only recorded with -tb-cache.  nb_relocs
+       is 0xffff if the code could not be fully described */
+    uint16_t nb_relocs;
+    uint32_t *relocs;
+    /* a superblock continues at sb_trace[i] when its i-th block jumps
+       there, instead of leaving the TB */
+    uint8_t sb_len;
+    target_ulong *sb_trace;
+    /* how often each direct jump was taken through cpu_exec() while
+       the TB was profiled, and to where */
+    uint8_t sb_profiled;
+    uint16_t exit_count[2];
+    target_ulong exit_pc[2];
+    /* collected while "tb_profile on": how often cpu_exec() entered
+       the TB, the size of its host code and how many helpers it calls */
+    uint64_t exec_count;
+    uint32_t tc_size;
+    uint16_t nb_helper_calls;
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -176,9 +200,16 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    target_ulong cs_base, uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc << 32) ^ ((uint64_t)pc >> 32);
+    h ^= (uint64_t)cs_base * 0x9e3779b97f4a7c15ULL;
+    h ^= flags * 0xc2b2ae3d27d4eb4fULL;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h >> 32;
 }
 
 void tb_free(TranslationBlock *tb);
@@ -186,8 +217,12 @@ void tb_flush(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+TranslationBlock *tb_alloc_code(target_ulong pc, int code_size);
+void tb_foreach(void (*fn)(TranslationBlock *tb, int code_size, void *opaque),
+                void *opaque);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* physical TB hash table, keyed on tb_hash_func() */
+extern QHT tb_htable;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -272,11 +307,50 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
 
 TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 
+/* longest chain of blocks translated as one superblock */
+#define TB_SUPERBLOCK_MAX_BLOCKS 4
+/* jumps through cpu_exec() before a chain is considered hot */
+#define TB_SUPERBLOCK_THRESHOLD  32
+
+/* tb_profile_jump() results */
+#define TB_PROFILE_COUNT   0   /* keep profiling, do not chain */
+#define TB_PROFILE_CHAIN   1
+#define TB_PROFILE_FORMED  2   /* a superblock replaced the source TB */
+
+int tb_profile_jump(CPUState *env, TranslationBlock *tb, int n,
+                    TranslationBlock *tb_next);
+
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
 
+#if !defined(CONFIG_USER_ONLY)
+/* With -machine tcg_threads=multi, tb_mt_lock() serializes translation
+   and TB invalidation between VCPU threads.  It nests within a thread;
+   cpu_mt_unwind() drops it (and the other locks a VCPU thread may hold
+   while executing guest code) after a longjmp to cpu_exec().  */
+void tb_mt_lock(void);
+void tb_mt_unlock(void);
+void cpu_mt_atomic_lock(void);
+void cpu_mt_atomic_unlock(void);
+void cpu_mt_unwind(void);
+void tb_flush_if_pending(CPUState *env);
+#else
+static inline void tb_mt_lock(void)
+{
+}
+
+static inline void tb_mt_unlock(void)
+{
+}
+
+static inline void cpu_mt_unwind(void)
+{
+}
+#endif
+
 extern int tb_invalidated_flag;
+extern bool tb_profile_enabled;
 
 /* The return address may point to the start of the next instruction.
    Subtracting one gets us the call instruction itself.  */
@@ -344,7 +418,7 @@ static inline tb_page_addr_t get_page_addr_code(CPUState *env1, target_ulong add
     int mmu_idx, page_index, pd;
     void *p;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    page_index = tlb_index(env1, addr);
     mmu_idx = cpu_mmu_index(env1);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
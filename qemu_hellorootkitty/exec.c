@@ -33,6 +33,7 @@
 #include "kvm.h"
 #include "hw/xen.h"
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #include "memory.h"
 #include "exec-memory.h"
 #if defined(CONFIG_USER_ONLY)
@@ -55,6 +56,11 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "qemu-thread.h"
+#include "cpus.h"
+#include "main-loop.h"
+#include "tb-cache.h"
+#include "disas.h"
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -78,8 +84,27 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+QHT tb_htable;
+
+/* The code buffer is split into regions that are filled in turn.  Once
+   the last one is full, the oldest region is recycled: only the TBs it
+   holds are invalidated, instead of flushing the whole buffer.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct CodeGenRegion {
+    uint8_t *start;
+    uint8_t *max_ptr;       /* threshold to switch to the next region */
+    uint8_t *end_ptr;       /* end of the generated code, once left */
+    TranslationBlock *tbs;  /* sorted by tc_ptr */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int code_gen_nb_regions;
+static int code_gen_region_max_blocks;
+static unsigned long code_gen_region_size;
+/* region being filled, code_gen_ptr points into it */
+static int code_gen_cur_region;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
@@ -125,6 +150,22 @@ DEFINE_TLS(CPUState *,cpu_single_env);
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
 int use_icount = 0;
+/* Run each VCPU in its own host thread (-machine tcg_threads=multi).  */
+bool mttcg_enabled;
+/* Retranslate hot chains of TBs as one (-machine tcg_superblocks=on).  */
+bool tcg_superblocks_enabled;
+bool tb_profile_enabled;
+
+#if !defined(CONFIG_USER_ONLY)
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_mutex_depth);
+/* serializes x86 LOCK-prefixed instructions between VCPU threads */
+static QemuMutex atomic_mutex;
+static DEFINE_TLS(bool, atomic_mutex_held);
+/* deferred until no VCPU is executing translated code */
+static bool tb_flush_pending;
+static bool tb_region_flush_pending;
+#endif
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -222,9 +263,13 @@ static int log_append = 0;
 /* statistics */
 #if !defined(CONFIG_USER_ONLY)
 static int tlb_flush_count;
+static int tlb_victim_hit_count;
+static int tlb_resize_count;
 #endif
 static int tb_flush_count;
+static int tb_region_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_superblock_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -459,6 +504,42 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+/* Each region keeps room for a block of maximum size past its
+   threshold, so only split buffers large enough for that to be a small
+   fraction of a region.  */
+static void code_gen_regions_init(void)
+{
+    unsigned long margin = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    CodeGenRegion *r;
+    int i;
+
+    code_gen_nb_regions = code_gen_buffer_size / (4 * margin);
+    if (code_gen_nb_regions < 1) {
+        code_gen_nb_regions = 1;
+    } else if (code_gen_nb_regions > CODE_GEN_MAX_REGIONS) {
+        code_gen_nb_regions = CODE_GEN_MAX_REGIONS;
+    }
+    code_gen_region_size = (code_gen_buffer_size / code_gen_nb_regions) &
+                           ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_blocks = code_gen_max_blocks / code_gen_nb_regions;
+
+    code_gen_buffer_max_size = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        r = &code_gen_regions[i];
+        r->start = code_gen_buffer + i * code_gen_region_size;
+        if (i == code_gen_nb_regions - 1) {
+            r->max_ptr = code_gen_buffer + code_gen_buffer_size - margin;
+        } else {
+            r->max_ptr = r->start + code_gen_region_size - margin;
+        }
+        r->end_ptr = r->start;
+        r->tbs = tbs + i * code_gen_region_max_blocks;
+        r->nb_tbs = 0;
+        code_gen_buffer_max_size += r->max_ptr - r->start;
+    }
+    code_gen_cur_region = 0;
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
 #ifdef USE_STATIC_CODE_GEN_BUFFER
@@ -558,7 +639,24 @@ static void code_gen_alloc(unsigned long tb_size)
     code_gen_buffer_max_size = code_gen_buffer_size -
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    tbs = g_malloc0(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_regions_init();
+}
+
+static inline uint8_t *code_gen_region_end(int i)
+{
+    return i == code_gen_cur_region ? code_gen_ptr
+                                    : code_gen_regions[i].end_ptr;
+}
+
+static int tb_count(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        n += code_gen_regions[i].nb_tbs;
+    }
+    return n;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -568,8 +666,13 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
+    code_gen_ptr = code_gen_regions[0].start;
+    qht_init(&tb_htable, CODE_GEN_HTABLE_SIZE);
     page_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+    qemu_mutex_init(&atomic_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -582,6 +685,55 @@ bool tcg_enabled(void)
     return code_gen_buffer != NULL;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+void tb_mt_lock(void)
+{
+    if (mttcg_enabled && get_tls(tb_mutex_depth)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tb_mt_unlock(void)
+{
+    if (mttcg_enabled && --get_tls(tb_mutex_depth) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+void cpu_mt_atomic_lock(void)
+{
+    if (mttcg_enabled) {
+        qemu_mutex_lock(&atomic_mutex);
+        get_tls(atomic_mutex_held) = true;
+    }
+}
+
+void cpu_mt_atomic_unlock(void)
+{
+    if (mttcg_enabled && get_tls(atomic_mutex_held)) {
+        get_tls(atomic_mutex_held) = false;
+        qemu_mutex_unlock(&atomic_mutex);
+    }
+}
+
+/* Called by cpu_exec() when a helper or a fault longjmp'ed out of the
+   code that took the lock.  */
+void cpu_mt_unwind(void)
+{
+    if (!mttcg_enabled) {
+        return;
+    }
+    if (get_tls(tb_mutex_depth)) {
+        get_tls(tb_mutex_depth) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+    cpu_mt_atomic_unlock();
+    if (qemu_mutex_iothread_locked()) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#endif
+
 void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
@@ -652,6 +804,7 @@ void cpu_exec_init(CPUState *env)
     QTAILQ_INIT(&env->watchpoints);
 #ifndef CONFIG_USER_ONLY
     env->thread_id = qemu_get_thread_id();
+    env->tlb_mask = (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS;
 #endif
     *penv = env;
 #if defined(CONFIG_USER_ONLY)
@@ -664,29 +817,71 @@ void cpu_exec_init(CPUState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block. Returns NULL if the current region
+   has too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        code_gen_ptr >= r->max_ptr)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = 0;
+    tb->cache_pending = 0;
+    tb->nb_relocs = 0;
+    tb->sb_len = 0;
+    tb->sb_profiled = 0;
+    tb->exit_count[0] = 0;
+    tb->exit_count[1] = 0;
+    tb->exec_count = 0;
+    return tb;
+}
+
+/* Allocate a TB together with code_size bytes of code buffer, for code
+   that was not produced by tb_gen_code.  Fills the empty regions in
+   order and never recycles one; returns NULL when out of space.  The
+   last region is kept for new translations.  */
+TranslationBlock *tb_alloc_code(target_ulong pc, int code_size)
+{
+    TranslationBlock *tb;
+    int next = code_gen_cur_region + 1;
+
+    if (code_gen_ptr + code_size >
+        code_gen_regions[code_gen_cur_region].max_ptr) {
+        if (next >= code_gen_nb_regions - 1 ||
+            code_gen_regions[next].nb_tbs) {
+            return NULL;
+        }
+        code_gen_regions[code_gen_cur_region].end_ptr = code_gen_ptr;
+        code_gen_cur_region = next;
+        code_gen_ptr = code_gen_regions[next].start;
+    }
+    tb = tb_alloc(pc);
+    if (!tb) {
+        return NULL;
+    }
+    tb->tc_ptr = code_gen_ptr;
+    tb->tc_size = code_size;
+    tb->nb_helper_calls = 0;
+    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_size +
+                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *r = &code_gen_regions[code_gen_cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+        r->nb_tbs--;
     }
 }
 
@@ -735,23 +930,46 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
+
+#if !defined(CONFIG_USER_ONLY)
+    if (mttcg_enabled && !qemu_tcg_in_exclusive()) {
+        if (cpu_single_env) {
+            /* Other VCPUs may be executing translated code, wait until
+               they have all left cpu_exec().  */
+            tb_flush_pending = true;
+            cpu_exit(cpu_single_env);
+        } else {
+            qemu_tcg_start_exclusive();
+            tb_flush(env1);
+            qemu_tcg_end_exclusive();
+        }
+        return;
+    }
+    tb_flush_pending = false;
+    tb_region_flush_pending = false;
+#endif
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+    printf("qemu: flush nb_tbs=%d\n", tb_count());
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if (code_gen_ptr > code_gen_buffer + code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
-    nb_tbs = 0;
+    for (i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].nb_tbs = 0;
+        code_gen_regions[i].end_ptr = code_gen_regions[i].start;
+    }
+    code_gen_cur_region = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    qht_reset(&tb_htable);
     page_flush_tb();
+#if !defined(CONFIG_USER_ONLY)
+    tb_cache_forget_all();
+#endif
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
@@ -761,58 +979,46 @@ void tb_flush(CPUState *env1)
 
 #ifdef DEBUG_TB_CHECK
 
+static void tb_invalidate_check_fn(void *p, uint32_t hash, void *opaque)
+{
+    TranslationBlock *tb = p;
+    target_ulong address = *(target_ulong *)opaque;
+
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
+          address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n",
+               address, (long)tb->pc, tb->size);
+    }
+}
+
 static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    qht_iter(&tb_htable, tb_invalidate_check_fn, &address);
+}
+
+static void tb_page_check_fn(void *p, uint32_t hash, void *opaque)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    qht_iter(&tb_htable, tb_page_check_fn, NULL);
 }
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb,
-                             int next_offset)
-{
-    TranslationBlock *tb1;
-    for(;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **)((char *)tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **)((char *)tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -873,11 +1079,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
+    tb_mt_lock();
+    tb->invalid = 1;
+
+    /* remove the TB from the hash table */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
-              offsetof(TranslationBlock, phys_hash_next));
+    qht_remove(&tb_htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags));
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -919,7 +1127,68 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
 
     tb_phys_invalidate_count++;
+
+    tb_mt_unlock();
+}
+
+/* Continue code generation in the next region, invalidating the TBs
+   left there by its previous use.  Like tb_flush, this must not run
+   while translated code of the region may be executing.  */
+static void tb_flush_region(CPUState *env1)
+{
+    CodeGenRegion *r;
+    TranslationBlock *tb;
+    int i;
+
+    if (code_gen_nb_regions == 1) {
+        tb_flush(env1);
+        return;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    tb_region_flush_pending = false;
+#endif
+    code_gen_regions[code_gen_cur_region].end_ptr = code_gen_ptr;
+    code_gen_cur_region = (code_gen_cur_region + 1) % code_gen_nb_regions;
+    r = &code_gen_regions[code_gen_cur_region];
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+#if !defined(CONFIG_USER_ONLY)
+        } else if (tb->cache_pending) {
+            tb_cache_forget(tb);
+#endif
+        } else {
+            /* cpu_exec may have chained it again after invalidation */
+            tb_jmp_remove(tb, 0);
+            tb_jmp_remove(tb, 1);
+        }
+    }
+    r->nb_tbs = 0;
+    r->end_ptr = r->start;
+    code_gen_ptr = r->start;
+    /* TBs that cpu_exec() remembers may have been freed */
+    tb_invalidated_flag = 1;
+    tb_region_flush_count++;
+}
+
+#if !defined(CONFIG_USER_ONLY)
+/* Called by a VCPU thread outside cpu_exec(), with the iothread
+   mutex held.  */
+void tb_flush_if_pending(CPUState *env)
+{
+    if (tb_flush_pending || tb_region_flush_pending) {
+        qemu_tcg_start_exclusive();
+        if (tb_flush_pending) {
+            tb_flush(env);
+        } else if (tb_region_flush_pending) {
+            tb_flush_region(env);
+        }
+        qemu_tcg_end_exclusive();
+    }
 }
+#endif
 
 static inline void set_bits(uint8_t *tab, int start, int len)
 {
@@ -976,9 +1245,64 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
-TranslationBlock *tb_gen_code(CPUState *env,
-                              target_ulong pc, target_ulong cs_base,
-                              int flags, int cflags)
+#if !defined(CONFIG_USER_ONLY)
+/* JIT symbol file in the format used by perf, which looks for it when
+   resolving addresses in anonymous executable memory.  */
+static FILE *tb_perf_map_file;
+
+static void tb_profile_perf_map(TranslationBlock *tb)
+{
+    const char *sym;
+
+    if (!tb_perf_map_file) {
+        return;
+    }
+    sym = lookup_symbol(tb->pc);
+    fprintf(tb_perf_map_file, "%lx %x guest:" TARGET_FMT_lx "%s%s\n",
+            (unsigned long)tb->tc_ptr, tb->tc_size, tb->pc,
+            sym[0] ? " " : "", sym);
+}
+
+/* While enabled, every TB is entered through cpu_exec(), which counts
+   its executions, and the TBs translated are written to
+   /tmp/perf-<pid>.map.  The translation buffer is flushed when the
+   profile starts so that no block is left chained to another.  */
+void tb_profile_enable(bool enable)
+{
+    char path[PATH_MAX];
+
+    if (enable == tb_profile_enabled) {
+        return;
+    }
+    if (enable) {
+        if (!tb_perf_map_file) {
+            snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+            tb_perf_map_file = fopen(path, "w");
+            if (!tb_perf_map_file) {
+                fprintf(stderr, "qemu: could not open %s: %s\n",
+                        path, strerror(errno));
+            }
+        }
+        tb_profile_enabled = true;
+        tb_flush(first_cpu);
+    } else {
+        tb_profile_enabled = false;
+        if (tb_perf_map_file) {
+            fflush(tb_perf_map_file);
+        }
+    }
+}
+#endif
+
+/* Translate the code at pc.  If trace_len is not zero, the TB is a
+   superblock that goes on with the code at trace[i] when its i-th block
+   jumps there.  */
+static TranslationBlock *tb_gen_code_trace(CPUState *env,
+                                           target_ulong pc,
+                                           target_ulong cs_base,
+                                           int flags, int cflags,
+                                           const target_ulong *trace,
+                                           int trace_len)
 {
     TranslationBlock *tb;
     uint8_t *tc_ptr;
@@ -986,11 +1310,21 @@ TranslationBlock *tb_gen_code(CPUState *env,
     target_ulong virt_page2;
     int code_gen_size;
 
+    tb_mt_lock();
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (mttcg_enabled) {
+            /* The other VCPUs must leave the translated code first:
+               return to the VCPU thread, which does the flush.  */
+            tb_region_flush_pending = true;
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* recycle the oldest region */
+        tb_flush_region(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1001,8 +1335,31 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    if (trace_len) {
+        tb->sb_len = trace_len;
+        tb->sb_trace = g_realloc(tb->sb_trace,
+                                 trace_len * sizeof(target_ulong));
+        memcpy(tb->sb_trace, trace, trace_len * sizeof(target_ulong));
+    }
     cpu_gen_code(env, tb, &code_gen_size);
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    tb->tc_size = code_gen_size;
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_profile_enabled) {
+        tb_profile_perf_map(tb);
+    }
+#endif
+    if (tcg_ctx.code_relocs_enabled) {
+        if (tcg_ctx.nb_code_relocs < 0) {
+            tb->nb_relocs = 0xffff;
+        } else if (tcg_ctx.nb_code_relocs > 0) {
+            tb->nb_relocs = tcg_ctx.nb_code_relocs;
+            tb->relocs = g_realloc(tb->relocs,
+                                   tb->nb_relocs * sizeof(uint32_t));
+            memcpy(tb->relocs, tcg_ctx.code_relocs,
+                   tb->nb_relocs * sizeof(uint32_t));
+        }
+    }
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1011,9 +1368,99 @@ TranslationBlock *tb_gen_code(CPUState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_mt_unlock();
     return tb;
 }
 
+TranslationBlock *tb_gen_code(CPUState *env,
+                              target_ulong pc, target_ulong cs_base,
+                              int flags, int cflags)
+{
+    return tb_gen_code_trace(env, pc, cs_base, flags, cflags, NULL, 0);
+}
+
+static TranslationBlock *tb_superblock_lookup(CPUState *env, target_ulong pc,
+                                              TranslationBlock *first)
+{
+    TranslationBlock *tb;
+
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (tb && tb->pc == pc && tb->cs_base == first->cs_base &&
+        tb->flags == first->flags) {
+        return tb;
+    }
+    return NULL;
+}
+
+/* Collect the blocks that follow 'first' on its hot path into trace.
+   Each block must start at or after the end of the previous one and
+   stay in the first page, so that the superblock still covers
+   [pc, pc + size) like any other TB.  */
+static int tb_superblock_trace(CPUState *env, TranslationBlock *first,
+                               TranslationBlock *next, target_ulong *trace)
+{
+    TranslationBlock *cur = first;
+    int len = 0, n;
+
+    while (len < TB_SUPERBLOCK_MAX_BLOCKS - 1) {
+        if (!next || next->invalid || next->sb_len || next->cflags ||
+            next->cs_base != first->cs_base || next->flags != first->flags ||
+            next->page_addr[0] != first->page_addr[0] ||
+            next->page_addr[1] != -1 ||
+            (next->pc & TARGET_PAGE_MASK) != (first->pc & TARGET_PAGE_MASK) ||
+            next->pc < cur->pc + cur->size) {
+            break;
+        }
+        trace[len++] = next->pc;
+        cur = next;
+        /* follow the hotter jump out of the new block */
+        n = cur->exit_count[1] > cur->exit_count[0];
+        if (cur->exit_count[n] < TB_SUPERBLOCK_THRESHOLD / 2) {
+            break;
+        }
+        next = tb_superblock_lookup(env, cur->exit_pc[n], first);
+    }
+    return len;
+}
+
+/* Called by cpu_exec() when tb left through its direct jump n to
+   tb_next.  Jumps are counted, and not chained, until one of them is
+   hot; tb is then retranslated as a superblock with the blocks that
+   usually follow it, which tcg_optimize and the liveness analysis see
+   as a single function.  */
+int tb_profile_jump(CPUState *env, TranslationBlock *tb, int n,
+                    TranslationBlock *tb_next)
+{
+    target_ulong trace[TB_SUPERBLOCK_MAX_BLOCKS - 1];
+    int len;
+
+    if (tb->sb_profiled) {
+        return TB_PROFILE_CHAIN;
+    }
+    if (tb->sb_len || tb->cflags || tb->page_addr[1] != -1) {
+        tb->sb_profiled = 1;
+        return TB_PROFILE_CHAIN;
+    }
+    tb->exit_pc[n] = tb_next->pc;
+    if (++tb->exit_count[n] < TB_SUPERBLOCK_THRESHOLD) {
+        return TB_PROFILE_COUNT;
+    }
+    tb->sb_profiled = 1;
+    len = tb_superblock_trace(env, tb, tb_next, trace);
+    if (len == 0) {
+        return TB_PROFILE_CHAIN;
+    }
+    tb_invalidated_flag = 0;
+    tb_gen_code_trace(env, tb->pc, tb->cs_base, tb->flags, 0, trace, len);
+    /* unless translating recycled its region, the superblock now
+       shadows tb */
+    if (!tb_invalidated_flag) {
+        tb_phys_invalidate(tb, -1);
+    }
+    tb_superblock_count++;
+    return TB_PROFILE_FORMED;
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1036,9 +1483,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_mt_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_mt_unlock();
         return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1112,6 +1562,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
     }
 #endif
+    tb_mt_unlock();
 #ifdef TARGET_HAS_PRECISE_SMC
     if (current_tb_modified) {
         /* we generate a block containing just the instruction
@@ -1137,9 +1588,10 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   cpu_single_env->eip + (long)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_mt_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
-        return;
+        goto out;
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1149,6 +1601,8 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+ out:
+    tb_mt_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1275,17 +1729,12 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    qht_insert(&tb_htable, tb,
+               tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags));
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1314,21 +1763,27 @@ void tb_link_page(TranslationBlock *tb,
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(unsigned long tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, i;
     unsigned long v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
-    if (nb_tbs <= 0)
-        return NULL;
     if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+        tc_ptr >= (unsigned long)code_gen_buffer + code_gen_buffer_size)
+        return NULL;
+    i = (tc_ptr - (unsigned long)code_gen_buffer) / code_gen_region_size;
+    if (i >= code_gen_nb_regions) {
+        i = code_gen_nb_regions - 1;
+    }
+    r = &code_gen_regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (unsigned long)code_gen_region_end(i))
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1338,7 +1793,27 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
+}
+
+/* Call fn for each allocated TB, oldest region first, with the size of
+   its host code.  */
+void tb_foreach(void (*fn)(TranslationBlock *tb, int code_size, void *opaque),
+                void *opaque)
+{
+    CodeGenRegion *r;
+    uint8_t *end;
+    int i, j, k;
+
+    for (k = 1; k <= code_gen_nb_regions; k++) {
+        j = (code_gen_cur_region + k) % code_gen_nb_regions;
+        r = &code_gen_regions[j];
+        end = code_gen_region_end(j);
+        for (i = 0; i < r->nb_tbs; i++) {
+            fn(&r->tbs[i], (i + 1 < r->nb_tbs ? r->tbs[i + 1].tc_ptr : end) -
+               r->tbs[i].tc_ptr, opaque);
+        }
+    }
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1634,6 +2109,15 @@ static void cpu_unlink_tb(CPUState *env)
     TranslationBlock *tb;
     static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
 
+    if (mttcg_enabled) {
+        /* Patching jumps under the feet of another host thread is not
+           safe, so every TB checks this flag on entry instead (see
+           gen_icount_start).  Order it after exit_request.  */
+        smp_wmb();
+        env->icount_decr.u16.high = 0xffff;
+        return;
+    }
+
     spin_lock(&interrupt_lock);
     tb = env->current_tb;
     /* if the cpu is currently executing code, we must unlink it and
@@ -1652,7 +2136,11 @@ static void tcg_handle_interrupt(CPUState *env, int mask)
     int old_mask;
 
     old_mask = env->interrupt_request;
-    env->interrupt_request |= mask;
+    if (mttcg_enabled) {
+        __sync_fetch_and_or(&env->interrupt_request, mask);
+    } else {
+        env->interrupt_request |= mask;
+    }
 
     /*
      * If called from iothread context, wake the target cpu in
@@ -1687,7 +2175,11 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
-    env->interrupt_request &= ~mask;
+    if (mttcg_enabled) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+    } else {
+        env->interrupt_request &= ~mask;
+    }
 }
 
 void cpu_exit(CPUState *env)
@@ -1984,11 +2476,50 @@ static CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+/* Choose the TLB size for the next flush interval from the number of
+   fills in the last one: double it when more than half of the entries
+   had to be refilled, halve it when it has stayed mostly idle for
+   several flushes in a row.  Returns the number of entries that must
+   be cleared.  */
+static unsigned int tlb_resize(CPUState *env)
+{
+    unsigned int old_size = tlb_size(env);
+    unsigned int size = old_size;
+
+    /* tlb_mask is preserved by cpu_reset, it is never left at zero */
+    assert(old_size >= CPU_TLB_MIN_SIZE && old_size <= CPU_TLB_MAX_SIZE);
+
+#ifdef CPU_TLB_DYNAMIC
+    if (env->tlb_misses > size / 2) {
+        env->tlb_quiet_flushes = 0;
+        if (size < CPU_TLB_MAX_SIZE) {
+            size <<= 1;
+        }
+    } else if (env->tlb_misses < size / 16) {
+        if (++env->tlb_quiet_flushes >= 16 && size > CPU_TLB_MIN_SIZE) {
+            env->tlb_quiet_flushes = 0;
+            size >>= 1;
+        }
+    } else {
+        env->tlb_quiet_flushes = 0;
+    }
+#endif
+    /* Without CPU_TLB_DYNAMIC, this pins the size to CPU_TLB_SIZE */
+    size = MIN(MAX(size, CPU_TLB_MIN_SIZE), CPU_TLB_MAX_SIZE);
+    if (size != old_size) {
+        env->tlb_mask = (unsigned long)(size - 1) << CPU_TLB_ENTRY_BITS;
+        tlb_resize_count++;
+    }
+    env->tlb_misses = 0;
+    return MAX(old_size, size);
+}
+
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global)
 {
-    int i;
+    unsigned int i, n;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -1997,11 +2528,14 @@ void tlb_flush(CPUState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for(i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+    n = tlb_resize(env);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < n; i++) {
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
     }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -2011,14 +2545,27 @@ void tlb_flush(CPUState *env, int flush_global)
     tlb_flush_count++;
 }
 
+static inline int tlb_entry_maps_page(CPUTLBEntry *tlb_entry,
+                                      target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+static inline int tlb_entry_is_empty(CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == (target_ulong)-1 &&
+           tlb_entry->addr_write == (target_ulong)-1 &&
+           tlb_entry->addr_code == (target_ulong)-1;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_maps_page(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
@@ -2046,9 +2593,15 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    i = tlb_index(env, addr);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
@@ -2085,6 +2638,20 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
+{
+    start &= TARGET_PAGE_MASK;
+    end = TARGET_PAGE_ALIGN(end);
+
+    if (end == start)
+        return;
+    cpu_physical_memory_mask_dirty_range(start, end - start, dirty_flags);
+    cpu_physical_memory_reset_dirty_tlb(start, end);
+}
+
+/* Make the next write to the range go through the slow path, which sets the
+   dirty flags again.  Flags cleared before this call are set again by any
+   write that follows it.  */
+void cpu_physical_memory_reset_dirty_tlb(ram_addr_t start, ram_addr_t end)
 {
     CPUState *env;
     unsigned long length, start1;
@@ -2096,7 +2663,6 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
 
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
@@ -2111,9 +2677,13 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         int mmu_idx;
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for(i = 0; i < CPU_TLB_SIZE; i++)
+            for(i = 0; i < tlb_size(env); i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -2191,8 +2761,11 @@ void cpu_tlb_update_dirty(CPUState *env)
     int i;
     int mmu_idx;
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        for(i = 0; i < CPU_TLB_SIZE; i++)
+        for(i = 0; i < tlb_size(env); i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
+        }
     }
 }
 
@@ -2210,9 +2783,44 @@ static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    i = tlb_index(env, vaddr);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+/* Look up the page of addr in the victim TLB.  On a hit the entry is
+   swapped with the one at index in the main TLB, so that the retried
+   access finds it there.  elt_ofs is the offset of the address field
+   that matches the access type.  */
+int tlb_victim_hit(CPUState *env, int mmu_idx, int index, size_t elt_ofs,
+                   target_ulong addr)
+{
+    int k;
+
+    addr &= TARGET_PAGE_MASK;
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][k];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vte + elt_ofs);
+
+        if (addr == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry tmp = env->tlb_table[mmu_idx][index];
+            target_phys_addr_t iotmp = env->iotlb[mmu_idx][index];
+
+            env->tlb_table[mmu_idx][index] = *vte;
+            *vte = tmp;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][k];
+            env->iotlb_v[mmu_idx][k] = iotmp;
+            tlb_victim_hit_count++;
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2313,9 +2921,21 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
         }
     }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    index = tlb_index(env, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    env->tlb_misses++;
+
+    /* Keep the entry being replaced in the victim TLB, unless it is
+       empty or maps the same page.  */
+    if (!tlb_entry_is_empty(te) &&
+        !tlb_entry_maps_page(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -4715,41 +5335,53 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs;
+    long code_size;
+    CodeGenRegion *r;
     TranslationBlock *tb;
+    QHTStats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (j = 0; j < code_gen_nb_regions; j++) {
+        r = &code_gen_regions[j];
+        code_size += code_gen_region_end(j) - r->start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
+    nb_tbs = tb_count();
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (filling #%d)\n",
+                code_gen_nb_regions, code_gen_cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4758,13 +5390,83 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp_count * 100) / nb_tbs : 0,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
+    qht_statistics(&tb_htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.1f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                (double)hst.used_head_buckets * 100 / hst.head_buckets);
+    cpu_fprintf(f, "TB hash occupancy   %0.1f%% (%zu entries)\n",
+                hst.occupancy * 100, hst.entries);
+    cpu_fprintf(f, "TB hash chain       avg %0.2f max %zu buckets\n",
+                hst.avg_chain, hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
-    cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB flush count      %d full, %d partial\n",
+                tb_flush_count, tb_region_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    if (tcg_superblocks_enabled) {
+        cpu_fprintf(f, "superblock count    %d\n", tb_superblock_count);
+    }
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+#if !defined(CONFIG_USER_ONLY)
+    cpu_fprintf(f, "TLB victim hits     %d\n", tlb_victim_hit_count);
+    cpu_fprintf(f, "TLB resize count    %d\n", tlb_resize_count);
+    if (first_cpu) {
+        cpu_fprintf(f, "TLB size            %u entries\n",
+                    (unsigned int)tlb_size(first_cpu));
+    }
+#endif
+#if !defined(CONFIG_USER_ONLY)
+    tb_cache_dump_info(f, cpu_fprintf);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+
+    if (ta->exec_count != tb->exec_count) {
+        return ta->exec_count < tb->exec_count ? 1 : -1;
+    }
+    return 0;
+}
+
+/* print the 'count' most executed TBs */
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    TranslationBlock **sorted, *tb;
+    CodeGenRegion *r;
+    uint64_t total = 0;
+    int i, j, n = 0;
+
+    sorted = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock *));
+    for (j = 0; j < code_gen_nb_regions; j++) {
+        r = &code_gen_regions[j];
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            if (tb->exec_count) {
+                total += tb->exec_count;
+                sorted[n++] = tb;
+            }
+        }
+    }
+    qsort(sorted, n, sizeof(TranslationBlock *), tb_profile_cmp);
+
+    cpu_fprintf(f, "%" PRIu64 " TB executions in %d TBs%s\n", total, n,
+                tb_profile_enabled ? "" : " (profiling is off)");
+    cpu_fprintf(f, "     count       %%  guest pc          host size"
+                "  helpers  symbol\n");
+    for (i = 0; i < n && i < count; i++) {
+        tb = sorted[i];
+        cpu_fprintf(f, "%10" PRIu64 "  %5.1f%%  " TARGET_FMT_lx
+                    "  %9u  %7u  %s\n",
+                    tb->exec_count, (double)tb->exec_count * 100 / total,
+                    tb->pc, tb->tc_size, tb->nb_helper_calls,
+                    lookup_symbol(tb->pc));
+    }
+    g_free(sorted);
+}
+
 #define MMUSUFFIX _cmmu
 #undef GETPC
 #define GETPC() NULL
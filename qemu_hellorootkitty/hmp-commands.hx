@@ -70,6 +70,22 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .mhandler.cmd = hmp_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Change the I/O limits of a block drive to @var{bps} @var{bps_rd} @var{bps_wr}
+@var{iops} @var{iops_rd} @var{iops_wr}.  A limit of 0 means unlimited, and
+all limits set to 0 turn throttling off.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -268,6 +284,53 @@ STEXI
 @item delvm @var{tag}|@var{id}
 @findex delvm
 Delete the snapshot identified by @var{tag} or @var{id}.
+ETEXI
+
+    {
+        .name       = "snapshot_live",
+        .args_type  = "incremental:-i,file:F",
+        .params     = "[-i] file",
+        .help       = "save the VM state to a file while the guest runs "
+                      "(-i: only the pages dirtied since the last one)",
+        .mhandler.cmd = hmp_snapshot_live,
+    },
+
+STEXI
+@item snapshot_live [-i] @var{file}
+@findex snapshot_live
+Save the RAM and device state to @var{file} while the guest keeps running;
+it is only stopped for the last pass. With @code{-i}, only the pages
+written since the previous live snapshot completed are saved. Disks are
+not saved. The progress is shown by @code{info snapshot_live}.
+ETEXI
+
+    {
+        .name       = "snapshot_live_cancel",
+        .args_type  = "",
+        .params     = "",
+        .help       = "cancel the current live snapshot",
+        .mhandler.cmd = hmp_snapshot_live_cancel,
+    },
+
+STEXI
+@item snapshot_live_cancel
+@findex snapshot_live_cancel
+Cancel the current live snapshot.
+ETEXI
+
+    {
+        .name       = "snapshot_live_load",
+        .args_type  = "file:F",
+        .params     = "file",
+        .help       = "restore the VM state saved by snapshot_live",
+        .mhandler.cmd = hmp_snapshot_live_load,
+    },
+
+STEXI
+@item snapshot_live_load @var{file}
+@findex snapshot_live_load
+Restore the state saved to @var{file} by @code{snapshot_live}. Load a full
+snapshot first, then the incremental ones in the order they were taken.
 ETEXI
 
     {
@@ -283,6 +346,39 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "start or stop counting translation block executions",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb_profile [off]
+@findex tb_profile
+Count how often each translation block is executed.  Blocks are no
+longer chained to each other while profiling, so emulation is slower.
+The host code of the blocks translated meanwhile is described in
+@file{/tmp/perf-<pid>.map} so that @command{perf} can attribute samples
+to guest addresses.  If called with option off, profiling stops.
+ETEXI
+
+    {
+        .name       = "tb_profile_top",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = do_tb_profile_top,
+    },
+
+STEXI
+@item tb_profile_top [@var{count}]
+@findex tb_profile_top
+Show the @var{count} (default 20) most executed translation blocks with
+their guest address, host code size and number of helper calls.
 ETEXI
 
     {
@@ -815,6 +911,78 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations,"
+                      "the cache size will be rounded down to a whole "
+                      "number of pages.",
+        .mhandler.cmd = hmp_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for XBZRLE migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .mhandler.cmd = hmp_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable/Disable the usage of a capability @var{capability} for migration.
+The capabilities are @code{compress}, which compresses RAM pages with
+a pool of worker threads, @code{xbzrle}, which sends the pages that
+are dirtied again as a delta against a cached copy, @code{zero-blocks},
+which sends the zeroed chunks of the disks without their data during
+block migration, @code{postcopy-ram}, which starts the guest on the
+destination before all of its RAM has been sent, @code{multifd}, which
+sends the RAM pages over several connections in parallel, and
+@code{auto-converge}, which slows down the guest when it dirties its
+memory faster than it can be migrated.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration tunable @var{parameter} to @var{value}.  The tunables
+are @code{compress-level}, @code{compress-threads},
+@code{decompress-threads}, @code{postcopy-passes} and
+@code{multifd-channels}.
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Switch the running migration to postcopy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Start the guest on the destination of the running migration and send it
+the rest of its RAM from there.  Requires the @code{postcopy-ram}
+capability.
 ETEXI
 
     {
@@ -1340,6 +1508,14 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
+@item info migrate_cache_size
+show current migration XBZRLE cache size
+@item info snapshot_live
+show the status of the last live snapshot
 @item info balloon
 show balloon information
 @item info qtree
@@ -13,6 +13,7 @@
 
 #include "hmp.h"
 #include "qmp-commands.h"
+#include "qerror.h"
 
 void hmp_info_name(Monitor *mon)
 {
@@ -124,6 +125,23 @@ void hmp_info_migrate(Monitor *mon)
         monitor_printf(mon, "Migration status: %s\n", info->status);
     }
 
+    if (info->has_total_time) {
+        monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_setup_time) {
+        monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
+                       info->setup_time);
+    }
+    if (info->has_expected_downtime) {
+        monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
+                       info->expected_downtime);
+    }
+    if (info->has_downtime) {
+        monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
+                       info->downtime);
+    }
+
     if (info->has_ram) {
         monitor_printf(mon, "transferred ram: %" PRIu64 " kbytes\n",
                        info->ram->transferred >> 10);
@@ -131,6 +149,17 @@ void hmp_info_migrate(Monitor *mon)
                        info->ram->remaining >> 10);
         monitor_printf(mon, "total ram: %" PRIu64 " kbytes\n",
                        info->ram->total >> 10);
+        monitor_printf(mon, "duplicate: %" PRIu64 " pages\n",
+                       info->ram->duplicate);
+        monitor_printf(mon, "normal: %" PRIu64 " pages\n",
+                       info->ram->normal);
+        monitor_printf(mon, "normal bytes: %" PRIu64 " kbytes\n",
+                       info->ram->normal_bytes >> 10);
+        monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages/s\n",
+                       info->ram->dirty_pages_rate);
+        monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
+                       info->ram->dirty_sync_count);
+        monitor_printf(mon, "mbps: %0.2f\n", info->ram->mbps);
     }
 
     if (info->has_disk) {
@@ -140,11 +169,99 @@ void hmp_info_migrate(Monitor *mon)
                        info->disk->remaining >> 10);
         monitor_printf(mon, "total disk: %" PRIu64 " kbytes\n",
                        info->disk->total >> 10);
+        monitor_printf(mon, "duplicate disk: %" PRIu64 " chunks\n",
+                       info->disk->duplicate);
+        monitor_printf(mon, "normal disk: %" PRIu64 " chunks\n",
+                       info->disk->normal);
+    }
+
+    if (info->has_xbzrle_cache) {
+        monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
+                       info->xbzrle_cache->cache_size);
+        monitor_printf(mon, "xbzrle transferred: %" PRIu64 " kbytes\n",
+                       info->xbzrle_cache->bytes >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
+        monitor_printf(mon, "xbzrle overflow: %" PRIu64 "\n",
+                       info->xbzrle_cache->overflow);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRId64 "\n",
+                       info->cpu_throttle_percentage);
     }
 
     qapi_free_MigrationInfo(info);
 }
 
+void hmp_info_migrate_capabilities(Monitor *mon)
+{
+    MigrationCapabilityStatusList *caps, *cap;
+
+    caps = qmp_query_migrate_capabilities(NULL);
+
+    for (cap = caps; cap; cap = cap->next) {
+        monitor_printf(mon, "%s: %s\n",
+                       MigrationCapability_lookup[cap->value->capability],
+                       cap->value->state ? "on" : "off");
+    }
+
+    qapi_free_MigrationCapabilityStatusList(caps);
+}
+
+void hmp_info_migrate_parameters(Monitor *mon)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "compress-level: %" PRId64 "\n",
+                   params->compress_level);
+    monitor_printf(mon, "compress-threads: %" PRId64 "\n",
+                   params->compress_threads);
+    monitor_printf(mon, "decompress-threads: %" PRId64 "\n",
+                   params->decompress_threads);
+    monitor_printf(mon, "postcopy-passes: %" PRId64 "\n",
+                   params->postcopy_passes);
+    monitor_printf(mon, "multifd-channels: %" PRId64 "\n",
+                   params->multifd_channels);
+
+    qapi_free_MigrationParameters(params);
+}
+
+void hmp_info_migrate_cache_size(Monitor *mon)
+{
+    monitor_printf(mon, "xbzrle cache size: %" PRId64 " kbytes\n",
+                   qmp_query_migrate_cache_size(NULL) >> 10);
+}
+
+void hmp_info_snapshot_live(Monitor *mon)
+{
+    SnapshotLiveInfo *info;
+
+    info = qmp_query_snapshot_live(NULL);
+
+    if (info->has_status) {
+        monitor_printf(mon, "Snapshot status: %s\n", info->status);
+        monitor_printf(mon, "file: %s (%s)\n", info->file,
+                       info->incremental ? "incremental" : "full");
+        monitor_printf(mon, "written: %" PRId64 " kbytes\n",
+                       info->bytes >> 10);
+        monitor_printf(mon, "total time: %" PRId64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_downtime) {
+        monitor_printf(mon, "downtime: %" PRId64 " milliseconds\n",
+                       info->downtime);
+    }
+
+    qapi_free_SnapshotLiveInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -216,6 +333,23 @@ void hmp_info_block(Monitor *mon)
                            info->value->inserted->ro,
                            info->value->inserted->drv,
                            info->value->inserted->encrypted);
+
+            if (info->value->inserted->bps
+                || info->value->inserted->bps_rd
+                || info->value->inserted->bps_wr
+                || info->value->inserted->iops
+                || info->value->inserted->iops_rd
+                || info->value->inserted->iops_wr) {
+                monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                               " bps_wr=%" PRId64 " iops=%" PRId64
+                               " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                               info->value->inserted->bps,
+                               info->value->inserted->bps_rd,
+                               info->value->inserted->bps_wr,
+                               info->value->inserted->iops,
+                               info->value->inserted->iops_rd,
+                               info->value->inserted->iops_wr);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -226,6 +360,39 @@ void hmp_info_block(Monitor *mon)
     qapi_free_BlockInfoList(block_list);
 }
 
+static void print_block_histogram(Monitor *mon, const char *prefix,
+                                  const char *name,
+                                  BlockHistogramBucketList *bucket)
+{
+    monitor_printf(mon, "    %s%s:", prefix, name);
+    for (; bucket; bucket = bucket->next) {
+        monitor_printf(mon, " %" PRId64 ":%" PRId64,
+                       bucket->value->start, bucket->value->count);
+    }
+    monitor_printf(mon, "\n");
+}
+
+static void print_block_histograms(Monitor *mon, const char *prefix,
+                                   BlockDeviceStats *stats)
+{
+    if (stats->has_rd_latency_histogram) {
+        print_block_histogram(mon, prefix, "rd_latency_ns",
+                              stats->rd_latency_histogram);
+    }
+    if (stats->has_wr_latency_histogram) {
+        print_block_histogram(mon, prefix, "wr_latency_ns",
+                              stats->wr_latency_histogram);
+    }
+    if (stats->has_flush_latency_histogram) {
+        print_block_histogram(mon, prefix, "flush_latency_ns",
+                              stats->flush_latency_histogram);
+    }
+    if (stats->has_queue_depth_histogram) {
+        print_block_histogram(mon, prefix, "queue_depth",
+                              stats->queue_depth_histogram);
+    }
+}
+
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
@@ -245,8 +412,7 @@ void hmp_info_blockstats(Monitor *mon)
                        " flush_operations=%" PRId64
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
-                       " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " flush_total_time_ns=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -255,6 +421,30 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64,
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses,
+                           stats->value->stats->refcount_cache_hits,
+                           stats->value->stats->refcount_cache_misses);
+        }
+        if (stats->value->stats->has_throttled_operations) {
+            monitor_printf(mon, " throttled_operations=%" PRId64
+                           " throttled_total_time_ns=%" PRId64,
+                           stats->value->stats->throttled_operations,
+                           stats->value->stats->throttled_total_time_ns);
+        }
+        monitor_printf(mon, " in_flight=%" PRId64 "\n",
+                       stats->value->stats->in_flight);
+
+        print_block_histograms(mon, "", stats->value->stats);
+        if (stats->value->has_parent) {
+            print_block_histograms(mon, "file ",
+                                   stats->value->parent->stats);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -521,3 +711,128 @@ void hmp_cpu(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "invalid CPU index\n");
     }
 }
+
+void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
+{
+    const char *cap = qdict_get_str(qdict, "capability");
+    bool state = qdict_get_bool(qdict, "state");
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (!strcmp(cap, MigrationCapability_lookup[i])) {
+            qmp_migrate_set_capability(i, state, &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_CAPABILITY_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, cap);
+    }
+
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (!strcmp(param, "compress-level")) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0,
+                                   false, 0, false, 0, &err);
+    } else if (!strcmp(param, "compress-threads")) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0,
+                                   false, 0, false, 0, &err);
+    } else if (!strcmp(param, "decompress-threads")) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value,
+                                   false, 0, false, 0, &err);
+    } else if (!strcmp(param, "postcopy-passes")) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   true, value, false, 0, &err);
+    } else if (!strcmp(param, "multifd-channels")) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_cache_size(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_snapshot_live(Monitor *mon, const QDict *qdict)
+{
+    bool incremental = qdict_get_try_bool(qdict, "incremental", 0);
+    const char *file = qdict_get_str(qdict, "file");
+    Error *err = NULL;
+
+    qmp_snapshot_live(file, true, incremental, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_snapshot_live_cancel(Monitor *mon, const QDict *qdict)
+{
+    qmp_snapshot_live_cancel(NULL);
+}
+
+void hmp_snapshot_live_load(Monitor *mon, const QDict *qdict)
+{
+    const char *file = qdict_get_str(qdict, "file");
+    Error *err = NULL;
+
+    qmp_snapshot_live_load(file, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_block_set_io_throttle(qdict_get_str(qdict, "device"),
+                              qdict_get_int(qdict, "bps"),
+                              qdict_get_int(qdict, "bps_rd"),
+                              qdict_get_int(qdict, "bps_wr"),
+                              qdict_get_int(qdict, "iops"),
+                              qdict_get_int(qdict, "iops_rd"),
+                              qdict_get_int(qdict, "iops_wr"), &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
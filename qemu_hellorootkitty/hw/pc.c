@@ -945,6 +945,8 @@ static CPUState *pc_new_cpu(const char *cpu_model)
     }
     qemu_register_reset(pc_cpu_reset, env);
     pc_cpu_reset(env);
+    /* the reset must not clobber the softmmu TLB size */
+    assert(tlb_size(env) == CPU_TLB_SIZE);
     return env;
 }
 
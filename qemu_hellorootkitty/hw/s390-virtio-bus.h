@@ -18,6 +18,7 @@
  */
 
 #include "virtio-net.h"
+#include "virtio-blk.h"
 #include "virtio-serial.h"
 
 #define VIRTIO_DEV_OFFS_TYPE		0	/* 8 bits */
@@ -47,6 +48,7 @@ typedef struct VirtIOS390Device {
     uint32_t host_features;
     virtio_serial_conf serial;
     virtio_net_conf net;
+    virtio_blk_conf blk;
 } VirtIOS390Device;
 
 typedef struct VirtIOS390Bus {
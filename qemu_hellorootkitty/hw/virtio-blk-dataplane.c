@@ -0,0 +1,546 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * The thread takes kicks from an ioeventfd, walks the virtqueue with the
+ * vring.c helpers and submits reads and writes straight to the raw image
+ * with Linux AIO, so none of the request path runs under the global mutex.
+ * Completions are signalled through the guest notifier, which the main loop
+ * turns into an interrupt.
+ *
+ * Errors are always reported to the guest: the rerror/werror policies of
+ * the drive, I/O accounting and the dirty log are bypassed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+#include <libaio.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "iov.h"
+#include "kvm.h"
+#include "event_notifier.h"
+#include "virtio-blk.h"
+#include "vring.h"
+#include "virtio-blk-dataplane.h"
+
+enum {
+    SEG_MAX = 128,          /* seg_max advertised to the guest, plus headers */
+    REQ_MAX = 128,          /* virtqueue size */
+};
+
+typedef struct VirtIOBlockDataPlaneReq {
+    struct iocb iocb;
+    unsigned int head;
+    struct virtio_blk_inhdr *inhdr;
+    bool is_read;
+    size_t nbytes;
+    struct iovec *data_iov;
+    unsigned int data_niov;
+    void *bounce;                   /* for guest buffers O_DIRECT rejects */
+    struct iovec iov[SEG_MAX];
+} VirtIOBlockDataPlaneReq;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    const char *serial;
+    int fd;                         /* the raw image, opened O_DIRECT */
+    bool read_only;
+    uint64_t nb_sectors;
+    bool started;
+    bool stopping;
+
+    /* Owned by the thread while it runs */
+    Vring vring;
+    EventNotifier *host_notifier;   /* the guest kicked us */
+    EventNotifier *guest_notifier;  /* we want to interrupt the guest */
+    io_context_t io_ctx;
+    EventNotifier io_notifier;      /* AIO completions are ready */
+    struct iocb *pending[REQ_MAX];  /* prepared but not yet submitted */
+    unsigned int num_pending;
+    unsigned int num_reqs;          /* prepared or submitted */
+    unsigned int free_reqs[REQ_MAX];
+    unsigned int num_free;
+    bool ring_full;                 /* stopped popping for lack of reqs */
+    bool completed;                 /* pushed to the used ring */
+    VirtIOBlockDataPlaneReq reqs[REQ_MAX];
+
+    QemuThread thread;
+    EventNotifier stop_notifier;
+    QemuMutex lock;
+    QemuCond cond;
+    bool run;                       /* protected by lock */
+    bool idle;
+    bool quit;
+    bool exited;
+};
+
+static void data_plane_complete(VirtIOBlockDataPlane *s,
+                                VirtIOBlockDataPlaneReq *req,
+                                int status, size_t len)
+{
+    stb_p(&req->inhdr->status, status);
+    vring_push(&s->vring, req->head, len + sizeof(*req->inhdr));
+    s->free_reqs[s->num_free++] = req - s->reqs;
+    s->completed = true;
+}
+
+static void data_plane_notify(VirtIOBlockDataPlane *s)
+{
+    if (s->completed && vring_should_notify(&s->vring)) {
+        event_notifier_set(s->guest_notifier);
+    }
+    s->completed = false;
+}
+
+static inline ssize_t io_event_ret(struct io_event *ev)
+{
+    return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
+}
+
+static void data_plane_complete_io(VirtIOBlockDataPlane *s,
+                                   VirtIOBlockDataPlaneReq *req, ssize_t ret)
+{
+    int status = VIRTIO_BLK_S_OK;
+
+    if (ret != req->nbytes) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+    if (req->bounce) {
+        if (req->is_read && status == VIRTIO_BLK_S_OK) {
+            iov_from_buf(req->data_iov, req->data_niov, req->bounce, 0,
+                         req->nbytes);
+        }
+        qemu_vfree(req->bounce);
+        req->bounce = NULL;
+    }
+
+    s->num_reqs--;
+    data_plane_complete(s, req, status, req->is_read ? req->nbytes : 0);
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int niov)
+{
+    unsigned int i;
+
+    for (i = 0; i < niov; i++) {
+        if ((uintptr_t)iov[i].iov_base % BDRV_SECTOR_SIZE ||
+            iov[i].iov_len % BDRV_SECTOR_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void data_plane_prepare_rw(VirtIOBlockDataPlane *s,
+                                  VirtIOBlockDataPlaneReq *req, bool is_read,
+                                  uint64_t sector, struct iovec *iov,
+                                  unsigned int niov)
+{
+    size_t nbytes = iov_size(iov, niov);
+    off_t offset = sector * BDRV_SECTOR_SIZE;
+
+    if ((!is_read && s->read_only) ||
+        nbytes % BDRV_SECTOR_SIZE ||
+        sector > s->nb_sectors ||
+        nbytes / BDRV_SECTOR_SIZE > s->nb_sectors - sector) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_IOERR, 0);
+        return;
+    }
+    if (nbytes == 0) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_OK, 0);
+        return;
+    }
+
+    req->is_read = is_read;
+    req->nbytes = nbytes;
+    req->data_iov = iov;
+    req->data_niov = niov;
+
+    if (iov_is_aligned(iov, niov)) {
+        if (is_read) {
+            io_prep_preadv(&req->iocb, s->fd, iov, niov, offset);
+        } else {
+            io_prep_pwritev(&req->iocb, s->fd, iov, niov, offset);
+        }
+    } else {
+        req->bounce = qemu_memalign(BDRV_SECTOR_SIZE, nbytes);
+        if (is_read) {
+            io_prep_pread(&req->iocb, s->fd, req->bounce, nbytes, offset);
+        } else {
+            iov_to_buf(iov, niov, req->bounce, 0, nbytes);
+            io_prep_pwrite(&req->iocb, s->fd, req->bounce, nbytes, offset);
+        }
+    }
+    io_set_eventfd(&req->iocb, event_notifier_get_fd(&s->io_notifier));
+    req->iocb.data = req;
+
+    s->pending[s->num_pending++] = &req->iocb;
+    s->num_reqs++;
+}
+
+static void data_plane_handle_request(VirtIOBlockDataPlane *s,
+                                      VirtIOBlockDataPlaneReq *req,
+                                      unsigned int out_num,
+                                      unsigned int in_num)
+{
+    struct iovec *iov = req->iov;
+    struct virtio_blk_outhdr *outhdr;
+    uint32_t type;
+
+    if (out_num < 1 || in_num < 1) {
+        error_report("virtio-blk missing headers");
+        exit(1);
+    }
+    if (iov[0].iov_len < sizeof(*outhdr) ||
+        iov[out_num + in_num - 1].iov_len < sizeof(*req->inhdr)) {
+        error_report("virtio-blk header not in correct element");
+        exit(1);
+    }
+
+    outhdr = iov[0].iov_base;
+    req->inhdr = iov[out_num + in_num - 1].iov_base;
+    type = ldl_p(&outhdr->type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* Only needs to cover writes the guest has seen complete */
+        data_plane_complete(s, req, fdatasync(s->fd) == 0 ?
+                            VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR, 0);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        /* Same convention as virtio-blk.c: no '\0' if the serial fills it */
+        strncpy(iov[out_num].iov_base, s->serial ? s->serial : "",
+                MIN(iov[out_num].iov_len, VIRTIO_BLK_ID_BYTES));
+        data_plane_complete(s, req, VIRTIO_BLK_S_OK, 0);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        data_plane_prepare_rw(s, req, false, ldq_p(&outhdr->sector),
+                              &iov[1], out_num - 1);
+    } else {
+        data_plane_prepare_rw(s, req, true, ldq_p(&outhdr->sector),
+                              &iov[out_num], in_num - 1);
+    }
+}
+
+static void data_plane_submit(VirtIOBlockDataPlane *s)
+{
+    int i, ret;
+
+    if (!s->num_pending) {
+        return;
+    }
+
+    ret = io_submit(s->io_ctx, s->num_pending, s->pending);
+    if (ret < 0) {
+        ret = 0;
+    }
+    for (i = ret; i < s->num_pending; i++) {
+        data_plane_complete_io(s, s->pending[i]->data, -EIO);
+    }
+    s->num_pending = 0;
+}
+
+static void data_plane_handle_notify(VirtIOBlockDataPlane *s)
+{
+    VirtIOBlockDataPlaneReq *req;
+    unsigned int out_num, in_num;
+    int head = -EAGAIN;
+
+    event_notifier_test_and_clear(s->host_notifier);
+
+    for (;;) {
+        vring_disable_notification(&s->vring);
+
+        while (s->num_free) {
+            req = &s->reqs[s->free_reqs[s->num_free - 1]];
+            head = vring_pop(&s->vring, req->iov, SEG_MAX, &out_num, &in_num);
+            if (head < 0) {
+                break;
+            }
+            s->num_free--;
+            req->head = head;
+            data_plane_handle_request(s, req, out_num, in_num);
+        }
+
+        if (!s->num_free) {
+            /* Picked up again as completions free up requests */
+            s->ring_full = true;
+            break;
+        }
+        if (head != -EAGAIN) {
+            /* The ring is broken until the guest resets the device */
+            break;
+        }
+        if (!vring_enable_notification(&s->vring)) {
+            break;
+        }
+    }
+
+    data_plane_submit(s);
+    data_plane_notify(s);
+}
+
+static void data_plane_handle_io(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[REQ_MAX];
+    struct timespec ts = { 0, 0 };
+    int nevents, i;
+
+    event_notifier_test_and_clear(&s->io_notifier);
+
+    do {
+        nevents = io_getevents(s->io_ctx, 0, REQ_MAX, events, &ts);
+        for (i = 0; i < nevents; i++) {
+            data_plane_complete_io(s, events[i].data,
+                                   io_event_ret(&events[i]));
+        }
+    } while (nevents == REQ_MAX || nevents == -EINTR);
+
+    if (s->ring_full) {
+        s->ring_full = false;
+        data_plane_handle_notify(s);
+    }
+    data_plane_notify(s);
+}
+
+/* Process the ring until asked to stop, then drain requests in flight */
+static void data_plane_run(VirtIOBlockDataPlane *s)
+{
+    struct pollfd fds[3];
+    bool stopping = false;
+    int i;
+
+    fds[0].fd = event_notifier_get_fd(&s->io_notifier);
+    fds[1].fd = event_notifier_get_fd(&s->stop_notifier);
+    fds[2].fd = event_notifier_get_fd(s->host_notifier);
+    for (i = 0; i < ARRAY_SIZE(fds); i++) {
+        fds[i].events = POLLIN;
+    }
+
+    /* Requests queued while the main loop owned the ring got no kick */
+    data_plane_handle_notify(s);
+
+    while (!stopping || s->num_reqs) {
+        if (poll(fds, stopping ? 1 : ARRAY_SIZE(fds), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("virtio-blk data plane: poll: %s", strerror(errno));
+            exit(1);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            data_plane_handle_io(s);
+        }
+        if (stopping) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->stop_notifier);
+            stopping = true;
+        } else if (fds[2].revents & POLLIN) {
+            data_plane_handle_notify(s);
+        }
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->quit) {
+        if (!s->run) {
+            s->idle = true;
+            qemu_cond_broadcast(&s->cond);
+            qemu_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        qemu_mutex_unlock(&s->lock);
+        data_plane_run(s);
+        qemu_mutex_lock(&s->lock);
+    }
+    s->exited = true;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/*
+ * The image must be a raw file that raw-posix opened with aio=native, which
+ * also means O_DIRECT, and kicks must arrive through ioeventfd.  Returns
+ * NULL, after reporting why, if the device has to use the normal path.
+ */
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockDriverState *bs,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    if (!kvm_has_many_ioeventfds()) {
+        error_report("x-data-plane requires KVM with ioeventfd support");
+        return NULL;
+    }
+    fd = raw_get_aio_fd(bs);
+    if (fd < 0) {
+        error_report("x-data-plane requires a raw image with aio=native "
+                     "and cache=none");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->serial = serial;
+    s->fd = fd;
+    s->read_only = bdrv_is_read_only(bs);
+    bdrv_get_geometry(bs, &s->nb_sectors);
+
+    if (io_setup(REQ_MAX, &s->io_ctx) != 0) {
+        error_report("x-data-plane: failed to create an AIO context");
+        g_free(s);
+        return NULL;
+    }
+    if (event_notifier_init(&s->io_notifier, 0) < 0 ||
+        event_notifier_init(&s->stop_notifier, 0) < 0) {
+        error_report("x-data-plane: failed to create an eventfd");
+        exit(1);
+    }
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    virtio_blk_data_plane_stop(s);
+
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_signal(&s->cond);
+    while (!s->exited) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    io_destroy(s->io_ctx);
+    event_notifier_cleanup(&s->io_notifier);
+    event_notifier_cleanup(&s->stop_notifier);
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s);
+}
+
+/*
+ * Take the virtqueue away from virtio-blk.c.  Called on the main loop when
+ * the driver is ready and the VM runs; on failure, the device keeps using
+ * the normal path.
+ */
+int virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    VirtQueue *vq = virtio_get_queue(vdev, 0);
+    unsigned int i;
+    int r;
+
+    if (s->started) {
+        return 0;
+    }
+    if (s->stopping) {
+        return -EBUSY;
+    }
+    if (!virtio_queue_get_addr(vdev, 0) ||
+        virtio_queue_get_num(vdev, 0) > REQ_MAX) {
+        return -EINVAL;
+    }
+
+    r = vring_setup(&s->vring, vdev, 0);
+    if (r < 0) {
+        return r;
+    }
+
+    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
+    if (r < 0) {
+        error_report("virtio-blk data plane: failed to set guest notifier "
+                     "(%d)", r);
+        goto fail_vring;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    r = vdev->binding->set_host_notifier(vdev->binding_opaque, 0, true);
+    if (r < 0) {
+        error_report("virtio-blk data plane: failed to set host notifier "
+                     "(%d)", r);
+        goto fail_guest_notifiers;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    s->num_pending = 0;
+    s->num_reqs = 0;
+    s->ring_full = false;
+    s->completed = false;
+    for (i = 0; i < REQ_MAX; i++) {
+        s->free_reqs[i] = i;
+    }
+    s->num_free = REQ_MAX;
+    event_notifier_test_and_clear(&s->stop_notifier);
+
+    qemu_mutex_lock(&s->lock);
+    s->run = true;
+    s->idle = false;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+
+    s->started = true;
+    return 0;
+
+fail_guest_notifiers:
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+fail_vring:
+    vring_teardown(&s->vring, vdev, 0);
+    return r;
+}
+
+/* Wait for requests in flight and hand the virtqueue back */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    VirtQueue *vq = virtio_get_queue(vdev, 0);
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+
+    qemu_mutex_lock(&s->lock);
+    s->run = false;
+    event_notifier_set(&s->stop_notifier);
+    while (!s->idle) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    vring_teardown(&s->vring, vdev, 0);
+    s->started = false;
+
+    /* An interrupt the main loop has not picked up yet */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(vq);
+    }
+
+    /* A pending kick is handed to virtio-blk.c while unassigning */
+    vdev->binding->set_host_notifier(vdev->binding_opaque, 0, false);
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+    s->stopping = false;
+}
+
+bool virtio_blk_data_plane_started(VirtIOBlockDataPlane *s)
+{
+    return s->started;
+}
@@ -0,0 +1,25 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_VIRTIO_BLK_DATAPLANE_H
+#define HW_VIRTIO_BLK_DATAPLANE_H
+
+#include "virtio.h"
+#include "block.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockDriverState *bs,
+                                                   const char *serial);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+int virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+bool virtio_blk_data_plane_started(VirtIOBlockDataPlane *s);
+
+#endif
@@ -20,6 +20,9 @@
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "virtio-blk-dataplane.h"
+#endif
 
 typedef struct VirtIOBlock
 {
@@ -32,6 +35,9 @@ typedef struct VirtIOBlock
     char *serial;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -420,6 +426,14 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Leave the ring alone while the data plane thread owns it */
+    if (s->dataplane && virtio_blk_data_plane_started(s->dataplane)) {
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+        return;
+    }
+#endif
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
@@ -459,6 +473,16 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 {
     VirtIOBlock *s = opaque;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        if (!running) {
+            virtio_blk_data_plane_stop(s->dataplane);
+        } else if (s->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK) {
+            virtio_blk_data_plane_start(s->dataplane);
+        }
+    }
+#endif
+
     if (!running)
         return;
 
@@ -468,13 +492,29 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     }
 }
 
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (!s->dataplane) {
+        return;
+    }
+    if ((status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running) {
+        virtio_blk_data_plane_start(s->dataplane);
+    } else {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+}
+
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -571,7 +611,7 @@ static const BlockDevOps virtio_block_ops = {
 };
 
 VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
-                              char **serial)
+                              char **serial, virtio_blk_conf *blk)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -601,6 +641,7 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
+    s->vdev.set_status = virtio_blk_set_status;
     s->vdev.reset = virtio_blk_reset;
     s->bs = conf->bs;
     s->conf = conf;
@@ -615,6 +656,21 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
     s->qdev = dev;
     register_savevm(dev, "virtio-blk", virtio_blk_id++, 2,
                     virtio_blk_save, virtio_blk_load, s);
+
+    if (blk->data_plane) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        /* On failure, the reason is reported and the device stays usable */
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, s->bs,
+                                                    s->serial);
+        if (s->dataplane) {
+            /* Guest memory is written behind the back of the dirty log */
+            register_device_unmigratable(dev, "virtio-blk", s);
+            bdrv_set_in_use(s->bs, 1);
+        }
+#else
+        error_report("x-data-plane is not supported by this build");
+#endif
+    }
     bdrv_set_dev_ops(s->bs, &virtio_block_ops, s);
     bdrv_set_buffer_alignment(s->bs, conf->logical_block_size);
 
@@ -627,6 +683,12 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_blk_data_plane_destroy(s->dataplane);
+        bdrv_set_in_use(s->bs, 0);
+    }
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     virtio_cleanup(vdev);
 }
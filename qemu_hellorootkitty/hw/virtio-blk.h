@@ -88,6 +88,11 @@ struct virtio_blk_inhdr
     unsigned char status;
 };
 
+typedef struct virtio_blk_conf
+{
+    uint32_t data_plane;    /* run the queue in its own thread */
+} virtio_blk_conf;
+
 /* SCSI pass-through header */
 struct virtio_scsi_inhdr
 {
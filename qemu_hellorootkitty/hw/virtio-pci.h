@@ -16,6 +16,7 @@
 #define QEMU_VIRTIO_PCI_H
 
 #include "virtio-net.h"
+#include "virtio-blk.h"
 #include "virtio-serial.h"
 
 /* Performance improves when virtqueue kick processing is decoupled from the
@@ -40,6 +41,7 @@ typedef struct {
 #endif
     virtio_serial_conf serial;
     virtio_net_conf net;
+    virtio_blk_conf blk;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
 } VirtIOPCIProxy;
@@ -0,0 +1,462 @@
+/*
+ * Virtqueue processing without the global mutex
+ *
+ * virtio.c walks the rings with ld*_phys()/st*_phys() and maps buffers with
+ * cpu_physical_memory_map(), neither of which may be called outside the
+ * global mutex.  Here the rings and buffers are instead reached through
+ * host pointers looked up in a private copy of the guest RAM layout.
+ * Writes done this way bypass the dirty log and the TB invalidation in
+ * exec.c, so a device using this must run under KVM and block migration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <linux/virtio_ring.h>
+
+#include "vring.h"
+#include "qemu-barrier.h"
+#include "qemu-error.h"
+
+static void hostmem_remove(HostMem *hostmem, int i)
+{
+    hostmem->regions[i] = hostmem->regions[--hostmem->nregions];
+}
+
+static void hostmem_append(HostMem *hostmem, target_phys_addr_t guest_addr,
+                           ram_addr_t size, uint8_t *host_addr)
+{
+    HostMemRegion *reg;
+
+    hostmem->regions = g_realloc(hostmem->regions, (hostmem->nregions + 1) *
+                                 sizeof(hostmem->regions[0]));
+    reg = &hostmem->regions[hostmem->nregions++];
+    reg->guest_addr = guest_addr;
+    reg->size = size;
+    reg->host_addr = host_addr;
+}
+
+/* Drop [start, start + size) from every region that overlaps it */
+static void hostmem_unassign(HostMem *hostmem, target_phys_addr_t start,
+                             ram_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    int i;
+
+    for (i = 0; i < hostmem->nregions; i++) {
+        HostMemRegion *reg = &hostmem->regions[i];
+        target_phys_addr_t reg_end = reg->guest_addr + reg->size;
+
+        if (end <= reg->guest_addr || start >= reg_end) {
+            continue;
+        }
+        if (start > reg->guest_addr && end < reg_end) {
+            /* Hole in the middle: keep the head here, append the tail */
+            uint8_t *tail = reg->host_addr + (end - reg->guest_addr);
+
+            reg->size = start - reg->guest_addr;
+            hostmem_append(hostmem, end, reg_end - end, tail);
+        } else if (start > reg->guest_addr) {
+            reg->size = start - reg->guest_addr;
+        } else if (end < reg_end) {
+            reg->host_addr += end - reg->guest_addr;
+            reg->size = reg_end - end;
+            reg->guest_addr = end;
+        } else {
+            hostmem_remove(hostmem, i--);
+        }
+    }
+}
+
+/* Add a RAM range, merging it with the regions it is contiguous with */
+static void hostmem_assign(HostMem *hostmem, target_phys_addr_t start,
+                           ram_addr_t size, uint8_t *host_addr)
+{
+    int i;
+
+    for (i = 0; i < hostmem->nregions; i++) {
+        HostMemRegion *reg = &hostmem->regions[i];
+
+        if (reg->guest_addr + reg->size == start &&
+            reg->host_addr + reg->size == host_addr) {
+            start = reg->guest_addr;
+            host_addr = reg->host_addr;
+            size += reg->size;
+            hostmem_remove(hostmem, i--);
+        } else if (start + size == reg->guest_addr &&
+                   host_addr + size == reg->host_addr) {
+            size += reg->size;
+            hostmem_remove(hostmem, i--);
+        }
+    }
+    hostmem_append(hostmem, start, size, host_addr);
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      bool log_dirty)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&hostmem->lock);
+    hostmem_unassign(hostmem, start_addr, size);
+    if (flags == IO_MEM_RAM) {
+        hostmem_assign(hostmem, start_addr, size,
+                       qemu_safe_ram_ptr(phys_offset));
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    return 0;
+}
+
+void hostmem_init(HostMem *hostmem)
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->lock);
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->lock);
+    g_free(hostmem->regions);
+    hostmem->regions = NULL;
+    hostmem->nregions = 0;
+}
+
+/*
+ * Return a host pointer for guest RAM [phys, phys + len), or NULL if the
+ * range is not entirely backed by one contiguous piece of RAM.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len)
+{
+    void *host_addr = NULL;
+    int i;
+
+    qemu_mutex_lock(&hostmem->lock);
+    for (i = 0; i < hostmem->nregions; i++) {
+        HostMemRegion *reg = &hostmem->regions[i];
+
+        if (phys >= reg->guest_addr &&
+            phys - reg->guest_addr + len <= reg->size) {
+            host_addr = reg->host_addr + (phys - reg->guest_addr);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+    return host_addr;
+}
+
+/* The event index fields live just past the end of the other side's ring */
+static uint16_t *vring_used_event_ptr(Vring *vring)
+{
+    return &vring->avail->ring[vring->num];
+}
+
+static uint16_t *vring_avail_event_ptr(Vring *vring)
+{
+    return (uint16_t *)&vring->used->ring[vring->num];
+}
+
+static bool vring_has_feature(Vring *vring, unsigned int fbit)
+{
+    return vring->vdev->guest_features & (1 << fbit);
+}
+
+/* Must be called on the main loop, with the queue not being processed */
+int vring_setup(Vring *vring, VirtIODevice *vdev, int n)
+{
+    vring->vdev = vdev;
+    vring->num = virtio_queue_get_num(vdev, n);
+    if (vring->num == 0) {
+        return -EINVAL;
+    }
+
+    hostmem_init(&vring->hostmem);
+    vring->desc = hostmem_lookup(&vring->hostmem,
+                                 virtio_queue_get_desc_addr(vdev, n),
+                                 virtio_queue_get_desc_size(vdev, n));
+    vring->avail = hostmem_lookup(&vring->hostmem,
+                                  virtio_queue_get_avail_addr(vdev, n),
+                                  virtio_queue_get_avail_size(vdev, n));
+    vring->used = hostmem_lookup(&vring->hostmem,
+                                 virtio_queue_get_used_addr(vdev, n),
+                                 virtio_queue_get_used_size(vdev, n) +
+                                 sizeof(uint16_t));
+    if (!vring->desc || !vring->avail || !vring->used) {
+        error_report("virtqueue %d is not in contiguous guest RAM", n);
+        hostmem_finalize(&vring->hostmem);
+        return -EFAULT;
+    }
+
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = lduw_p(&vring->used->idx);
+    vring->signalled_used = 0;
+    vring->signalled_used_valid = false;
+    vring->inuse = 0;
+    vring->broken = false;
+    return 0;
+}
+
+/* Hand the queue back to virtio.c; all popped requests must be pushed */
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+    hostmem_finalize(&vring->hostmem);
+}
+
+void vring_disable_notification(Vring *vring)
+{
+    if (!vring_has_feature(vring, VIRTIO_RING_F_EVENT_IDX)) {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) | VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/*
+ * Ask the guest to kick again.  Returns true if buffers were added in the
+ * meantime, for which no kick will come.
+ */
+bool vring_enable_notification(Vring *vring)
+{
+    if (vring_has_feature(vring, VIRTIO_RING_F_EVENT_IDX)) {
+        stw_p(vring_avail_event_ptr(vring), vring->last_avail_idx);
+    } else {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) & ~VRING_USED_F_NO_NOTIFY);
+    }
+    /* Publish the flag before checking for more work */
+    smp_mb();
+    return lduw_p(&vring->avail->idx) != vring->last_avail_idx;
+}
+
+/* Same rules as vring_notify() in virtio.c */
+bool vring_should_notify(Vring *vring)
+{
+    uint16_t old, new;
+    bool v;
+
+    /* Flush the used ring before reading the guest's suppression state */
+    smp_mb();
+
+    if (vring_has_feature(vring, VIRTIO_F_NOTIFY_ON_EMPTY) &&
+        !vring->inuse &&
+        lduw_p(&vring->avail->idx) == vring->last_avail_idx) {
+        return true;
+    }
+
+    if (!vring_has_feature(vring, VIRTIO_RING_F_EVENT_IDX)) {
+        return !(lduw_p(&vring->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = vring->signalled_used_valid;
+    old = vring->signalled_used;
+    new = vring->signalled_used = vring->last_used_idx;
+    vring->signalled_used_valid = true;
+
+    if (unlikely(!v)) {
+        return true;
+    }
+    return vring_need_event(lduw_p(vring_used_event_ptr(vring)), new, old);
+}
+
+static int vring_map_desc(Vring *vring, VRingDesc *desc, struct iovec iov[],
+                          unsigned int iov_size, unsigned int *out_num,
+                          unsigned int *in_num)
+{
+    uint64_t addr = ldq_p(&desc->addr);
+    uint32_t len = ldl_p(&desc->len);
+    struct iovec *iovec;
+
+    if (*out_num + *in_num >= iov_size) {
+        error_report("Too many descriptors in a virtio-blk request");
+        return -ENOBUFS;
+    }
+    if (!(lduw_p(&desc->flags) & VRING_DESC_F_WRITE) && *in_num) {
+        error_report("Readable descriptor after writable ones");
+        return -EFAULT;
+    }
+
+    iovec = &iov[*out_num + *in_num];
+    iovec->iov_base = hostmem_lookup(&vring->hostmem, addr, len);
+    if (!iovec->iov_base) {
+        error_report("Descriptor %#" PRIx64 "+%#x is not in guest RAM",
+                     addr, len);
+        return -EFAULT;
+    }
+    iovec->iov_len = len;
+
+    if (lduw_p(&desc->flags) & VRING_DESC_F_WRITE) {
+        (*in_num)++;
+    } else {
+        (*out_num)++;
+    }
+    return 0;
+}
+
+static int vring_map_indirect(Vring *vring, VRingDesc *indirect,
+                              struct iovec iov[], unsigned int iov_size,
+                              unsigned int *out_num, unsigned int *in_num)
+{
+    uint32_t len = ldl_p(&indirect->len);
+    unsigned int i = 0, count, found = 0;
+    VRingDesc *desc;
+    int ret;
+
+    if (len == 0 || len % sizeof(VRingDesc)) {
+        error_report("Invalid size for indirect buffer table");
+        return -EFAULT;
+    }
+    count = len / sizeof(VRingDesc);
+
+    desc = hostmem_lookup(&vring->hostmem, ldq_p(&indirect->addr), len);
+    if (!desc) {
+        error_report("Indirect buffer table is not in guest RAM");
+        return -EFAULT;
+    }
+
+    for (;;) {
+        if (++found > count) {
+            error_report("Loop detected in indirect buffer table");
+            return -EFAULT;
+        }
+        if (lduw_p(&desc[i].flags) & VRING_DESC_F_INDIRECT) {
+            error_report("Nested indirect descriptor");
+            return -EFAULT;
+        }
+        ret = vring_map_desc(vring, &desc[i], iov, iov_size, out_num, in_num);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!(lduw_p(&desc[i].flags) & VRING_DESC_F_NEXT)) {
+            return 0;
+        }
+        i = lduw_p(&desc[i].next);
+        if (i >= count) {
+            error_report("Desc next is %u", i);
+            return -EFAULT;
+        }
+    }
+}
+
+/*
+ * Map the next available request into iov[], readable buffers first.
+ * Returns its head index, -EAGAIN if the ring is empty, or another negative
+ * errno if the guest handed us garbage, after which the ring stays broken
+ * until it is set up again.
+ */
+int vring_pop(Vring *vring, struct iovec iov[], unsigned int iov_size,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    unsigned int i, head, found = 0, num = vring->num;
+    uint16_t avail_idx, last_avail_idx = vring->last_avail_idx;
+    int ret;
+
+    if (vring->broken) {
+        return -EFAULT;
+    }
+
+    avail_idx = lduw_p(&vring->avail->idx);
+    /* Read the ring entries only after seeing the index */
+    smp_rmb();
+
+    if ((uint16_t)(avail_idx - last_avail_idx) > num) {
+        error_report("Guest moved used index from %u to %u",
+                     last_avail_idx, avail_idx);
+        ret = -EFAULT;
+        goto broken;
+    }
+    if (avail_idx == last_avail_idx) {
+        return -EAGAIN;
+    }
+
+    head = lduw_p(&vring->avail->ring[last_avail_idx % num]);
+    if (head >= num) {
+        error_report("Guest says index %u is available", head);
+        ret = -EFAULT;
+        goto broken;
+    }
+
+    *out_num = *in_num = 0;
+    i = head;
+    for (;;) {
+        VRingDesc *desc = &vring->desc[i];
+
+        if (++found > num) {
+            error_report("Looped descriptor");
+            ret = -EFAULT;
+            goto broken;
+        }
+        if (lduw_p(&desc->flags) & VRING_DESC_F_INDIRECT) {
+            ret = vring_map_indirect(vring, desc, iov, iov_size,
+                                     out_num, in_num);
+        } else {
+            ret = vring_map_desc(vring, desc, iov, iov_size, out_num, in_num);
+        }
+        if (ret < 0) {
+            goto broken;
+        }
+        if (!(lduw_p(&desc->flags) & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = lduw_p(&desc->next);
+        if (i >= num) {
+            error_report("Desc next is %u", i);
+            ret = -EFAULT;
+            goto broken;
+        }
+    }
+
+    vring->last_avail_idx++;
+    vring->inuse++;
+    return head;
+
+broken:
+    vring->broken = true;
+    return ret;
+}
+
+/* Complete the request popped as head, with len bytes written to it */
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    VRingUsedElem *elem;
+    uint16_t new;
+
+    elem = &vring->used->ring[vring->last_used_idx % vring->num];
+    stl_p(&elem->id, head);
+    stl_p(&elem->len, len);
+
+    /* The element must be visible before the index that covers it */
+    smp_wmb();
+
+    new = vring->last_used_idx + 1;
+    stw_p(&vring->used->idx, new);
+    vring->inuse--;
+
+    /* The index wrapped past the last value we signalled: re-arm */
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - vring->last_used_idx))) {
+        vring->signalled_used_valid = false;
+    }
+    vring->last_used_idx = new;
+}
@@ -0,0 +1,67 @@
+/*
+ * Virtqueue processing without the global mutex
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_VRING_H
+#define QEMU_VRING_H
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "virtio.h"
+
+/*
+ * A copy of the guest RAM layout, kept up to date by a memory client on the
+ * main loop, so that another thread can translate guest physical addresses
+ * without calling into exec.c.
+ */
+typedef struct HostMemRegion {
+    target_phys_addr_t guest_addr;
+    ram_addr_t size;
+    uint8_t *host_addr;
+} HostMemRegion;
+
+typedef struct HostMem {
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+    HostMemRegion *regions;
+    int nregions;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem);
+void hostmem_finalize(HostMem *hostmem);
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len);
+
+/*
+ * The consumer side of a virtqueue.  While a Vring is set up, it owns the
+ * queue: the device must not call virtqueue_pop() or virtqueue_push().
+ */
+typedef struct Vring {
+    HostMem hostmem;
+    VirtIODevice *vdev;
+    unsigned int num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    uint16_t last_used_idx;
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    unsigned int inuse;         /* popped but not yet pushed */
+    bool broken;                /* the guest gave us a bad descriptor */
+} Vring;
+
+int vring_setup(Vring *vring, VirtIODevice *vdev, int n);
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
+void vring_disable_notification(Vring *vring);
+bool vring_enable_notification(Vring *vring);
+bool vring_should_notify(Vring *vring);
+int vring_pop(Vring *vring, struct iovec iov[], unsigned int iov_size,
+              unsigned int *out_num, unsigned int *in_num);
+void vring_push(Vring *vring, unsigned int head, int len);
+
+#endif
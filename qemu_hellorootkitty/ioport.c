@@ -28,6 +28,7 @@
 #include "ioport.h"
 #include "trace.h"
 #include "memory.h"
+#include "main-loop.h"
 
 /***********************************************************/
 /* IO Port */
@@ -64,9 +65,21 @@ static uint32_t ioport_read(int index, uint32_t address)
         default_ioport_readl
     };
     IOPortReadFunc *func = ioport_read_table[index][address];
+    uint32_t data;
+    bool locked = false;
+
     if (!func)
         func = default_func[index];
-    return func(ioport_opaque[address], address);
+    /* VCPU threads of multi-threaded TCG run without the mutex */
+    if (mttcg_enabled && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    data = func(ioport_opaque[address], address);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return data;
 }
 
 static void ioport_write(int index, uint32_t address, uint32_t data)
@@ -77,9 +90,18 @@ static void ioport_write(int index, uint32_t address, uint32_t data)
         default_ioport_writel
     };
     IOPortWriteFunc *func = ioport_write_table[index][address];
+    bool locked = false;
+
     if (!func)
         func = default_func[index];
+    if (mttcg_enabled && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
     func(ioport_opaque[address], address, data);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static uint32_t default_ioport_readb(void *opaque, uint32_t address)
@@ -339,6 +339,17 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the calling thread holds
+ * the main loop mutex.
+ *
+ * With "-machine tcg_threads=multi", VCPU threads execute guest code
+ * without holding the main loop mutex and only take it around device
+ * emulation.  Code that can be reached both ways uses this function
+ * to decide whether it has to take the mutex itself.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
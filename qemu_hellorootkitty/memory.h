@@ -36,6 +36,7 @@ typedef struct MemoryRegionMmio MemoryRegionMmio;
  */
 #define DIRTY_MEMORY_VGA       0
 #define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_SNAPSHOT  2
 #define DIRTY_MEMORY_MIGRATION 3
 
 struct MemoryRegionMmio {
@@ -42,6 +42,12 @@ static int file_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t file_writev(MigrationState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int exec_close(MigrationState *s)
 {
     int ret = 0;
@@ -84,6 +90,7 @@ int exec_start_outgoing_migration(MigrationState *s, const char *command)
     s->close = exec_close;
     s->get_error = file_errno;
     s->write = file_write;
+    s->writev = file_writev;
 
     migrate_fd_connect(s);
     return 0;
@@ -17,6 +17,7 @@
 #include "qemu-char.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "multifd.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -38,6 +39,44 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+#ifndef _WIN32
+static ssize_t socket_writev(MigrationState *s, const struct iovec *iov,
+                             int iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    return sendmsg(s->fd, &msg, 0);
+}
+#endif
+
+/* address of the outgoing migration, for the multifd channels */
+static struct sockaddr_in outgoing_addr;
+
+static int tcp_open_channel(MigrationState *s)
+{
+    int fd, ret;
+
+    fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -socket_error();
+    }
+
+    do {
+        ret = connect(fd, (struct sockaddr *)&outgoing_addr,
+                      sizeof(outgoing_addr));
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        ret = -socket_error();
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
 static int tcp_close(MigrationState *s)
 {
     DPRINTF("tcp_close\n");
@@ -86,7 +125,12 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port)
 
     s->get_error = socket_errno;
     s->write = socket_write;
+#ifndef _WIN32
+    s->writev = socket_writev;
+#endif
     s->close = tcp_close;
+    s->open_channel = tcp_open_channel;
+    outgoing_addr = addr;
 
     s->fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
     if (s->fd == -1) {
@@ -135,13 +179,22 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out2;
     }
 
+    /* the multifd channels connect right after the main socket */
+    if (migrate_use_multifd() && multifd_load_setup(s) < 0) {
+        fprintf(stderr, "could not accept multifd channels\n");
+        goto out;
+    }
+
     f = qemu_fopen_socket(c);
     if (f == NULL) {
         fprintf(stderr, "could not qemu_fopen socket\n");
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f) == 1) {
+        /* postcopy closes the socket once the RAM is loaded */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -174,7 +227,7 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         goto err;
     }
-    if (listen(s, 1) == -1) {
+    if (listen(s, 1 + MAX_MULTIFD_CHANNELS) == -1) {
         goto err;
     }
 
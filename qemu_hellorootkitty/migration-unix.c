@@ -38,6 +38,12 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
 static int unix_close(MigrationState *s)
 {
     DPRINTF("unix_close\n");
@@ -83,6 +89,7 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
 
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
@@ -138,7 +145,10 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f) == 1) {
+        /* postcopy closes the socket once the RAM is loaded */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -19,7 +19,10 @@
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
+#include "multifd.h"
+#include "cpus.h"
 #include "qmp-commands.h"
+#include "qerror.h"
 
 //#define DEBUG_MIGRATION
 
@@ -41,6 +44,20 @@ enum {
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* Default tunables of the compress capability */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+
+/* Default size of the xbzrle page cache */
+#define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
+
+/* Default number of precopy passes before switching to postcopy */
+#define DEFAULT_MIGRATE_POSTCOPY_PASSES 2
+
+/* Default number of additional connections of the multifd capability */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -48,11 +65,17 @@ static NotifierList migration_state_notifiers =
    migrations at once.  For now we don't need to add
    dynamic creation of migration */
 
-static MigrationState *migrate_get_current(void)
+MigrationState *migrate_get_current(void)
 {
     static MigrationState current_migration = {
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .postcopy_passes = DEFAULT_MIGRATE_POSTCOPY_PASSES,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
     };
 
     return &current_migration;
@@ -80,9 +103,17 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns 1 if the source switched to postcopy: the rest of the stream is
+ * then loaded in the background, and f and its socket must not be closed.
+ */
+int process_incoming_migration(QEMUFile *f)
 {
-    if (qemu_loadvm_state(f) < 0) {
+    int ret;
+
+    ret = qemu_loadvm_state(f);
+    multifd_load_cleanup(ret < 0);
+    if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
@@ -94,6 +125,7 @@ void process_incoming_migration(QEMUFile *f)
     } else {
         runstate_set(RUN_STATE_PRELAUNCH);
     }
+    return ret;
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -107,6 +139,41 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+static void get_xbzrle_cache_stats(MigrationInfo *info)
+{
+    if (migrate_use_xbzrle()) {
+        info->has_xbzrle_cache = true;
+        info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
+        info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
+        info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
+        info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
+        info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+    }
+}
+
+static void get_ram_stats(MigrationInfo *info, MigrationState *s)
+{
+    info->has_ram = true;
+    info->ram = g_malloc0(sizeof(*info->ram));
+    info->ram->transferred = ram_bytes_transferred();
+    info->ram->remaining = ram_bytes_remaining();
+    info->ram->total = ram_bytes_total();
+    info->ram->has_duplicate = true;
+    info->ram->duplicate = dup_mig_pages_transferred();
+    info->ram->has_normal = true;
+    info->ram->normal = norm_mig_pages_transferred();
+    info->ram->has_normal_bytes = true;
+    info->ram->normal_bytes = norm_mig_bytes_transferred();
+    info->ram->has_dirty_pages_rate = true;
+    info->ram->dirty_pages_rate = ram_dirty_pages_rate();
+    info->ram->has_dirty_sync_count = true;
+    info->ram->dirty_sync_count = ram_dirty_sync_count();
+    info->ram->has_mbps = true;
+    info->ram->mbps = s->mbps;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -118,13 +185,21 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
+
+        info->has_total_time = true;
+        info->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+        info->has_setup_time = true;
+        info->setup_time = s->setup_time;
+        if (s->postcopy) {
+            info->has_downtime = true;
+            info->downtime = s->downtime;
+        } else {
+            info->has_expected_downtime = true;
+            info->expected_downtime = s->expected_downtime;
+        }
 
-        info->has_ram = true;
-        info->ram = g_malloc0(sizeof(*info->ram));
-        info->ram->transferred = ram_bytes_transferred();
-        info->ram->remaining = ram_bytes_remaining();
-        info->ram->total = ram_bytes_total();
+        get_ram_stats(info, s);
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -132,11 +207,34 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->transferred = blk_mig_bytes_transferred();
             info->disk->remaining = blk_mig_bytes_remaining();
             info->disk->total = blk_mig_bytes_total();
+            info->disk->has_duplicate = true;
+            info->disk->duplicate = blk_mig_dup_blocks_transferred();
+            info->disk->has_normal = true;
+            info->disk->normal = blk_mig_norm_blocks_transferred();
+            info->disk->has_normal_bytes = true;
+            info->disk->normal_bytes = blk_mig_norm_bytes_transferred();
+        }
+
+        get_xbzrle_cache_stats(info);
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
         }
         break;
     case MIG_STATE_COMPLETED:
         info->has_status = true;
         info->status = g_strdup("completed");
+
+        info->has_total_time = true;
+        info->total_time = s->total_time;
+        info->has_setup_time = true;
+        info->setup_time = s->setup_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+
+        get_ram_stats(info, s);
+        get_xbzrle_cache_stats(info);
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -151,6 +249,214 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
+{
+    MigrationCapabilityStatusList *head = NULL, **prev = &head;
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        MigrationCapabilityStatusList *caps = g_malloc0(sizeof(*caps));
+
+        caps->value = g_malloc0(sizeof(*caps->value));
+        caps->value->capability = i;
+        caps->value->state = s->enabled_capabilities[i];
+        *prev = caps;
+        prev = &caps->next;
+    }
+
+    return head;
+}
+
+void qmp_migrate_set_capability(MigrationCapability capability, bool state,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    s->enabled_capabilities[capability] = state;
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+    MigrationState *s = migrate_get_current();
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_threads;
+    params->decompress_threads = s->decompress_threads;
+    params->postcopy_passes = s->postcopy_passes;
+    params->multifd_channels = s->multifd_channels;
+
+    return params;
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_postcopy_passes,
+                                int64_t postcopy_passes,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "an integer in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 || compress_threads > MAX_MIGRATE_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "an integer in the range of 1 to 64");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 || decompress_threads > MAX_MIGRATE_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 1 to 64");
+        return;
+    }
+    if (has_postcopy_passes && (postcopy_passes < 0 ||
+                                postcopy_passes > INT_MAX)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "postcopy-passes",
+                  "a non-negative integer");
+        return;
+    }
+    if (has_multifd_channels &&
+        (multifd_channels < 1 || multifd_channels > MAX_MULTIFD_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd-channels",
+                  "an integer in the range of 1 to 16");
+        return;
+    }
+    if (has_multifd_channels && s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_threads = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+    if (has_postcopy_passes) {
+        s->postcopy_passes = postcopy_passes;
+    }
+    if (has_multifd_channels) {
+        s->multifd_channels = multifd_channels;
+    }
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_use_postcopy()) {
+        error_set(errp, QERR_FEATURE_DISABLED, "postcopy-ram");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_NOT_ACTIVE);
+        return;
+    }
+
+    /* switch at the next iteration */
+    s->start_postcopy = true;
+}
+
+void qmp_migrate_set_cache_size(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t new_size;
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "at least one page");
+        return;
+    }
+
+    s->xbzrle_cache_size = new_size;
+}
+
+int64_t qmp_query_migrate_cache_size(Error **errp)
+{
+    return migrate_xbzrle_cache_size();
+}
+
+bool migrate_use_compression(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    return migrate_get_current()->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    return migrate_get_current()->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    return migrate_get_current()->decompress_threads;
+}
+
+bool migrate_use_xbzrle(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_XBZRLE];
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return migrate_get_current()->xbzrle_cache_size;
+}
+
+bool migrate_use_zero_blocks(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+bool migrate_use_postcopy(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+bool migrate_use_multifd(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    return migrate_get_current()->multifd_channels;
+}
+
+bool migrate_auto_converge(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
 /* shared migration helpers */
 
 static void migrate_fd_monitor_suspend(MigrationState *s, Monitor *mon)
@@ -169,6 +475,7 @@ static int migrate_fd_cleanup(MigrationState *s)
     int ret = 0;
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    cpu_throttle_stop();
 
     if (s->file) {
         DPRINTF("closing file\n");
@@ -176,6 +483,10 @@ static int migrate_fd_cleanup(MigrationState *s)
             ret = -1;
         }
         s->file = NULL;
+        /* the channels may wait for the end of the main stream */
+        if (multifd_save_cleanup(s->state != MIG_STATE_ACTIVE) < 0) {
+            ret = -1;
+        }
     } else {
         if (s->mon) {
             monitor_resume(s->mon);
@@ -198,9 +509,20 @@ void migrate_fd_error(MigrationState *s)
     migrate_fd_cleanup(s);
 }
 
+/* Bytes written so far, by the main stream and by the multifd channels */
+static uint64_t migrate_bytes_sent(MigrationState *s)
+{
+    return qemu_ftell(s->file) + multifd_save_bytes_transferred();
+}
+
 static void migrate_fd_completed(MigrationState *s)
 {
     DPRINTF("setting completed state\n");
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+    if (s->total_time) {
+        /* average over the whole migration */
+        s->mbps = (double)migrate_bytes_sent(s) * 8 / 1000 / s->total_time;
+    }
     if (migrate_fd_cleanup(s) < 0) {
         s->state = MIG_STATE_ERROR;
     } else {
@@ -210,11 +532,97 @@ static void migrate_fd_completed(MigrationState *s)
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
+static void migrate_fd_put_notify(void *opaque);
+static void migrate_fd_put_ready(void *opaque);
+
+/*
+ * Measure the bandwidth over periods of at least 100ms, and deduce how
+ * long the guest would be stopped if the migration completed now.
+ */
+static void migrate_update_bandwidth(MigrationState *s)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t bytes = migrate_bytes_sent(s);
+    double bandwidth;
+
+    if (now - s->xfer_time < 100) {
+        return;
+    }
+
+    /* in bytes per millisecond */
+    bandwidth = (double)(bytes - s->xfer_bytes) / (now - s->xfer_time);
+    s->mbps = bandwidth * 8 / 1000;
+    if (bandwidth > 0) {
+        s->expected_downtime = ram_bytes_remaining() / bandwidth;
+    }
+    s->xfer_time = now;
+    s->xfer_bytes = bytes;
+}
+
+/*
+ * In postcopy, the destination sends its page requests back on the
+ * migration socket.
+ */
+static void migrate_fd_return_read(void *opaque)
+{
+    MigrationState *s = opaque;
+    uint8_t *msg = s->rp_buf;
+    char idstr[256];
+    ssize_t len;
+    int size;
+
+    do {
+        len = qemu_recv(s->fd, s->rp_buf + s->rp_len,
+                        sizeof(s->rp_buf) - s->rp_len, 0);
+    } while (len == -1 && socket_error() == EINTR);
+
+    if (len == -1 && socket_error() == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        DPRINTF("return path closed\n");
+        migrate_fd_error(s);
+        return;
+    }
+    s->rp_len += len;
+
+    while (s->rp_len >= 2) {
+        if (msg[0] != MIG_RP_MSG_REQ_PAGE) {
+            DPRINTF("bad message %d on the return path\n", msg[0]);
+            migrate_fd_error(s);
+            return;
+        }
+        size = 2 + msg[1] + 8;
+        if (s->rp_len < size) {
+            break;
+        }
+        memcpy(idstr, msg + 2, msg[1]);
+        idstr[msg[1]] = 0;
+        if (ram_save_queue_page(idstr, ldq_be_p(msg + 2 + msg[1])) < 0) {
+            DPRINTF("bad page request for block %s\n", idstr);
+            migrate_fd_error(s);
+            return;
+        }
+        s->rp_len -= size;
+        memmove(s->rp_buf, s->rp_buf + size, s->rp_len);
+    }
+
+    /* the guest is waiting, do not wait for the next tick of the file */
+    migrate_fd_put_ready(s);
+}
+
+static void migrate_fd_set_handlers(MigrationState *s, bool wait_write)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy ? migrate_fd_return_read : NULL,
+                         wait_write ? migrate_fd_put_notify : NULL, s);
+}
+
 static void migrate_fd_put_notify(void *opaque)
 {
     MigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    migrate_fd_set_handlers(s, false);
     qemu_file_put_notify(s->file);
     if (s->file && qemu_file_get_error(s->file)) {
         migrate_fd_error(s);
@@ -239,12 +647,62 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
         ret = -(s->get_error(s));
 
     if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+        migrate_fd_set_handlers(s, true);
+    }
+
+    return ret;
+}
+
+static ssize_t migrate_fd_writev_buffer(void *opaque, const struct iovec *iov,
+                                        int iovcnt)
+{
+    MigrationState *s = opaque;
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1) {
+        ret = -(s->get_error(s));
+    }
+
+    if (ret == -EAGAIN) {
+        migrate_fd_set_handlers(s, true);
     }
 
     return ret;
 }
 
+/*
+ * Stop the VM and send what the destination needs to run it.  From then
+ * on the pages are sent by the iterations, the ones the destination asks
+ * for first.
+ */
+static void migrate_fd_start_postcopy(MigrationState *s)
+{
+    int old_vm_running = runstate_is_running();
+    int64_t stop_time = qemu_get_clock_ms(rt_clock);
+
+    DPRINTF("switching to postcopy\n");
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    s->postcopy = true;
+    migrate_fd_set_handlers(s, false);
+    if (qemu_savevm_state_postcopy(s->mon, s->file) < 0) {
+        migrate_fd_error(s);
+        if (old_vm_running) {
+            vm_start();
+        }
+        return;
+    }
+    s->downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+}
+
 static void migrate_fd_put_ready(void *opaque)
 {
     MigrationState *s = opaque;
@@ -255,12 +713,31 @@ static void migrate_fd_put_ready(void *opaque)
         return;
     }
 
+    if (migrate_use_postcopy() && !s->postcopy &&
+        (s->start_postcopy ||
+         (s->postcopy_passes &&
+          ram_save_completed_passes() >= s->postcopy_passes))) {
+        migrate_fd_start_postcopy(s);
+        return;
+    }
+
     DPRINTF("iterate\n");
     ret = qemu_savevm_state_iterate(s->mon, s->file);
     if (ret < 0) {
         migrate_fd_error(s);
-    } else if (ret == 1) {
+    } else if (ret == 0) {
+        migrate_update_bandwidth(s);
+    } else if (s->postcopy) {
+        /* the VM is already stopped, and runs on the destination */
+        DPRINTF("done postcopy\n");
+        if (qemu_savevm_state_postcopy_complete(s->mon, s->file) < 0) {
+            migrate_fd_error(s);
+        } else {
+            migrate_fd_completed(s);
+        }
+    } else {
         int old_vm_running = runstate_is_running();
+        int64_t stop_time = qemu_get_clock_ms(rt_clock);
 
         DPRINTF("done iterating\n");
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
@@ -270,6 +747,7 @@ static void migrate_fd_put_ready(void *opaque)
         } else {
             migrate_fd_completed(s);
         }
+        s->downtime = qemu_get_clock_ms(rt_clock) - stop_time;
         if (s->state != MIG_STATE_COMPLETED) {
             if (old_vm_running) {
                 vm_start();
@@ -360,6 +838,8 @@ void migrate_fd_connect(MigrationState *s)
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_writev_buffer
+                                                : NULL,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -371,6 +851,9 @@ void migrate_fd_connect(MigrationState *s)
         migrate_fd_error(s);
         return;
     }
+    s->xfer_time = qemu_get_clock_ms(rt_clock);
+    s->xfer_bytes = migrate_bytes_sent(s);
+    s->setup_time = s->xfer_time - s->start_time;
     migrate_fd_put_ready(s);
 }
 
@@ -378,11 +861,30 @@ static MigrationState *migrate_init(Monitor *mon, int detach, int blk, int inc)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
+    int decompress_threads = s->decompress_threads;
+    int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int postcopy_passes = s->postcopy_passes;
+    int multifd_channels = s->multifd_channels;
+
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
+    s->xbzrle_cache_size = xbzrle_cache_size;
+    s->postcopy_passes = postcopy_passes;
+    s->multifd_channels = multifd_channels;
     s->blk = blk;
     s->shared = inc;
+    s->start_time = qemu_get_clock_ms(rt_clock);
     s->mon = NULL;
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -408,11 +910,42 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         monitor_printf(mon, "migration already in progress\n");
         return -1;
     }
+    if (snapshot_live_is_active()) {
+        monitor_printf(mon, "live snapshot in progress\n");
+        return -1;
+    }
 
     if (qemu_savevm_state_blocked(mon)) {
         return -1;
     }
 
+    if (migrate_use_postcopy()) {
+        /* page requests need a return channel, and disks have no faults */
+        if (blk || inc) {
+            monitor_printf(mon, "postcopy does not support block "
+                           "migration\n");
+            return -1;
+        }
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            monitor_printf(mon, "postcopy needs a tcp: or unix: "
+                           "migration\n");
+            return -1;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        /* pages would race between the channels and the return path */
+        if (migrate_use_postcopy() || migrate_use_compression()) {
+            monitor_printf(mon, "multifd cannot be combined with the "
+                           "postcopy-ram and compress capabilities\n");
+            return -1;
+        }
+        if (!strstart(uri, "tcp:", NULL)) {
+            monitor_printf(mon, "multifd needs a tcp: migration\n");
+            return -1;
+        }
+    }
+
     s = migrate_init(mon, detach, blk, inc);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -458,6 +991,7 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data)
     s = migrate_get_current();
     s->bandwidth_limit = d;
     qemu_file_set_rate_limit(s->file, s->bandwidth_limit);
+    multifd_save_set_rate_limit(s->bandwidth_limit);
 
     return 0;
 }
@@ -17,6 +17,20 @@
 #include "qdict.h"
 #include "qemu-common.h"
 #include "notify.h"
+#include "qapi-types.h"
+
+/* Upper bound of the compress-threads and decompress-threads parameters */
+#define MAX_MIGRATE_THREADS 64
+
+/* Upper bound of the multifd-channels parameter */
+#define MAX_MULTIFD_CHANNELS 16
+
+/*
+ * Messages from the destination to the source in postcopy, sent back on
+ * the migration socket.  A page request is followed by the length and
+ * name of the RAM block, and the be64 offset of the page in the block.
+ */
+#define MIG_RP_MSG_REQ_PAGE 1
 
 typedef struct MigrationState MigrationState;
 
@@ -30,12 +44,37 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    ssize_t (*writev)(MigrationState *s, const struct iovec *iov, int iovcnt);
+    /* connect an additional, blocking socket to the destination */
+    int (*open_channel)(MigrationState *s);
     void *opaque;
     int blk;
     int shared;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    int64_t xbzrle_cache_size;
+    int postcopy_passes;
+    int multifd_channels;
+    bool start_postcopy;
+    bool postcopy;
+    /* partial message read from the return path */
+    uint8_t rp_buf[2 + 255 + 8];
+    int rp_len;
+    /* statistics, times are in milliseconds of rt_clock */
+    int64_t start_time;
+    int64_t total_time;
+    int64_t setup_time;
+    int64_t downtime;
+    int64_t expected_downtime;
+    double mbps;
+    /* start of the current bandwidth measurement */
+    int64_t xfer_time;
+    uint64_t xfer_bytes;
 };
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -80,9 +119,38 @@ bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+bool migrate_use_xbzrle(void);
+int64_t migrate_xbzrle_cache_size(void);
+bool migrate_use_zero_blocks(void);
+bool migrate_use_postcopy(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+bool migrate_auto_converge(void);
+MigrationState *migrate_get_current(void);
+
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t dup_mig_pages_transferred(void);
+uint64_t norm_mig_pages_transferred(void);
+uint64_t norm_mig_bytes_transferred(void);
+uint64_t ram_dirty_pages_rate(void);
+uint64_t ram_dirty_sync_count(void);
+int ram_save_completed_passes(void);
+int ram_save_queue_page(const char *idstr, uint64_t offset);
+int ram_snapshot_begin(bool incremental);
+void ram_snapshot_end(bool completed);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+double xbzrle_mig_cache_hit_rate(void);
+uint64_t xbzrle_mig_pages_overflow(void);
 
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
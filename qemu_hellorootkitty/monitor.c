@@ -1073,6 +1073,25 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+    if (!option || !strcmp(option, "on")) {
+        tb_profile_enable(true);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_enable(false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
+static void do_tb_profile_top(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 20);
+
+    dump_tb_profile((FILE *)mon, monitor_fprintf, count);
+}
+
 static void encrypted_bdrv_it(void *opaque, BlockDriverState *bs);
 
 struct bdrv_iterate_context {
@@ -2560,6 +2579,11 @@ static void do_loadvm(Monitor *mon, const QDict *qdict)
     int saved_vm_running  = runstate_is_running();
     const char *name = qdict_get_str(qdict, "name");
 
+    if (snapshot_live_is_active()) {
+        monitor_printf(mon, "live snapshot in progress\n");
+        return;
+    }
+
     vm_stop(RUN_STATE_RESTORE_VM);
 
     if (load_vmstate(name) == 0 && saved_vm_running) {
@@ -2849,6 +2873,34 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.info = hmp_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .mhandler.info = hmp_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "migrate_cache_size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .mhandler.info = hmp_info_migrate_cache_size,
+    },
+    {
+        .name       = "snapshot_live",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the status of the last live snapshot",
+        .mhandler.info = hmp_info_snapshot_live,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -0,0 +1,948 @@
+/*
+ * Migration of the guest RAM over several connections
+ *
+ * With the multifd capability, the source opens a few more connections
+ * to the destination after the main one, and stripes the RAM pages it
+ * would have put in the main stream over them.  Every connection has a
+ * thread on each side: the sender writes the queued pages straight from
+ * guest memory, and the receiver reads them straight into it.  The rest
+ * of the migration (device state, zero pages, XBZRLE pages) still goes
+ * through the main stream.
+ *
+ * A page is sent at most once between two RAM sections of the main
+ * stream.  At the end of each section the source puts a sync point on
+ * every channel, and the destination only goes on with the main stream
+ * once all channels have reached it, holding the channels there in the
+ * meantime.  The copies of a page can thus never be applied out of
+ * order, whichever connection they travel on.  The RAM sections of the
+ * main stream carry RAM_SAVE_FLAG_MULTIFD, so that a destination which
+ * does not expect the channels refuses the migration.
+ *
+ * Channel stream: a 12 byte header (magic, channel id, number of
+ * channels), then packets starting with a be64 page offset ORed with
+ * MULTIFD_FLAG_*.  A page is followed by the RAM block name unless
+ * MULTIFD_FLAG_CONTINUE is set, then by the page data; a sync point is
+ * followed by its be64 number.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "migration.h"
+#include "multifd.h"
+
+//#define DEBUG_MULTIFD
+
+#ifdef DEBUG_MULTIFD
+#define DPRINTF(fmt, ...) \
+    do { printf("multifd: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifndef _WIN32
+
+#define MULTIFD_MAGIC 0x4d464443 /* "MFDC" */
+
+#define MULTIFD_FLAG_PAGE      0x01
+#define MULTIFD_FLAG_CONTINUE  0x02
+#define MULTIFD_FLAG_SYNC      0x04
+#define MULTIFD_FLAG_EOS       0x08
+
+/* pages queued on a channel, and pages written with one sendmsg */
+#define MULTIFD_QUEUE_SIZE 16384
+#define MULTIFD_BATCH 64
+
+/* the source opens its channels right after the main connection */
+#define MULTIFD_ACCEPT_TIMEOUT 10 /* seconds */
+
+static int multifd_write_full(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ret = sendmsg(fd, &msg, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (ret > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static int multifd_read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < size) {
+        ret = qemu_recv(fd, (uint8_t *)buf + done, size - done, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/***********************************************************/
+/* source */
+
+typedef struct MultiFDPage {
+    RAMBlock *block;        /* NULL for a sync point */
+    ram_addr_t offset;
+    uint64_t sync;
+} MultiFDPage;
+
+typedef struct MultiFDSendChannel {
+    QemuThread thread;
+    QemuCond cond;
+    int fd;                 /* -1 when the channel is not in use */
+    bool quit;              /* end the stream once the queue is empty */
+    MultiFDPage queue[MULTIFD_QUEUE_SIZE];
+    int head;
+    int count;
+    int taken;              /* entries of the batch being written */
+    RAMBlock *last_block;
+    uint8_t hdr[MULTIFD_BATCH * (8 + 1 + 255 + 8)];
+    struct iovec iov[MULTIFD_BATCH * 2];
+} MultiFDSendChannel;
+
+static struct {
+    MultiFDSendChannel *channels[MAX_MULTIFD_CHANNELS];
+    /* threads created, and channels of the current migration */
+    int nthreads;
+    int nchannels;
+    bool initialized;
+    QemuMutex lock;
+    QemuCond done_cond;
+    int error;
+    uint64_t sync;
+    int queued;
+    /* bandwidth used by the channels in the current 100ms window */
+    int64_t xfer_limit;
+    int64_t window_start;
+    int64_t bytes_xfer;
+    /* bytes written by the channels since the migration started */
+    uint64_t bytes_total;
+} send_state;
+
+static void multifd_send_init(void)
+{
+    if (!send_state.initialized) {
+        qemu_mutex_init(&send_state.lock);
+        qemu_cond_init(&send_state.done_cond);
+        send_state.initialized = true;
+    }
+}
+
+/* Wait until the channels may write size more bytes.  */
+static void multifd_send_rate_limit(size_t size)
+{
+    int64_t now;
+
+    qemu_mutex_lock(&send_state.lock);
+    for (;;) {
+        now = get_clock();
+        if (now - send_state.window_start >= 100000000) {
+            /* a batch may go over the limit, the next window pays for it */
+            send_state.window_start = now;
+            send_state.bytes_xfer = MAX(send_state.bytes_xfer -
+                                        send_state.xfer_limit, 0);
+        }
+        if (send_state.bytes_xfer < send_state.xfer_limit ||
+            send_state.error) {
+            break;
+        }
+        qemu_mutex_unlock(&send_state.lock);
+        usleep((send_state.window_start + 100000000 - now) / 1000 + 1);
+        qemu_mutex_lock(&send_state.lock);
+    }
+    send_state.bytes_xfer += size;
+    send_state.bytes_total += size;
+    qemu_mutex_unlock(&send_state.lock);
+}
+
+static int multifd_send_batch(MultiFDSendChannel *p, int fd,
+                              MultiFDPage *pages, int n)
+{
+    uint8_t *hdr = p->hdr;
+    uint8_t *start;
+    RAMBlock *block;
+    size_t size = 0;
+    int iovcnt = 0;
+    int i, len;
+
+    for (i = 0; i < n; i++) {
+        block = pages[i].block;
+        start = hdr;
+        if (!block) {
+            stq_be_p(hdr, MULTIFD_FLAG_SYNC);
+            stq_be_p(hdr + 8, pages[i].sync);
+            hdr += 16;
+        } else if (block == p->last_block) {
+            stq_be_p(hdr, pages[i].offset | MULTIFD_FLAG_PAGE |
+                          MULTIFD_FLAG_CONTINUE);
+            hdr += 8;
+        } else {
+            len = strlen(block->idstr);
+            stq_be_p(hdr, pages[i].offset | MULTIFD_FLAG_PAGE);
+            hdr[8] = len;
+            memcpy(hdr + 9, block->idstr, len);
+            hdr += 9 + len;
+            p->last_block = block;
+        }
+
+        /* consecutive headers go in the same element */
+        if (iovcnt && (uint8_t *)p->iov[iovcnt - 1].iov_base +
+                      p->iov[iovcnt - 1].iov_len == start) {
+            p->iov[iovcnt - 1].iov_len += hdr - start;
+        } else {
+            p->iov[iovcnt].iov_base = start;
+            p->iov[iovcnt].iov_len = hdr - start;
+            iovcnt++;
+        }
+        size += hdr - start;
+
+        if (block) {
+            p->iov[iovcnt].iov_base = block->host + pages[i].offset;
+            p->iov[iovcnt].iov_len = TARGET_PAGE_SIZE;
+            iovcnt++;
+            size += TARGET_PAGE_SIZE;
+        }
+    }
+
+    multifd_send_rate_limit(size);
+    return multifd_write_full(fd, p->iov, iovcnt);
+}
+
+static void multifd_send_eos(int fd)
+{
+    uint8_t hdr[8];
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+
+    stq_be_p(hdr, MULTIFD_FLAG_EOS);
+    multifd_write_full(fd, &iov, 1);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *p = opaque;
+    MultiFDPage pages[MULTIFD_BATCH];
+    int fd, n, i, ret;
+
+    qemu_mutex_lock(&send_state.lock);
+    for (;;) {
+        while (p->fd == -1 || (!p->count && !p->quit)) {
+            qemu_cond_wait(&p->cond, &send_state.lock);
+        }
+        fd = p->fd;
+
+        if (send_state.error) {
+            send_state.queued -= p->count;
+            p->count = 0;
+        }
+        if (!p->count) {
+            /* quit */
+            if (!send_state.error) {
+                qemu_mutex_unlock(&send_state.lock);
+                multifd_send_eos(fd);
+                qemu_mutex_lock(&send_state.lock);
+            }
+            close(fd);
+            p->fd = -1;
+            p->quit = false;
+            qemu_cond_broadcast(&send_state.done_cond);
+            continue;
+        }
+
+        n = MIN(p->count, MULTIFD_BATCH);
+        for (i = 0; i < n; i++) {
+            pages[i] = p->queue[(p->head + i) % MULTIFD_QUEUE_SIZE];
+        }
+        p->taken = n;
+        qemu_mutex_unlock(&send_state.lock);
+
+        ret = multifd_send_batch(p, fd, pages, n);
+
+        qemu_mutex_lock(&send_state.lock);
+        p->head = (p->head + n) % MULTIFD_QUEUE_SIZE;
+        p->count -= n;
+        p->taken = 0;
+        send_state.queued -= n;
+        if (ret < 0 && !send_state.error) {
+            DPRINTF("write error %d\n", ret);
+            send_state.error = ret;
+        }
+        qemu_cond_broadcast(&send_state.done_cond);
+    }
+
+    return NULL;
+}
+
+bool multifd_save_active(void)
+{
+    return send_state.nchannels > 0;
+}
+
+static int multifd_send_handshake(int fd, int id, int nchannels)
+{
+    uint8_t hdr[12];
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+
+    stl_be_p(hdr, MULTIFD_MAGIC);
+    stl_be_p(hdr + 4, id);
+    stl_be_p(hdr + 8, nchannels);
+    return multifd_write_full(fd, &iov, 1);
+}
+
+/* Open the channels if f is the stream of a multifd migration.  */
+int multifd_save_setup(QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    MultiFDSendChannel *p;
+    int nchannels, fd, i, ret;
+
+    if (!migrate_use_multifd() || s->file != f || !s->open_channel) {
+        return 0;
+    }
+
+    multifd_send_init();
+    /* a failed migration may not have been cleaned up */
+    multifd_save_cleanup(true);
+
+    nchannels = migrate_multifd_channels();
+    send_state.error = 0;
+    send_state.sync = 0;
+    send_state.queued = 0;
+    send_state.bytes_total = 0;
+    multifd_save_set_rate_limit(s->bandwidth_limit);
+
+    for (i = 0; i < nchannels; i++) {
+        fd = s->open_channel(s);
+        if (fd < 0) {
+            ret = fd;
+            goto fail;
+        }
+        ret = multifd_send_handshake(fd, i, nchannels);
+        if (ret < 0) {
+            close(fd);
+            goto fail;
+        }
+
+        if (i == send_state.nthreads) {
+            p = g_malloc0(sizeof(*p));
+            p->fd = -1;
+            qemu_cond_init(&p->cond);
+            send_state.channels[send_state.nthreads++] = p;
+            qemu_thread_create(&p->thread, multifd_send_thread, p);
+        }
+
+        p = send_state.channels[i];
+        qemu_mutex_lock(&send_state.lock);
+        p->head = 0;
+        p->count = 0;
+        p->last_block = NULL;
+        p->fd = fd;
+        send_state.nchannels++;
+        qemu_mutex_unlock(&send_state.lock);
+    }
+
+    DPRINTF("opened %d channels\n", nchannels);
+    return 0;
+
+fail:
+    fprintf(stderr, "multifd: cannot open channel %d: %s\n", i,
+            strerror(-ret));
+    multifd_save_cleanup(true);
+    return ret;
+}
+
+uint64_t multifd_save_bytes_transferred(void)
+{
+    uint64_t bytes;
+
+    if (!send_state.initialized) {
+        return 0;
+    }
+    qemu_mutex_lock(&send_state.lock);
+    bytes = send_state.bytes_total;
+    qemu_mutex_unlock(&send_state.lock);
+    return bytes;
+}
+
+/*
+ * The queues hold about as much as the channels may write in 100ms, so
+ * that pages are not accounted as sent long before they really are.
+ */
+bool multifd_save_full(void)
+{
+    int64_t limit;
+    bool full;
+
+    if (!multifd_save_active()) {
+        return false;
+    }
+
+    qemu_mutex_lock(&send_state.lock);
+    limit = MAX(send_state.xfer_limit / TARGET_PAGE_SIZE,
+                MULTIFD_BATCH * send_state.nchannels);
+    full = send_state.queued >= limit;
+    qemu_mutex_unlock(&send_state.lock);
+    return full;
+}
+
+/*
+ * Queue a page on the least busy channel.  Returns false if every queue
+ * is full, in which case the page must go in the main stream: blocking
+ * here could deadlock with a destination waiting for the main stream.
+ * The last slot of each queue is kept for a sync point.
+ */
+bool multifd_save_page(RAMBlock *block, uint64_t offset)
+{
+    MultiFDSendChannel *p, *best = NULL;
+    int i;
+
+    qemu_mutex_lock(&send_state.lock);
+    for (i = 0; i < send_state.nchannels; i++) {
+        p = send_state.channels[i];
+        if (!best || p->count < best->count) {
+            best = p;
+        }
+    }
+    if (send_state.error || best->count >= MULTIFD_QUEUE_SIZE - 1) {
+        qemu_mutex_unlock(&send_state.lock);
+        return false;
+    }
+
+    i = (best->head + best->count) % MULTIFD_QUEUE_SIZE;
+    best->queue[i].block = block;
+    best->queue[i].offset = offset;
+    best->count++;
+    send_state.queued++;
+    qemu_cond_signal(&best->cond);
+    qemu_mutex_unlock(&send_state.lock);
+    return true;
+}
+
+/*
+ * Put a sync point on every channel.  If the last entry not yet taken
+ * by the thread already is one, it is simply renumbered: the destination
+ * only needs to know the last sync point a channel went past.
+ */
+int multifd_save_sync(void)
+{
+    MultiFDSendChannel *p;
+    MultiFDPage *last;
+    int i, ret;
+
+    if (!multifd_save_active()) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&send_state.lock);
+    send_state.sync++;
+    for (i = 0; i < send_state.nchannels; i++) {
+        p = send_state.channels[i];
+        last = &p->queue[(p->head + p->count + MULTIFD_QUEUE_SIZE - 1) %
+                         MULTIFD_QUEUE_SIZE];
+        if (p->count > p->taken && !last->block) {
+            last->sync = send_state.sync;
+            continue;
+        }
+        assert(p->count < MULTIFD_QUEUE_SIZE);
+        last = &p->queue[(p->head + p->count) % MULTIFD_QUEUE_SIZE];
+        last->block = NULL;
+        last->sync = send_state.sync;
+        p->count++;
+        send_state.queued++;
+        qemu_cond_signal(&p->cond);
+    }
+    ret = send_state.error;
+    qemu_mutex_unlock(&send_state.lock);
+    return ret;
+}
+
+void multifd_save_set_rate_limit(int64_t bytes_per_sec)
+{
+    multifd_send_init();
+    qemu_mutex_lock(&send_state.lock);
+    send_state.xfer_limit = bytes_per_sec / 10;
+    qemu_mutex_unlock(&send_state.lock);
+}
+
+/*
+ * Close the channels once they have written what is queued, or right
+ * away if abort is true.  Returns the first write error.
+ */
+int multifd_save_cleanup(bool abort)
+{
+    MultiFDSendChannel *p;
+    int i, ret;
+
+    if (!multifd_save_active()) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&send_state.lock);
+    if (abort && !send_state.error) {
+        send_state.error = -ECANCELED;
+    }
+    for (i = 0; i < send_state.nchannels; i++) {
+        p = send_state.channels[i];
+        if (p->fd != -1) {
+            if (abort) {
+                /* wake up a thread blocked in sendmsg */
+                shutdown(p->fd, SHUT_RDWR);
+            }
+            p->quit = true;
+            qemu_cond_signal(&p->cond);
+        }
+    }
+    for (i = 0; i < send_state.nchannels; i++) {
+        p = send_state.channels[i];
+        while (p->fd != -1) {
+            qemu_cond_wait(&send_state.done_cond, &send_state.lock);
+        }
+    }
+    send_state.nchannels = 0;
+    ret = send_state.error;
+    qemu_mutex_unlock(&send_state.lock);
+
+    DPRINTF("closed channels, error %d\n", ret);
+    return ret;
+}
+
+/***********************************************************/
+/* destination */
+
+typedef struct MultiFDRecvChannel {
+    QemuThread thread;
+    QemuCond cond;
+    int fd;
+    bool running;
+    uint64_t synced;        /* last sync point read */
+    RAMBlock *last_block;
+} MultiFDRecvChannel;
+
+static struct {
+    MultiFDRecvChannel *channels[MAX_MULTIFD_CHANNELS];
+    int nthreads;
+    int nchannels;
+    QemuMutex lock;
+    QemuCond sync_cond;
+    int error;
+    uint64_t released;      /* sync points the channels may go past */
+    /* qemu_get_ram_ptr reorders ram_list.blocks under our feet */
+    RAMBlock **blocks;
+    int nb_blocks;
+} recv_state;
+
+static RAMBlock *multifd_find_block(const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < recv_state.nb_blocks; i++) {
+        if (!strcmp(recv_state.blocks[i]->idstr, idstr)) {
+            return recv_state.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static int multifd_recv_page(MultiFDRecvChannel *p, uint64_t hdr)
+{
+    ram_addr_t offset = hdr & TARGET_PAGE_MASK;
+    char idstr[256];
+    uint8_t len;
+    int ret;
+
+    if (!(hdr & MULTIFD_FLAG_CONTINUE)) {
+        ret = multifd_read_full(p->fd, &len, 1);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = multifd_read_full(p->fd, idstr, len);
+        if (ret < 0) {
+            return ret;
+        }
+        idstr[len] = 0;
+        p->last_block = multifd_find_block(idstr);
+        if (!p->last_block) {
+            fprintf(stderr, "multifd: unknown RAM block %s\n", idstr);
+            return -EINVAL;
+        }
+    } else if (!p->last_block) {
+        return -EINVAL;
+    }
+
+    if (offset >= p->last_block->length) {
+        fprintf(stderr, "multifd: page offset out of RAM block %s\n",
+                p->last_block->idstr);
+        return -EINVAL;
+    }
+    return multifd_read_full(p->fd, p->last_block->host + offset,
+                             TARGET_PAGE_SIZE);
+}
+
+static int multifd_recv_channel(MultiFDRecvChannel *p)
+{
+    uint8_t buf[8];
+    uint64_t hdr;
+    int ret;
+
+    for (;;) {
+        ret = multifd_read_full(p->fd, buf, 8);
+        if (ret < 0) {
+            return ret;
+        }
+        hdr = ldq_be_p(buf);
+
+        if (hdr & MULTIFD_FLAG_EOS) {
+            return 0;
+        } else if (hdr & MULTIFD_FLAG_SYNC) {
+            ret = multifd_read_full(p->fd, buf, 8);
+            if (ret < 0) {
+                return ret;
+            }
+            qemu_mutex_lock(&recv_state.lock);
+            p->synced = ldq_be_p(buf);
+            qemu_cond_broadcast(&recv_state.sync_cond);
+            while (recv_state.released < p->synced && !recv_state.error) {
+                qemu_cond_wait(&p->cond, &recv_state.lock);
+            }
+            ret = recv_state.error;
+            qemu_mutex_unlock(&recv_state.lock);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (hdr & MULTIFD_FLAG_PAGE) {
+            ret = multifd_recv_page(p, hdr);
+            if (ret < 0) {
+                return ret;
+            }
+        } else {
+            return -EINVAL;
+        }
+    }
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *p = opaque;
+    int ret;
+
+    qemu_mutex_lock(&recv_state.lock);
+    for (;;) {
+        while (!p->running) {
+            qemu_cond_wait(&p->cond, &recv_state.lock);
+        }
+        qemu_mutex_unlock(&recv_state.lock);
+
+        ret = multifd_recv_channel(p);
+
+        qemu_mutex_lock(&recv_state.lock);
+        if (ret < 0 && !recv_state.error) {
+            DPRINTF("read error %d\n", ret);
+            recv_state.error = ret;
+        }
+        p->running = false;
+        qemu_cond_broadcast(&recv_state.sync_cond);
+    }
+
+    return NULL;
+}
+
+static int multifd_accept(int listen_fd, int *id, int *nchannels)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    uint8_t hdr[12];
+    struct timeval tv;
+    fd_set rfds;
+    int fd, ret;
+
+    /* a source without multifd never connects */
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(listen_fd, &rfds);
+        tv.tv_sec = MULTIFD_ACCEPT_TIMEOUT;
+        tv.tv_usec = 0;
+        ret = select(listen_fd + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret == -1) {
+        return -socket_error();
+    } else if (ret == 0) {
+        return -ETIMEDOUT;
+    }
+
+    do {
+        fd = qemu_accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
+    } while (fd == -1 && socket_error() == EINTR);
+    if (fd == -1) {
+        return -socket_error();
+    }
+
+    if (multifd_read_full(fd, hdr, sizeof(hdr)) < 0 ||
+        ldl_be_p(hdr) != MULTIFD_MAGIC) {
+        close(fd);
+        return -EINVAL;
+    }
+    *id = ldl_be_p(hdr + 4);
+    *nchannels = ldl_be_p(hdr + 8);
+    return fd;
+}
+
+/* Accept the channels of the migration whose main connection was just
+ * accepted on listen_fd.  */
+int multifd_load_setup(int listen_fd)
+{
+    int fds[MAX_MULTIFD_CHANNELS];
+    MultiFDRecvChannel *p;
+    RAMBlock *block;
+    int nchannels = 1;
+    int n = 0, id = -1;
+    int fd, i;
+
+    if (!recv_state.nthreads) {
+        qemu_mutex_init(&recv_state.lock);
+        qemu_cond_init(&recv_state.sync_cond);
+    }
+
+    for (i = 0; i < MAX_MULTIFD_CHANNELS; i++) {
+        fds[i] = -1;
+    }
+    for (i = 0; i < nchannels; i++) {
+        fd = multifd_accept(listen_fd, &id, &n);
+        if (fd < 0) {
+            fprintf(stderr, "multifd: cannot accept channel: %s\n",
+                    strerror(-fd));
+            goto fail;
+        }
+        if (i == 0) {
+            nchannels = n;
+        }
+        if (n != nchannels || n < 1 || n > MAX_MULTIFD_CHANNELS ||
+            id < 0 || id >= n || fds[id] != -1) {
+            fprintf(stderr, "multifd: invalid channel %d of %d\n", id, n);
+            close(fd);
+            goto fail;
+        }
+        fds[id] = fd;
+    }
+
+    recv_state.nb_blocks = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        recv_state.nb_blocks++;
+    }
+    recv_state.blocks = g_malloc(recv_state.nb_blocks * sizeof(RAMBlock *));
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        recv_state.blocks[i++] = block;
+    }
+
+    recv_state.error = 0;
+    recv_state.released = 0;
+    for (i = 0; i < nchannels; i++) {
+        if (i == recv_state.nthreads) {
+            p = g_malloc0(sizeof(*p));
+            qemu_cond_init(&p->cond);
+            recv_state.channels[recv_state.nthreads++] = p;
+            qemu_thread_create(&p->thread, multifd_recv_thread, p);
+        }
+
+        p = recv_state.channels[i];
+        qemu_mutex_lock(&recv_state.lock);
+        p->fd = fds[i];
+        p->synced = 0;
+        p->last_block = NULL;
+        p->running = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&recv_state.lock);
+    }
+    recv_state.nchannels = nchannels;
+
+    DPRINTF("accepted %d channels\n", nchannels);
+    return 0;
+
+fail:
+    for (i = 0; i < MAX_MULTIFD_CHANNELS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    return -EINVAL;
+}
+
+bool multifd_load_active(void)
+{
+    return recv_state.nchannels > 0;
+}
+
+/*
+ * Called at the end of each RAM section of the main stream: wait until
+ * every channel has reached the matching sync point, then let them go on.
+ */
+int multifd_load_sync(void)
+{
+    MultiFDRecvChannel *p;
+    uint64_t sync;
+    int i, ret;
+
+    if (!multifd_load_active()) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&recv_state.lock);
+    sync = recv_state.released + 1;
+    for (i = 0; i < recv_state.nchannels && !recv_state.error; i++) {
+        p = recv_state.channels[i];
+        while (p->synced < sync && !recv_state.error) {
+            if (!p->running) {
+                recv_state.error = -EIO;
+                break;
+            }
+            qemu_cond_wait(&recv_state.sync_cond, &recv_state.lock);
+        }
+    }
+    if (!recv_state.error) {
+        recv_state.released = sync;
+    }
+    for (i = 0; i < recv_state.nchannels; i++) {
+        qemu_cond_signal(&recv_state.channels[i]->cond);
+    }
+    ret = recv_state.error;
+    qemu_mutex_unlock(&recv_state.lock);
+
+    if (ret < 0) {
+        fprintf(stderr, "multifd: channel failed: %s\n", strerror(-ret));
+    }
+    return ret;
+}
+
+/* Wait for the end of the channels, or stop them if abort is true.  */
+void multifd_load_cleanup(bool abort)
+{
+    MultiFDRecvChannel *p;
+    int i;
+
+    if (!multifd_load_active()) {
+        return;
+    }
+
+    qemu_mutex_lock(&recv_state.lock);
+    if (abort && !recv_state.error) {
+        recv_state.error = -ECANCELED;
+    }
+    for (i = 0; i < recv_state.nchannels; i++) {
+        p = recv_state.channels[i];
+        if (recv_state.error) {
+            shutdown(p->fd, SHUT_RDWR);
+        }
+        qemu_cond_signal(&p->cond);
+    }
+    for (i = 0; i < recv_state.nchannels; i++) {
+        p = recv_state.channels[i];
+        while (p->running) {
+            qemu_cond_wait(&recv_state.sync_cond, &recv_state.lock);
+        }
+        close(p->fd);
+        p->fd = -1;
+    }
+    recv_state.nchannels = 0;
+    qemu_mutex_unlock(&recv_state.lock);
+
+    g_free(recv_state.blocks);
+    recv_state.blocks = NULL;
+    recv_state.nb_blocks = 0;
+}
+
+#else
+
+int multifd_save_setup(QEMUFile *f)
+{
+    return 0;
+}
+
+bool multifd_save_active(void)
+{
+    return false;
+}
+
+bool multifd_save_full(void)
+{
+    return false;
+}
+
+bool multifd_save_page(RAMBlock *block, uint64_t offset)
+{
+    return false;
+}
+
+int multifd_save_sync(void)
+{
+    return 0;
+}
+
+void multifd_save_set_rate_limit(int64_t bytes_per_sec)
+{
+}
+
+uint64_t multifd_save_bytes_transferred(void)
+{
+    return 0;
+}
+
+int multifd_save_cleanup(bool abort)
+{
+    return 0;
+}
+
+int multifd_load_setup(int listen_fd)
+{
+    return -ENOSYS;
+}
+
+bool multifd_load_active(void)
+{
+    return false;
+}
+
+int multifd_load_sync(void)
+{
+    return 0;
+}
+
+void multifd_load_cleanup(bool abort)
+{
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Migration of the guest RAM over several connections
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MULTIFD_H
+#define QEMU_MULTIFD_H
+
+#include "qemu-common.h"
+
+struct RAMBlock;
+
+/*
+ * Source side.  The pages queued with multifd_save_page are striped over
+ * the channels, each of them written by its own thread.  A sync point is
+ * queued at the end of every RAM section of the main stream: the
+ * destination does not go past it before every channel has reached it,
+ * so a page sent again later can never be overwritten by its old copy.
+ */
+int multifd_save_setup(QEMUFile *f);
+bool multifd_save_active(void);
+bool multifd_save_full(void);
+bool multifd_save_page(struct RAMBlock *block, uint64_t offset);
+int multifd_save_sync(void);
+void multifd_save_set_rate_limit(int64_t bytes_per_sec);
+uint64_t multifd_save_bytes_transferred(void);
+int multifd_save_cleanup(bool abort);
+
+/*
+ * Destination side.  The channels are accepted on the listening socket
+ * right after the main connection, and their threads write the pages
+ * straight into guest memory.
+ */
+int multifd_load_setup(int listen_fd);
+bool multifd_load_active(void);
+int multifd_load_sync(void);
+void multifd_load_cleanup(bool abort);
+
+#endif
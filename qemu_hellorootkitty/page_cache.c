@@ -0,0 +1,154 @@
+/*
+ * LRU cache of guest pages
+ *
+ * The pages are found through a hash table indexed by page number, and
+ * kept on a list ordered from the most to the least recently used one.
+ * The page buffers are allocated once, when the cache is created.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "page_cache.h"
+
+typedef struct CacheItem {
+    uint64_t addr;
+    uint8_t *data;
+    QLIST_ENTRY(CacheItem) hash_entry;
+    QTAILQ_ENTRY(CacheItem) lru_entry;
+} CacheItem;
+
+struct PageCache {
+    QLIST_HEAD(CacheBucket, CacheItem) *buckets;
+    uint64_t hash_mask;
+    QTAILQ_HEAD(CacheLRU, CacheItem) lru;
+    CacheItem *items;
+    uint8_t *data;
+    int64_t max_num_items;
+    int64_t num_items;
+    unsigned int page_size;
+};
+
+static inline struct CacheBucket *cache_bucket(const PageCache *cache,
+                                               uint64_t addr)
+{
+    return &cache->buckets[(addr / cache->page_size) & cache->hash_mask];
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+    int64_t i, n_buckets = 1;
+
+    if (num_pages <= 0) {
+        return NULL;
+    }
+
+    while (n_buckets < num_pages) {
+        n_buckets <<= 1;
+    }
+
+    cache = g_malloc0(sizeof(*cache));
+    cache->buckets = g_malloc(n_buckets * sizeof(*cache->buckets));
+    for (i = 0; i < n_buckets; i++) {
+        QLIST_INIT(&cache->buckets[i]);
+    }
+    cache->hash_mask = n_buckets - 1;
+    QTAILQ_INIT(&cache->lru);
+    cache->items = g_malloc0(num_pages * sizeof(*cache->items));
+    cache->data = qemu_vmalloc(num_pages * page_size);
+    cache->max_num_items = num_pages;
+    cache->page_size = page_size;
+
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    qemu_vfree(cache->data);
+    g_free(cache->items);
+    g_free(cache->buckets);
+    g_free(cache);
+}
+
+static CacheItem *cache_find(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it;
+
+    QLIST_FOREACH(it, cache_bucket(cache, addr), hash_entry) {
+        if (it->addr == addr) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+    if (it != QTAILQ_FIRST(&cache->lru)) {
+        QTAILQ_REMOVE(&cache->lru, it, lru_entry);
+        QTAILQ_INSERT_HEAD(&cache->lru, it, lru_entry);
+    }
+    return it->data;
+}
+
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (it) {
+        QTAILQ_REMOVE(&cache->lru, it, lru_entry);
+    } else if (cache->num_items < cache->max_num_items) {
+        it = &cache->items[cache->num_items];
+        it->data = cache->data + cache->num_items * cache->page_size;
+        cache->num_items++;
+        it->addr = addr;
+        QLIST_INSERT_HEAD(cache_bucket(cache, addr), it, hash_entry);
+    } else {
+        it = QTAILQ_LAST(&cache->lru, CacheLRU);
+        QTAILQ_REMOVE(&cache->lru, it, lru_entry);
+        QLIST_REMOVE(it, hash_entry);
+        it->addr = addr;
+        QLIST_INSERT_HEAD(cache_bucket(cache, addr), it, hash_entry);
+    }
+
+    memcpy(it->data, pdata, cache->page_size);
+    QTAILQ_INSERT_HEAD(&cache->lru, it, lru_entry);
+    return it->data;
+}
+
+PageCache *cache_resize(PageCache *cache, int64_t num_pages)
+{
+    PageCache *new_cache;
+    CacheItem *it;
+
+    new_cache = cache_init(num_pages, cache->page_size);
+    if (!new_cache) {
+        return cache;
+    }
+
+    /* insert from the least recently used, so that the order is kept */
+    for (it = QTAILQ_LAST(&cache->lru, CacheLRU); it;
+         it = QTAILQ_PREV(it, CacheLRU, lru_entry)) {
+        cache_insert(new_cache, it->addr, it->data);
+    }
+
+    cache_fini(cache);
+    return new_cache;
+}
+
+int64_t cache_max_num_items(const PageCache *cache)
+{
+    return cache->max_num_items;
+}
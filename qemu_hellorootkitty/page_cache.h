@@ -0,0 +1,40 @@
+/*
+ * LRU cache of guest pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PAGE_CACHE_H
+#define QEMU_PAGE_CACHE_H
+
+#include "qemu-common.h"
+
+typedef struct PageCache PageCache;
+
+/* Create a cache holding at most num_pages pages of page_size bytes.  */
+PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+void cache_fini(PageCache *cache);
+
+/*
+ * Return the cached copy of the page at addr and make it the most
+ * recently used one, or NULL if the page is not cached.
+ */
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr);
+
+/*
+ * Copy pdata into the cache as the page at addr, evicting the least
+ * recently used page if the cache is full.  Returns the cached copy.
+ */
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
+/*
+ * Change the capacity of the cache, keeping the most recently used
+ * pages.  Returns the new cache, the old one is freed.
+ */
+PageCache *cache_resize(PageCache *cache, int64_t num_pages);
+
+int64_t cache_max_num_items(const PageCache *cache);
+
+#endif
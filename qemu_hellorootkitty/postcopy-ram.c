@@ -0,0 +1,328 @@
+/*
+ * Postcopy migration of the guest RAM
+ *
+ * When the source switches to postcopy, it tells the destination which
+ * pages it sent during precopy have been dirtied again.  Those pages are
+ * dropped and the whole guest RAM is registered with userfaultfd, so that
+ * the guest blocks when it touches a page that has not arrived yet.  A
+ * thread reads these faults and asks the source for the pages over the
+ * migration socket; the pages are then placed with UFFDIO_COPY by the
+ * thread that reads the rest of the stream, which wakes up the guest.
+ *
+ * The list of RAM blocks is copied when postcopy starts, because
+ * qemu_get_ram_ptr reorders ram_list.blocks while the guest runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "hw/hw.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "migration.h"
+#include "postcopy-ram.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyIncoming {
+    bool active;
+    int ufd;
+    /* written to stop the fault thread */
+    int quit_fds[2];
+    /* return path to the source */
+    int rp_fd;
+    RAMBlock **blocks;
+    int nb_blocks;
+    QemuThread fault_thread;
+} PostcopyIncoming;
+
+static PostcopyIncoming incoming = {
+    .ufd = -1,
+};
+
+RAMBlock *postcopy_ram_find_block(const char *idstr)
+{
+    int i;
+
+    for (i = 0; i < incoming.nb_blocks; i++) {
+        if (!strcmp(incoming.blocks[i]->idstr, idstr)) {
+            return incoming.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static RAMBlock *postcopy_ram_block_from_host(uint8_t *host)
+{
+    RAMBlock *block;
+    int i;
+
+    for (i = 0; i < incoming.nb_blocks; i++) {
+        block = incoming.blocks[i];
+        if (host >= block->host && host < block->host + block->length) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_ram_request_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t msg[2 + 255 + 8];
+    int len = strlen(block->idstr);
+    int size = 2 + len + 8;
+    int done = 0;
+    ssize_t ret;
+    int i;
+
+    msg[0] = MIG_RP_MSG_REQ_PAGE;
+    msg[1] = len;
+    memcpy(msg + 2, block->idstr, len);
+    for (i = 0; i < 8; i++) {
+        msg[2 + len + i] = (uint64_t)offset >> (56 - i * 8);
+    }
+
+    while (done < size) {
+        ret = send(incoming.rp_fd, msg + done, size - done, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    RAMBlock *block;
+    uint8_t *host;
+    ssize_t ret;
+
+    pfd[0].fd = incoming.ufd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = incoming.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("postcopy: poll");
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(incoming.ufd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            perror("postcopy: read userfault");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (uint8_t *)(uintptr_t)msg.arg.pagefault.address;
+        block = postcopy_ram_block_from_host(host);
+        if (!block) {
+            fprintf(stderr, "postcopy: fault at %p outside guest RAM\n", host);
+            continue;
+        }
+        if (postcopy_ram_request_page(block, (host - block->host) &
+                                      TARGET_PAGE_MASK) < 0) {
+            fprintf(stderr, "postcopy: cannot request page from source\n");
+            break;
+        }
+    }
+
+    close(incoming.ufd);
+    close(incoming.quit_fds[0]);
+    close(incoming.quit_fds[1]);
+    g_free(incoming.blocks);
+    incoming.blocks = NULL;
+    incoming.nb_blocks = 0;
+    return NULL;
+}
+
+int postcopy_ram_incoming_init(QEMUFile *f)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg;
+    RAMBlock *block;
+    int i;
+
+    if (incoming.active) {
+        return -EINVAL;
+    }
+    if (TARGET_PAGE_SIZE != getpagesize()) {
+        fprintf(stderr, "postcopy: target and host page sizes differ\n");
+        return -EINVAL;
+    }
+    incoming.rp_fd = qemu_file_socket_fd(f);
+    if (incoming.rp_fd < 0) {
+        fprintf(stderr, "postcopy: the migration stream has no return "
+                "channel\n");
+        return -EINVAL;
+    }
+
+    incoming.ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (incoming.ufd < 0) {
+        perror("postcopy: userfaultfd");
+        return -errno;
+    }
+    if (ioctl(incoming.ufd, UFFDIO_API, &api) < 0) {
+        perror("postcopy: UFFDIO_API");
+        goto fail;
+    }
+
+    incoming.nb_blocks = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        incoming.nb_blocks++;
+    }
+    incoming.blocks = g_malloc(incoming.nb_blocks * sizeof(RAMBlock *));
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        incoming.blocks[i++] = block;
+
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(incoming.ufd, UFFDIO_REGISTER, &reg) < 0) {
+            fprintf(stderr, "postcopy: cannot register RAM block %s: %s\n",
+                    block->idstr, strerror(errno));
+            goto fail;
+        }
+        if (!(reg.ioctls & (1ULL << _UFFDIO_COPY))) {
+            fprintf(stderr, "postcopy: RAM block %s does not support "
+                    "UFFDIO_COPY\n", block->idstr);
+            goto fail;
+        }
+    }
+
+    if (qemu_pipe(incoming.quit_fds) < 0) {
+        perror("postcopy: pipe");
+        goto fail;
+    }
+    incoming.active = true;
+    qemu_thread_create(&incoming.fault_thread, postcopy_ram_fault_thread,
+                       NULL);
+    return 0;
+
+fail:
+    /* closing the userfaultfd unregisters the ranges */
+    close(incoming.ufd);
+    incoming.ufd = -1;
+    g_free(incoming.blocks);
+    incoming.blocks = NULL;
+    incoming.nb_blocks = 0;
+    return -EINVAL;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return incoming.active;
+}
+
+/*
+ * Called once the whole RAM has been received.  Unregistering the ranges
+ * wakes up any thread still waiting for a page; the fault thread closes
+ * the userfaultfd when it exits.
+ */
+void postcopy_ram_incoming_cleanup(void)
+{
+    struct uffdio_range range;
+    int i;
+
+    if (!incoming.active) {
+        return;
+    }
+
+    for (i = 0; i < incoming.nb_blocks; i++) {
+        range.start = (uintptr_t)incoming.blocks[i]->host;
+        range.len = incoming.blocks[i]->length;
+        ioctl(incoming.ufd, UFFDIO_UNREGISTER, &range);
+    }
+    incoming.active = false;
+    if (write(incoming.quit_fds[1], "", 1) != 1) {
+        perror("postcopy: stop fault thread");
+    }
+}
+
+int postcopy_ram_place_page(void *host, const void *from)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)from,
+        .len = TARGET_PAGE_SIZE,
+    };
+
+    /* a page that was requested twice may already be there */
+    if (ioctl(incoming.ufd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_ram_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero = {
+        .range.start = (uintptr_t)host,
+        .range.len = TARGET_PAGE_SIZE,
+    };
+
+    if (ioctl(incoming.ufd, UFFDIO_ZEROPAGE, &zero) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+#else
+
+int postcopy_ram_incoming_init(QEMUFile *f)
+{
+    fprintf(stderr, "postcopy: userfaultfd is not supported on this host\n");
+    return -ENOSYS;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return false;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+int postcopy_ram_place_page(void *host, const void *from)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_place_zero_page(void *host)
+{
+    return -ENOSYS;
+}
+
+RAMBlock *postcopy_ram_find_block(const char *idstr)
+{
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Postcopy migration of the guest RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "qemu-common.h"
+
+struct RAMBlock;
+
+/*
+ * Destination side.  Once the source has switched to postcopy, the pages
+ * that are still missing are registered with userfaultfd: a thread asks
+ * the source for each page the guest faults on, and the pages received
+ * from the stream are placed atomically, waking up the faulting threads.
+ */
+int postcopy_ram_incoming_init(QEMUFile *f);
+bool postcopy_ram_incoming_active(void);
+void postcopy_ram_incoming_cleanup(void);
+int postcopy_ram_place_page(void *host, const void *from);
+int postcopy_ram_place_zero_page(void *host);
+struct RAMBlock *postcopy_ram_find_block(const char *idstr);
+
+#endif
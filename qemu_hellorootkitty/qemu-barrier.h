@@ -13,6 +13,13 @@
  * load/stores from C code.
  */
 #define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+
+/*
+ * Loads may still be reordered with older stores to different
+ * locations, so a full barrier needs a serializing instruction.
+ */
+#define smp_mb()    __sync_synchronize()
 
 #elif defined(_ARCH_PPC)
 
@@ -22,6 +29,8 @@
  * each other
  */
 #define smp_wmb()   asm volatile("eieio" ::: "memory")
+#define smp_rmb()   asm volatile("sync" ::: "memory")
+#define smp_mb()    asm volatile("sync" ::: "memory")
 
 #else
 
@@ -32,6 +41,8 @@
  * be overkill.
  */
 #define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
 
 #endif
 
@@ -99,6 +99,18 @@ static inline char *realpath(const char *path, char *resolved_path)
 void configure_icount(const char *option);
 extern int use_icount;
 
+/* multi-threaded TCG */
+void configure_tcg_threads(const char *option);
+extern bool mttcg_enabled;
+
+/* hot-trace superblocks */
+void configure_tcg_superblocks(bool enable);
+extern bool tcg_superblocks_enabled;
+
+/* guest globals kept in host registers between translation blocks */
+void configure_tcg_pinned_globals(const char *option);
+void check_tcg_pinned_globals(void);
+
 /* FIXME: Remove NEED_CPU_H.  */
 #ifndef NEED_CPU_H
 
@@ -130,6 +142,8 @@ int qemu_fls(int i);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 int qemu_parse_fd(const char *param);
+bool buffer_is_zero(const void *buf, size_t len);
+bool buffer_is_dup(const void *buf, size_t len);
 
 /*
  * strtosz() suffixes used to specify the default treatment of an
@@ -148,6 +162,10 @@ int64_t strtosz_suffix(const char *nptr, char **end, const char default_suffix);
 int64_t strtosz_suffix_unit(const char *nptr, char **end,
                             const char default_suffix, int64_t unit);
 
+/* Unsigned LEB128 encoding, as used by the XBZRLE migration format */
+int uleb128_encode(uint8_t *out, uint32_t n);
+int uleb128_decode(const uint8_t *in, int len, uint32_t *n);
+
 /* path.c */
 void init_paths(const char *prefix);
 const char *path(const char *pathname);
@@ -245,6 +263,11 @@ typedef uint64_t pcibus_t;
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
 
+/* persistent translation cache (-tb-cache) */
+int tb_cache_init(const char *filename);
+void tb_cache_load(void);
+void tb_cache_save(void);
+
 void cpu_exec_init_all(void);
 
 /* CPU save/load.  */
@@ -85,6 +85,38 @@ static QemuOptsList qemu_drive_opts = {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
             .help = "open drive file as read-only",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 L2 table cache in bytes",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 refcount block cache in bytes",
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
         },
         { /* end of list */ }
     },
@@ -490,6 +522,18 @@ static QemuOptsList qemu_machine_opts = {
             .name = "accel",
             .type = QEMU_OPT_STRING,
             .help = "accelerator list",
+        }, {
+            .name = "tcg_threads",
+            .type = QEMU_OPT_STRING,
+            .help = "one host thread for all VCPUs (single) or per VCPU (multi)",
+        }, {
+            .name = "tcg_superblocks",
+            .type = QEMU_OPT_BOOL,
+            .help = "retranslate hot chains of blocks as one",
+        }, {
+            .name = "tcg_pin",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG globals kept in host registers, separated by ':'",
         },
         { /* End of list */ }
     },
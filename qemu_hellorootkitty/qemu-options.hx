@@ -31,7 +31,13 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "-machine [type=]name[,prop[=value][,...]]\n"
     "                selects emulated machine (-machine ? for list)\n"
     "                property accel=accel1[:accel2[:...]] selects accelerator\n"
-    "                supported accelerators are kvm, xen, tcg (default: tcg)\n",
+    "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
+    "                property tcg_threads=single|multi runs all TCG VCPUs in\n"
+    "                one host thread or each in its own (default: single)\n"
+    "                property tcg_superblocks=on|off retranslates hot chains\n"
+    "                of blocks as one (default: off)\n"
+    "                property tcg_pin=global1[:global2[:...]] keeps TCG globals\n"
+    "                in host registers between blocks\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -44,6 +50,24 @@ This is used to enable an accelerator. Depending on the target architecture,
 kvm, xen, or tcg can be available. By default, tcg is used. If there is more
 than one accelerator specified, the next one is used if the previous one fails
 to initialize.
+@item tcg_threads=single|multi
+With @code{multi}, tcg runs each VCPU in its own host thread so that a SMP
+guest can use several host CPUs. This is experimental: it is only available
+for x86 guests on x86 Linux hosts and cannot be combined with
+@option{-icount}. The default, @code{single}, runs all VCPUs round-robin in
+one thread.
+@item tcg_superblocks=on|off
+With @code{on}, tcg counts the direct jumps between translated blocks and
+retranslates a block together with the blocks that usually follow it once
+the path is hot, so that the code generator optimizes across them. This is
+only available for x86 guests and cannot be combined with @option{-icount}.
+@item tcg_pin=@var{global1}[:@var{global2}[:...]]
+Keep the named TCG globals (for example @code{cc_op:cc_src:rax} for an
+x86 guest) in host registers while tcg runs chained blocks, instead of
+storing them to the CPU state at the end of each block. They are still
+written back around helper calls. Up to 3 globals can be pinned on x86-64
+hosts; other hosts do not support this property. QEMU exits if a name
+matches no global of the guest.
 @end table
 ETEXI
 
@@ -135,7 +159,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,l2-cache-size=size]\n"
+    "       [,refcount-cache-size=size]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -186,6 +212,26 @@ host disk is full; report the error to the guest otherwise).
 The default setting is @option{werror=enospc} and @option{rerror=report}.
 @item readonly
 Open drive @option{file} as read-only. Guest write attempts will fail.
+@item l2-cache-size=@var{size}
+@itemx refcount-cache-size=@var{size}
+Size in bytes of the L2 table and refcount block caches of a qcow2 image.
+Each cached table takes one cluster.  Lookups that miss the cache have to
+read the table from the image, so random I/O over a large image benefits
+from a bigger L2 cache; a cache that covers the whole image needs 8 bytes
+per cluster.  Neither cache grows beyond the tables the image has.  Hit
+and miss counts are shown by @code{info blockstats}.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total,
+@var{r} for reads and @var{w} for writes.  0 means unlimited.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} requests per second in total, @var{r} reads and
+@var{w} writes, as submitted to the image after the device merged adjacent
+writes.  0 means unlimited.  Requests beyond the limits wait in the
+order they were made; short bursts are let through.  The limits can be
+changed with @code{block_set_io_throttle}.  They do not apply to virtio-blk
+devices with @option{x-data-plane} enabled.  Synchronous requests, such as
+IDE PIO or floppy transfers, count against the limits but are never
+delayed.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -2480,6 +2526,20 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  save translated code to file at exit and reuse it\n"
+    "                at the next start\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Save the translated code to @var{file} when QEMU exits, and load it back
+when QEMU starts, so that code that is run again is not translated again.
+Code is only reused if the guest code it was translated from is unchanged.
+The file is ignored if it was written by another QEMU binary or for a
+different machine (RAM size, CPU model, @option{-icount} or TCG threading
+mode).  Only supported on x86-64 hosts.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -0,0 +1,341 @@
+/*
+ * Concurrent hash table with lock-free lookups
+ *
+ * The table is an array of cache-line sized head buckets; each bucket
+ * holds a few (hash, pointer) pairs and a pointer to an overflow bucket.
+ * The entries of a chain are kept packed, so that the first empty slot
+ * ends the chain.
+ *
+ * Readers do not take any lock.  Writers bump a sequence counter in the
+ * head bucket around every change to the chain, and a reader that sees
+ * the counter change (or the table being resized under its feet)
+ * retries.  Maps replaced by a resize and overflow buckets stay
+ * allocated until qht_reset(), which the caller only invokes when no
+ * reader can be running.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-barrier.h"
+#include "qht.h"
+
+#define QHT_BUCKET_ALIGN 64
+#define QHT_BUCKET_ENTRIES                                          \
+    ((QHT_BUCKET_ALIGN - sizeof(unsigned int) - sizeof(void *)) /   \
+     (sizeof(uint32_t) + sizeof(void *)))
+
+typedef struct QHTBucket {
+    unsigned int sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN))) QHTBucket;
+
+struct QHTMap {
+    QHTBucket *buckets;
+    size_t n_buckets;
+    QHTMap *next;
+};
+
+#define qht_read(x) (*(volatile typeof(x) *)&(x))
+
+static QHTBucket *qht_bucket_new(void)
+{
+    QHTBucket *b;
+
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(QHTBucket));
+    memset(b, 0, sizeof(QHTBucket));
+    return b;
+}
+
+static QHTMap *qht_map_new(size_t n_buckets)
+{
+    QHTMap *map;
+
+    map = g_malloc0(sizeof(QHTMap));
+    map->n_buckets = n_buckets;
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 n_buckets * sizeof(QHTBucket));
+    memset(map->buckets, 0, n_buckets * sizeof(QHTBucket));
+    return map;
+}
+
+static void qht_map_clear(QHTMap *map)
+{
+    QHTBucket *b, *next;
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        for (b = map->buckets[i].next; b; b = next) {
+            next = b->next;
+            qemu_vfree(b);
+        }
+    }
+    memset(map->buckets, 0, map->n_buckets * sizeof(QHTBucket));
+}
+
+static void qht_map_free(QHTMap *map)
+{
+    qht_map_clear(map);
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static inline QHTBucket *qht_map_head(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline void qht_write_begin(QHTBucket *head)
+{
+    head->sequence++;
+    smp_wmb();
+}
+
+static inline void qht_write_end(QHTBucket *head)
+{
+    smp_wmb();
+    head->sequence++;
+}
+
+void qht_init(QHT *ht, size_t n_elems)
+{
+    size_t n_buckets = 1;
+
+    /* qht_insert grows the table when it is half full */
+    while (n_buckets * QHT_BUCKET_ENTRIES / 2 < n_elems) {
+        n_buckets <<= 1;
+    }
+    ht->map = qht_map_new(n_buckets);
+    ht->n_entries = 0;
+    ht->retired = NULL;
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map;
+
+    while (ht->retired) {
+        map = ht->retired;
+        ht->retired = map->next;
+        qht_map_free(map);
+    }
+    qht_map_clear(ht->map);
+    ht->n_entries = 0;
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_reset(ht);
+    qht_map_free(ht->map);
+    ht->map = NULL;
+}
+
+static bool qht_map_insert(QHTMap *map, void *p, uint32_t hash)
+{
+    QHTBucket *head, *b, *nb;
+    int i;
+
+    head = qht_map_head(map, hash);
+    b = head;
+    for (;;) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == p) {
+                return false;
+            }
+            if (!b->pointers[i]) {
+                qht_write_begin(head);
+                b->hashes[i] = hash;
+                smp_wmb();
+                b->pointers[i] = p;
+                qht_write_end(head);
+                return true;
+            }
+        }
+        if (!b->next) {
+            break;
+        }
+        b = b->next;
+    }
+
+    /* the chain is full, the new bucket is published fully formed */
+    nb = qht_bucket_new();
+    nb->hashes[0] = hash;
+    nb->pointers[0] = p;
+    qht_write_begin(head);
+    b->next = nb;
+    qht_write_end(head);
+    return true;
+}
+
+static void qht_grow(QHT *ht)
+{
+    QHTMap *old = ht->map, *map;
+    QHTBucket *b;
+    size_t i;
+    int j;
+
+    map = qht_map_new(old->n_buckets * 2);
+    for (i = 0; i < old->n_buckets; i++) {
+        for (b = &old->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_map_insert(map, b->pointers[j], b->hashes[j]);
+            }
+        }
+    }
+    smp_wmb();
+    ht->map = map;
+    /* readers may still be walking the old map */
+    old->next = ht->retired;
+    ht->retired = old;
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    if (!qht_map_insert(ht->map, p, hash)) {
+        return false;
+    }
+    ht->n_entries++;
+    if (ht->n_entries > ht->map->n_buckets * QHT_BUCKET_ENTRIES / 2) {
+        qht_grow(ht);
+    }
+    return true;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *head, *b, *fb, *lb;
+    int i, fi, li;
+
+    head = qht_map_head(ht->map, hash);
+    for (b = head; b; b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES && b->pointers[i]; i++) {
+            if (b->pointers[i] == p) {
+                goto found;
+            }
+        }
+    }
+    return false;
+
+ found:
+    /* fill the hole with the last entry of the chain */
+    fb = lb = b;
+    fi = li = i;
+    for (i++; b; b = b->next, i = 0) {
+        for (; i < QHT_BUCKET_ENTRIES && b->pointers[i]; i++) {
+            lb = b;
+            li = i;
+        }
+        if (i < QHT_BUCKET_ENTRIES) {
+            break;
+        }
+    }
+    qht_write_begin(head);
+    fb->hashes[fi] = lb->hashes[li];
+    fb->pointers[fi] = lb->pointers[li];
+    lb->pointers[li] = NULL;
+    qht_write_end(head);
+    ht->n_entries--;
+    return true;
+}
+
+static void *qht_chain_lookup(QHTBucket *head, qht_lookup_func_t func,
+                              const void *userp, uint32_t hash)
+{
+    QHTBucket *b = head;
+    void *p;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            p = qht_read(b->pointers[i]);
+            if (!p) {
+                return NULL;
+            }
+            if (qht_read(b->hashes[i]) == hash && func(p, userp)) {
+                return p;
+            }
+        }
+        b = qht_read(b->next);
+    } while (b);
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *head;
+    unsigned int seq;
+    void *p;
+
+    for (;;) {
+        map = qht_read(ht->map);
+        smp_rmb();
+        head = qht_map_head(map, hash);
+        seq = qht_read(head->sequence);
+        if (seq & 1) {
+            continue;
+        }
+        smp_rmb();
+        p = qht_chain_lookup(head, func, userp, hash);
+        smp_rmb();
+        if (qht_read(head->sequence) == seq && qht_read(ht->map) == map) {
+            return p;
+        }
+    }
+}
+
+void qht_iter(QHT *ht, qht_iter_func_t func, void *opaque)
+{
+    QHTMap *map = ht->map;
+    QHTBucket *b;
+    size_t i;
+    int j;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(b->pointers[j], b->hashes[j], opaque);
+            }
+        }
+    }
+}
+
+void qht_statistics(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map = ht->map;
+    QHTBucket *b;
+    size_t i, chain, n_buckets, used_buckets = 0;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->head_buckets = map->n_buckets;
+    n_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        b = &map->buckets[i];
+        if (!b->pointers[0]) {
+            continue;
+        }
+        stats->used_head_buckets++;
+        for (chain = 0; b; b = b->next) {
+            chain++;
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+            }
+        }
+        used_buckets += chain;
+        n_buckets += chain - 1;
+        if (chain > stats->max_chain) {
+            stats->max_chain = chain;
+        }
+    }
+    if (stats->used_head_buckets) {
+        stats->avg_chain = (double)used_buckets / stats->used_head_buckets;
+    }
+    stats->occupancy = (double)stats->entries /
+                       (n_buckets * QHT_BUCKET_ENTRIES);
+}
@@ -0,0 +1,53 @@
+/*
+ * Concurrent hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include "qemu-common.h"
+
+typedef struct QHTMap QHTMap;
+
+typedef struct QHT {
+    QHTMap *map;
+    size_t n_entries;
+    /* maps replaced by a resize, freed by qht_reset() */
+    QHTMap *retired;
+} QHT;
+
+typedef struct QHTStats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    size_t max_chain;
+    double avg_chain;
+    double occupancy;
+} QHTStats;
+
+/* Return true if 'obj' is the object described by 'userp'.  */
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(void *obj, uint32_t hash, void *opaque);
+
+/*
+ * qht_lookup() may run concurrently with the other functions, except
+ * qht_reset() and qht_destroy().  The writers (qht_insert, qht_remove)
+ * must be serialized by the caller.  The objects stored in the table
+ * must stay allocated until the next qht_reset() because a concurrent
+ * reader may still be looking at them after they have been removed.
+ */
+void qht_init(QHT *ht, size_t n_elems);
+void qht_destroy(QHT *ht);
+void qht_reset(QHT *ht);
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+void *qht_lookup(QHT *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+void qht_iter(QHT *ht, qht_iter_func_t func, void *opaque);
+void qht_statistics(QHT *ht, QHTStats *stats);
+
+#endif
@@ -558,6 +558,191 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-capability",
+        .args_type  = "capability:s,state:b",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_capability,
+    },
+
+SQMP
+migrate-set-capability
+----------------------
+
+Enable or disable a migration capability.
+
+Arguments:
+
+- "capability": capability name (json-string)
+     - Possible values: "compress", "xbzrle", "zero-blocks", "postcopy-ram",
+       "multifd", "auto-converge"
+- "state": new state of the capability (json-bool)
+
+Example:
+
+-> { "execute": "migrate-set-capability",
+     "arguments": { "capability": "compress", "state": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,"
+                      "decompress-threads:i?,postcopy-passes:i?,"
+                      "multifd-channels:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set the migration tunables.
+
+Arguments:
+
+- "compress-level": zlib compression level, 1 to 9 (json-int, optional)
+- "compress-threads": number of compression threads (json-int, optional)
+- "decompress-threads": number of decompression threads (json-int, optional)
+- "postcopy-passes": passes over the RAM before switching to postcopy, 0 to
+  only switch on migrate-start-postcopy (json-int, optional)
+- "multifd-channels": number of additional connections of the "multifd"
+  capability, 1 to 16 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 1, "compress-threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the running migration to postcopy: the guest is started on the
+destination, which fetches the pages it touches from the source while the
+rest of the RAM is sent.  Requires the "postcopy-ram" capability.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-cache-size",
+        .args_type  = "value:o",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_cache_size,
+    },
+
+SQMP
+migrate-set-cache-size
+----------------------
+
+Set the size of the XBZRLE cache.  The size is rounded down to a whole
+number of pages.
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "snapshot-live",
+        .args_type  = "file:F,incremental:b?",
+        .mhandler.cmd_new = qmp_marshal_input_snapshot_live,
+    },
+
+SQMP
+snapshot-live
+-------------
+
+Save the state of the VM to a file while the guest keeps running.  The
+guest is only stopped for the last pass over its RAM and for the device
+state.  Disks are not saved.  The command returns once the snapshot has
+started; see query-snapshot-live.
+
+Arguments:
+
+- "file": file to write the snapshot to (json-string)
+- "incremental": only save the pages written since the last live snapshot
+                 completed (json-bool, optional)
+
+Example:
+
+-> { "execute": "snapshot-live", "arguments": { "file": "/tmp/base.snap" } }
+<- { "return": {} }
+-> { "execute": "snapshot-live",
+     "arguments": { "file": "/tmp/incr1.snap", "incremental": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "snapshot-live-cancel",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_snapshot_live_cancel,
+    },
+
+SQMP
+snapshot-live-cancel
+--------------------
+
+Cancel the running live snapshot.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "snapshot-live-cancel" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "snapshot-live-load",
+        .args_type  = "file:F",
+        .mhandler.cmd_new = qmp_marshal_input_snapshot_live_load,
+    },
+
+SQMP
+snapshot-live-load
+------------------
+
+Restore a snapshot saved by snapshot-live.  A chain is restored by loading
+its full snapshot, then its incremental snapshots in the order they were
+taken.
+
+Arguments:
+
+- "file": file to read the snapshot from (json-string)
+
+Example:
+
+-> { "execute": "snapshot-live-load", "arguments": { "file": "/tmp/base.snap" } }
+<- { "return": {} }
+-> { "execute": "snapshot-live-load", "arguments": { "file": "/tmp/incr1.snap" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -680,6 +865,43 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change the I/O limits of a block device.  Requests beyond the limits wait
+in the order they were made.  A limit of 0 means unlimited; all non-zero
+limits apply at the same time.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps": total throughput limit in bytes per second (json-int)
+- "bps_rd": read throughput limit in bytes per second (json-int)
+- "bps_wr": write throughput limit in bytes per second (json-int)
+- "iops": total I/O operations per second (json-int)
+- "iops_rd": read I/O operations per second (json-int)
+- "iops_wr": write I/O operations per second (json-int)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                        "bps": 1000000,
+                                                        "bps_rd": 0,
+                                                        "bps_wr": 0,
+                                                        "iops": 0,
+                                                        "iops_rd": 0,
+                                                        "iops_wr": 0 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1152,6 +1374,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps": limit total bytes per second (json-int)
+         - "bps_rd": limit read bytes per second (json-int)
+         - "bps_wr": limit write bytes per second (json-int)
+         - "iops": limit total I/O operations per second (json-int)
+         - "iops_rd": limit read operations per second (json-int)
+         - "iops_wr": limit write operations per second (json-int)
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
                to "ok" when the "cont" command is issued (json_string, optional)
@@ -1171,7 +1399,13 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
-               "file":"disks/test.img"
+               "file":"disks/test.img",
+               "bps":1000000,
+               "bps_rd":0,
+               "bps_wr":0,
+               "iops":1000000,
+               "iops_rd":0,
+               "iops_wr":0
             },
             "type":"unknown"
          },
@@ -1228,6 +1462,41 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": lookups served by the image format's L2 table
+                       cache (json-int, optional)
+    - "l2_cache_misses": lookups that loaded an L2 table (json-int, optional)
+    - "refcount_cache_hits": lookups served by the image format's refcount
+                             block cache (json-int, optional)
+    - "refcount_cache_misses": lookups that loaded a refcount block
+                               (json-int, optional)
+    The cache counters are only present for formats with metadata caches,
+    like qcow2
+    - "throttled_operations": requests delayed by the I/O limits
+                              (json-int, optional)
+    - "throttled_total_time_ns": total time requests waited for the I/O
+                                 limits in nano-seconds (json-int, optional)
+    The throttling counters are only present for devices with I/O limits
+    - "in_flight": requests submitted but not completed yet (json-int)
+    - "rd_latency_histogram": time read requests took in nano-seconds, as a
+                              json-array of json-objects with "start", the
+                              lower bound of the bucket, and "count", the
+                              number of requests.  The first bucket is
+                              [0, 1024), then each bucket ends where the
+                              next power of two starts: [1024, 2048),
+                              [2048, 4096) and so on up to the one starting
+                              at 2^40, which has no upper bound.  Only the
+                              non-empty buckets are listed, so the next
+                              "start" is not always the upper bound; the
+                              field is omitted if there are none (optional)
+    - "wr_latency_histogram": same for write requests (optional)
+    - "flush_latency_histogram": same for cache flushes (optional)
+    - "queue_depth_histogram": number of requests in flight when each request
+                               was submitted, itself included, in the same
+                               form, with buckets [1, 2), [2, 4) and so on up
+                               to the one starting at 32768, which has no
+                               upper bound (optional)
+    Comparing the histograms of a device with those of its "parent" shows
+    how much of the latency comes from the image format and the I/O limits
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1892,16 +2161,47 @@ The main json-object contains the following:
 
 - "status": migration status (json-string)
      - Possible values: "active", "completed", "failed", "cancelled"
-- "ram": only present if "status" is "active", it is a json-object with the
-  following RAM information (in bytes):
-         - "transferred": amount transferred (json-int)
-         - "remaining": amount remaining (json-int)
-         - "total": total (json-int)
+- "total-time": only present if "status" is "active" or "completed", time
+  elapsed since the migration started, or its total duration once it has
+  completed, in milliseconds (json-int)
+- "setup-time": only present if "status" is "active" or "completed", time
+  spent before the first iteration, in milliseconds (json-int)
+- "expected-downtime": only present if "status" is "active", time the guest
+  would be stopped if the migration completed now, in milliseconds
+  (json-int)
+- "downtime": only present if "status" is "completed", or after the switch
+  to postcopy, time the guest was stopped, in milliseconds (json-int)
+- "ram": only present if "status" is "active" or "completed", it is a
+  json-object with the following RAM information:
+         - "transferred": amount transferred in bytes (json-int)
+         - "remaining": amount remaining in bytes (json-int)
+         - "total": total in bytes (json-int)
+         - "duplicate": pages made of a single repeated byte (json-int)
+         - "normal": pages sent in full (json-int)
+         - "normal-bytes": bytes sent in full pages (json-int)
+         - "dirty-pages-rate": pages dirtied again per second (json-int)
+         - "dirty-sync-count": number of iterations (json-int)
+         - "mbps": throughput in megabits per second (json-number)
 - "disk": only present if "status" is "active" and it is a block migration,
-  it is a json-object with the following disk information (in bytes):
-         - "transferred": amount transferred (json-int)
-         - "remaining": amount remaining (json-int)
-         - "total": total (json-int)
+  it is a json-object with the following disk information:
+         - "transferred": amount transferred in bytes (json-int)
+         - "remaining": amount remaining in bytes (json-int)
+         - "total": total in bytes (json-int)
+         - "duplicate": zero chunks sent without their data (json-int)
+         - "normal": chunks sent in full (json-int)
+         - "normal-bytes": bytes sent in full chunks (json-int)
+- "xbzrle-cache": only present if XBZRLE is enabled and "status" is
+  "active" or "completed", it is a json-object with the following
+  XBZRLE information:
+         - "cache-size": XBZRLE cache size in bytes (json-int)
+         - "bytes": bytes sent as XBZRLE deltas (json-int)
+         - "pages": pages sent as XBZRLE deltas (json-int)
+         - "cache-miss": re-sent pages not found in the cache (json-int)
+         - "cache-hit-rate": ratio of re-sent pages found in the cache
+           (json-number)
+         - "overflow": pages whose delta did not fit in a page (json-int)
+- "cpu-throttle-percentage": only present while the "auto-converge"
+  capability throttles the vCPUs, share of the time they sleep (json-int)
 
 Examples:
 
@@ -1913,7 +2213,24 @@ Examples:
 2. Migration is done and has succeeded
 
 -> { "execute": "query-migrate" }
-<- { "return": { "status": "completed" } }
+<- { "return": {
+        "status": "completed",
+        "total-time":12345,
+        "setup-time":12,
+        "downtime":34,
+        "ram":{
+          "transferred":123,
+          "remaining":0,
+          "total":246,
+          "duplicate":123,
+          "normal":123,
+          "normal-bytes":123456,
+          "dirty-pages-rate":0,
+          "dirty-sync-count":15,
+          "mbps":8.5
+        }
+     }
+   }
 
 3. Migration is done and has failed
 
@@ -1926,10 +2243,19 @@ Examples:
 <- {
       "return":{
          "status":"active",
+         "total-time":12345,
+         "setup-time":12,
+         "expected-downtime":12,
          "ram":{
             "transferred":123,
             "remaining":123,
-            "total":246
+            "total":246,
+            "duplicate":123,
+            "normal":123,
+            "normal-bytes":123456,
+            "dirty-pages-rate":10,
+            "dirty-sync-count":8,
+            "mbps":8.5
          }
       }
    }
@@ -1961,6 +2287,113 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
     },
 
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Show the state of the migration capabilities.
+
+Return a json-array of json-objects, one per capability, with:
+
+- "capability": capability name (json-string)
+- "state": capability state (json-bool)
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "capability": "compress", "state": false } ] }
+
+EQMP
+
+    {
+        .name       = "query-migrate-capabilities",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show the migration tunables.
+
+Return a json-object with:
+
+- "compress-level": zlib compression level (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+- "postcopy-passes": passes over the RAM before switching to postcopy
+  (json-int)
+- "multifd-channels": number of additional connections of the "multifd"
+  capability (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2, "postcopy-passes": 2,
+                 "multifd-channels": 2 } }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-cache-size
+------------------------
+
+Show the size of the XBZRLE cache, in bytes.
+
+Example:
+
+-> { "execute": "query-migrate-cache-size" }
+<- { "return": 67108864 }
+
+EQMP
+
+    {
+        .name       = "query-migrate-cache-size",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_cache_size,
+    },
+
+SQMP
+query-snapshot-live
+-------------------
+
+Show the status of the last live snapshot.
+
+Return a json-object with the following information:
+
+- "status": "active", "completed", "failed" or "cancelled" (json-string,
+            absent if no live snapshot was started)
+- "file": file the snapshot is written to (json-string)
+- "incremental": true for an incremental snapshot (json-bool)
+- "bytes": amount of bytes written to the file (json-int)
+- "total-time": time elapsed since the snapshot started, or its duration
+                once it has ended, in milliseconds (json-int)
+- "downtime": time the guest was stopped for, in milliseconds (json-int,
+              only present once the snapshot has completed)
+
+Example:
+
+-> { "execute": "query-snapshot-live" }
+<- { "return": { "status": "completed", "file": "/tmp/incr1.snap",
+                 "incremental": true, "bytes": 2117632,
+                 "total-time": 112, "downtime": 9 } }
+
+EQMP
+
+    {
+        .name       = "query-snapshot-live",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_snapshot_live,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -83,6 +83,10 @@
 #include "qemu-queue.h"
 #include "qemu-timer.h"
 #include "cpus.h"
+#include "qemu-thread.h"
+#include "postcopy-ram.h"
+#include "qmp-commands.h"
+#include "qerror.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -157,9 +161,11 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFileWritevBufferFunc *writev_buffer;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
@@ -174,6 +180,12 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* With writev_buffer, the data to write: pieces of buf and the
+     * buffers passed to qemu_put_buffer_async.  */
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+    int iov_bytes;
+
     int last_error;
 };
 
@@ -262,10 +274,10 @@ QEMUFile *qemu_popen(FILE *stdio_file, const char *mode)
 
     if(mode[0] == 'r') {
         s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_pclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_pclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL);
     }
     return s->file;
 }
@@ -282,6 +294,18 @@ QEMUFile *qemu_popen_cmd(const char *command, const char *mode)
     return qemu_popen(popen_file, mode);
 }
 
+/* Return the socket under f, or -1 if f is not a socket.  */
+int qemu_file_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+    s = f->opaque;
+    return s->fd;
+}
+
 int qemu_stdio_fd(QEMUFile *f)
 {
     QEMUFileStdio *p;
@@ -311,10 +335,10 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 
     if(mode[0] == 'r') {
         s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL);
     }
     return s->file;
 
@@ -329,7 +353,7 @@ QEMUFile *qemu_fopen_socket(int fd)
 
     s->fd = fd;
     s->file = qemu_fopen_ops(s, NULL, socket_get_buffer, socket_close, 
-			     NULL, NULL, NULL);
+			     NULL, NULL, NULL, NULL);
     return s->file;
 }
 
@@ -367,10 +391,10 @@ QEMUFile *qemu_fopen(const char *filename, const char *mode)
     
     if(mode[0] == 'w') {
         s->file = qemu_fopen_ops(s, file_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
+				 NULL, NULL, NULL, NULL);
     } else {
         s->file = qemu_fopen_ops(s, NULL, file_get_buffer, stdio_fclose, 
-			       NULL, NULL, NULL);
+			       NULL, NULL, NULL, NULL);
     }
     return s->file;
 fail:
@@ -378,6 +402,74 @@ fail:
     return NULL;
 }
 
+/* A file in memory, used to send the device state as a single blob.  */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (s->size + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, s->size + size);
+        s->data = g_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    g_free(s->data);
+    g_free(s);
+    return 0;
+}
+
+/* Open data for reading, or a new empty buffer for writing if data is NULL.
+ * The file takes ownership of data.  */
+static QEMUFile *qemu_bufopen(uint8_t *data, size_t size)
+{
+    QEMUFileBuffer *s = g_malloc0(sizeof(QEMUFileBuffer));
+
+    s->data = data;
+    s->size = size;
+    s->capacity = size;
+    if (data) {
+        return qemu_fopen_ops(s, NULL, buf_get_buffer, buf_close,
+                              NULL, NULL, NULL, NULL);
+    }
+    return qemu_fopen_ops(s, buf_put_buffer, NULL, buf_close,
+                          NULL, NULL, NULL, NULL);
+}
+
+static const uint8_t *qemu_buf_get_data(QEMUFile *f, size_t *size)
+{
+    QEMUFileBuffer *s = f->opaque;
+
+    qemu_fflush(f);
+    *size = s->size;
+    return s->data;
+}
+
 static int block_put_buffer(void *opaque, const uint8_t *buf,
                            int64_t pos, int size)
 {
@@ -399,8 +491,9 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
     if (is_writable)
         return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
+			      NULL, NULL, NULL, NULL);
+    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose,
+                          NULL, NULL, NULL, NULL);
 }
 
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
@@ -408,7 +501,8 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileCloseFunc *close,
                          QEMUFileRateLimit *rate_limit,
                          QEMUFileSetRateLimit *set_rate_limit,
-                         QEMUFileGetRateLimit *get_rate_limit)
+                         QEMUFileGetRateLimit *get_rate_limit,
+                         QEMUFileWritevBufferFunc *writev_buffer)
 {
     QEMUFile *f;
 
@@ -421,6 +515,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     f->rate_limit = rate_limit;
     f->set_rate_limit = set_rate_limit;
     f->get_rate_limit = get_rate_limit;
+    f->writev_buffer = writev_buffer;
     f->is_write = 0;
 
     return f;
@@ -438,12 +533,22 @@ void qemu_file_set_error(QEMUFile *f, int ret)
 
 void qemu_fflush(QEMUFile *f)
 {
+    ssize_t len;
+
     if (!f->put_buffer)
         return;
 
-    if (f->is_write && f->buf_index > 0) {
-        int len;
-
+    if (f->is_write && f->iovcnt > 0) {
+        len = f->writev_buffer(f->opaque, f->iov, f->iovcnt, f->buf_offset);
+        if (len > 0) {
+            f->buf_offset += f->iov_bytes;
+        } else {
+            f->last_error = -EINVAL;
+        }
+        f->iovcnt = 0;
+        f->iov_bytes = 0;
+        f->buf_index = 0;
+    } else if (f->is_write && f->buf_index > 0) {
         len = f->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
         if (len > 0)
             f->buf_offset += f->buf_index;
@@ -497,6 +602,28 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+/* Queue size bytes at buf for the next writev_buffer call, merging them
+ * with the previous element when they follow it in memory.  The vector
+ * is written once it is full or holds as much as the copy buffer, so the
+ * rate limit sees the data in chunks of the same size as before.  */
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+
+    if (last && buf == (uint8_t *)last->iov_base + last->iov_len) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+    f->iov_bytes += size;
+
+    if (f->iovcnt >= MAX_IOV_SIZE || f->iov_bytes >= IO_BUF_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -516,8 +643,33 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         f->buf_index += l;
         buf += l;
         size -= l;
-        if (f->buf_index >= IO_BUF_SIZE)
+        if (f->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        } else if (f->buf_index >= IO_BUF_SIZE) {
             qemu_fflush(f);
+        }
+    }
+}
+
+/* Like qemu_put_buffer, but only keep a reference to buf when the file
+ * can write vectors: buf must stay valid until the next qemu_fflush.
+ * Used for guest pages, which are sent without being copied.  */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (!f->last_error && size > 0) {
+        f->is_write = 1;
+        add_to_iovec(f, buf, size);
     }
 }
 
@@ -531,8 +683,11 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE)
+    if (f->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    } else if (f->buf_index >= IO_BUF_SIZE) {
         qemu_fflush(f);
+    }
 }
 
 static void qemu_file_skip(QEMUFile *f, int size)
@@ -619,6 +774,9 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        return f->buf_offset + f->iov_bytes;
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -1512,6 +1670,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1614,26 +1773,31 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static int qemu_savevm_state_live(Monitor *mon, QEMUFile *f,
+                                  int section_type, int stage)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
             continue;
 
         /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_END);
+        qemu_put_byte(f, section_type);
         qemu_put_be32(f, se->section_id);
 
-        ret = se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
+        ret = se->save_live_state(mon, f, stage, se->opaque);
         if (ret < 0) {
             return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_full(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1655,7 +1819,70 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
 
         vmstate_save(f, se);
     }
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_live(mon, f, QEMU_VM_SECTION_END,
+                                 QEMU_VM_SECTION_END);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_savevm_state_full(f);
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Switch to postcopy, with the VM stopped.  The live handlers send what
+ * the destination needs to start without their remaining state, and the
+ * device state follows as a single blob, so that the destination can
+ * load it while it keeps reading the pages the devices touch.  Iterating
+ * then sends the rest of the live state, and
+ * qemu_savevm_state_postcopy_complete ends the stream.
+ */
+int qemu_savevm_state_postcopy(Monitor *mon, QEMUFile *f)
+{
+    QEMUFile *package;
+    const uint8_t *data;
+    size_t size;
+    int ret;
 
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_live(mon, f, QEMU_VM_SECTION_PART,
+                                 QEMU_SAVEVM_STAGE_POSTCOPY);
+    if (ret < 0) {
+        return ret;
+    }
+
+    package = qemu_bufopen(NULL, 0);
+    qemu_savevm_state_full(package);
+    qemu_put_byte(package, QEMU_VM_EOF);
+    data = qemu_buf_get_data(package, &size);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, size);
+    qemu_put_buffer(f, data, size);
+    qemu_fclose(package);
+
+    return qemu_file_get_error(f);
+}
+
+int qemu_savevm_state_postcopy_complete(Monitor *mon, QEMUFile *f)
+{
+    int ret;
+
+    ret = qemu_savevm_state_live(mon, f, QEMU_VM_SECTION_END,
+                                 QEMU_VM_SECTION_END);
+    if (ret < 0) {
+        return ret;
+    }
     qemu_put_byte(f, QEMU_VM_EOF);
 
     return qemu_file_get_error(f);
@@ -1801,30 +2028,36 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+typedef struct PostcopyListenState {
+    QEMUFile *f;
+    LoadStateList *handlers;
+    QemuThread thread;
+} PostcopyListenState;
+
+static int qemu_loadvm_postcopy(QEMUFile *f, LoadStateList *handlers);
+
+static void loadvm_free_handlers(LoadStateList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
-    int ret;
 
-    if (qemu_savevm_state_blocked(default_mon)) {
-        return -EINVAL;
+    QLIST_FOREACH_SAFE(le, handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
     }
+}
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+/*
+ * Load sections up to QEMU_VM_EOF.  Returns 1 if the source switched to
+ * postcopy: the rest of f is then loaded by a separate thread, which owns
+ * f and takes the entries of handlers.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1847,16 +2080,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1865,59 +2096,157 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            return qemu_loadvm_postcopy(f, handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+static void *postcopy_listen_thread(void *opaque)
+{
+    PostcopyListenState *pl = opaque;
+    int fd = qemu_file_socket_fd(pl->f);
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+    ret = qemu_loadvm_state_main(pl->f, pl->handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(pl->f);
+    }
+    postcopy_ram_incoming_cleanup();
+    loadvm_free_handlers(pl->handlers);
+    g_free(pl->handlers);
+
+    if (ret < 0) {
+        fprintf(stderr, "load of migration failed\n");
+        exit(0);
+    }
+
+    qemu_fclose(pl->f);
+    close(fd);
+    g_free(pl);
+    return NULL;
+}
+
+/*
+ * The live sections go on in a separate thread, which places the pages
+ * the guest faults on as they arrive, while this thread loads the device
+ * state from the package and returns so that the guest can be started.
+ */
+static int qemu_loadvm_postcopy(QEMUFile *f, LoadStateList *handlers)
+{
+    PostcopyListenState *pl;
+    LoadStateList package_handlers = QLIST_HEAD_INITIALIZER(package_handlers);
+    LoadStateEntry *le;
+    QEMUFile *package;
+    uint8_t *data;
+    uint32_t size;
+    int ret;
+
+    size = qemu_get_be32(f);
+    data = g_malloc(size);
+    if (qemu_get_buffer(f, data, size) != size) {
+        g_free(data);
+        return -EINVAL;
+    }
+    if (!postcopy_ram_incoming_active()) {
+        fprintf(stderr, "savevm: postcopy state without postcopy RAM\n");
+        g_free(data);
+        return -EINVAL;
+    }
+
+    pl = g_malloc0(sizeof(*pl));
+    pl->f = f;
+    pl->handlers = g_malloc0(sizeof(*pl->handlers));
+    while ((le = QLIST_FIRST(handlers)) != NULL) {
         QLIST_REMOVE(le, entry);
-        g_free(le);
+        QLIST_INSERT_HEAD(pl->handlers, le, entry);
     }
+    qemu_thread_create(&pl->thread, postcopy_listen_thread, pl);
 
+    package = qemu_bufopen(data, size);
+    ret = qemu_loadvm_state_main(package, &package_handlers);
     if (ret == 0) {
-        ret = qemu_file_get_error(f);
+        ret = qemu_file_get_error(package);
     }
+    loadvm_free_handlers(&package_handlers);
+    qemu_fclose(package);
 
-    return ret;
+    return ret < 0 ? ret : 1;
+}
+
+/*
+ * Returns 1 if the load goes on in the background after a switch to
+ * postcopy; f and its file descriptor are then closed when it completes.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateList handlers = QLIST_HEAD_INITIALIZER(handlers);
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(default_mon)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &handlers);
+    loadvm_free_handlers(&handlers);
+    if (ret < 0) {
+        return ret;
+    }
+
+    cpu_synchronize_all_post_init();
+
+    if (ret == 1) {
+        return 1;
+    }
+    return qemu_file_get_error(f);
 }
 
 static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
@@ -1986,6 +2315,11 @@ void do_savevm(Monitor *mon, const QDict *qdict)
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
 
+    if (snapshot_live_is_active()) {
+        monitor_printf(mon, "live snapshot in progress\n");
+        return;
+    }
+
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -2089,6 +2423,12 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    /* the live snapshot would go on saving the RAM being loaded */
+    if (snapshot_live_is_active()) {
+        error_report("live snapshot in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2129,7 +2469,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -2254,3 +2594,261 @@ void do_info_snapshots(Monitor *mon)
     g_free(available_snapshots);
 
 }
+
+/*
+ * Live snapshots save the VM state to a file with the iterative migration
+ * code while the guest keeps running; it is only stopped for the last pass
+ * and the device state.  The file holds a migration stream, which is loaded
+ * with snapshot-live-load or "-incoming exec:cat file".  Once a snapshot
+ * has completed, the pages the guest writes are tracked so that the next
+ * one can be incremental: it only holds the pages dirtied in the meantime,
+ * and is loaded after the snapshots it builds upon.  Disks are not saved.
+ */
+
+enum {
+    SNAPSHOT_LIVE_NONE,
+    SNAPSHOT_LIVE_ACTIVE,
+    SNAPSHOT_LIVE_COMPLETED,
+    SNAPSHOT_LIVE_FAILED,
+    SNAPSHOT_LIVE_CANCELLED,
+};
+
+#define SNAPSHOT_LIVE_TICK_MS    100
+#define SNAPSHOT_LIVE_TICK_BYTES (32 << 20)
+
+typedef struct LiveSnapshotState {
+    int state;
+    char *filename;
+    bool incremental;
+    FILE *stdio_file;
+    QEMUFile *file;
+    QEMUTimer *timer;
+    int64_t tick_bytes;
+    int64_t bytes;
+    int64_t start_time;
+    int64_t total_time;
+    int64_t downtime;
+} LiveSnapshotState;
+
+static LiveSnapshotState live_snapshot;
+
+static int snapshot_live_put_buffer(void *opaque, const uint8_t *buf,
+                                    int64_t pos, int size)
+{
+    LiveSnapshotState *s = opaque;
+    size_t len;
+
+    len = fwrite(buf, 1, size, s->stdio_file);
+    s->tick_bytes += len;
+    s->bytes += len;
+    return len;
+}
+
+static int snapshot_live_rate_limit(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret;
+
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        return ret;
+    }
+    return s->tick_bytes >= SNAPSHOT_LIVE_TICK_BYTES;
+}
+
+static int snapshot_live_close(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret;
+
+    ret = fclose(s->stdio_file) == 0 ? 0 : -errno;
+    s->stdio_file = NULL;
+    return ret;
+}
+
+bool snapshot_live_is_active(void)
+{
+    return live_snapshot.state == SNAPSHOT_LIVE_ACTIVE;
+}
+
+static void snapshot_live_finish(LiveSnapshotState *s, int state)
+{
+    if (state != SNAPSHOT_LIVE_COMPLETED) {
+        qemu_savevm_state_cancel(NULL, s->file);
+    }
+    if (qemu_fclose(s->file) != 0) {
+        state = SNAPSHOT_LIVE_FAILED;
+    }
+    s->file = NULL;
+    ram_snapshot_end(state == SNAPSHOT_LIVE_COMPLETED);
+    cpu_throttle_stop();
+    qemu_del_timer(s->timer);
+
+    s->state = state;
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+}
+
+static void snapshot_live_complete(LiveSnapshotState *s)
+{
+    int saved_vm_running = runstate_is_running();
+    int64_t stop_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    vm_stop(RUN_STATE_SAVE_VM);
+    ret = qemu_savevm_state_complete(NULL, s->file);
+    snapshot_live_finish(s, ret < 0 ? SNAPSHOT_LIVE_FAILED
+                                    : SNAPSHOT_LIVE_COMPLETED);
+    s->downtime = qemu_get_clock_ms(rt_clock) - stop_time;
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+static void snapshot_live_iterate(void *opaque)
+{
+    LiveSnapshotState *s = opaque;
+    int ret;
+
+    s->tick_bytes = 0;
+    ret = qemu_savevm_state_iterate(NULL, s->file);
+    if (ret < 0) {
+        snapshot_live_finish(s, SNAPSHOT_LIVE_FAILED);
+    } else if (ret == 1) {
+        snapshot_live_complete(s);
+    } else {
+        qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) +
+                       SNAPSHOT_LIVE_TICK_MS);
+    }
+}
+
+void qmp_snapshot_live(const char *file, bool has_incremental,
+                       bool incremental, Error **errp)
+{
+    LiveSnapshotState *s = &live_snapshot;
+
+    if (s->state == SNAPSHOT_LIVE_ACTIVE ||
+        migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (qemu_savevm_state_blocked(default_mon)) {
+        error_set(errp, QERR_UNDEFINED_ERROR);
+        return;
+    }
+
+    incremental = has_incremental && incremental;
+    if (ram_snapshot_begin(incremental) < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "incremental",
+                  "false before a live snapshot has completed");
+        return;
+    }
+
+    s->stdio_file = fopen(file, "wb");
+    if (!s->stdio_file) {
+        ram_snapshot_end(false);
+        error_set(errp, QERR_OPEN_FILE_FAILED, file);
+        return;
+    }
+    s->file = qemu_fopen_ops(s, snapshot_live_put_buffer, NULL,
+                             snapshot_live_close, snapshot_live_rate_limit,
+                             NULL, NULL, NULL);
+    if (!s->timer) {
+        s->timer = qemu_new_timer_ms(rt_clock, snapshot_live_iterate, s);
+    }
+
+    g_free(s->filename);
+    s->filename = g_strdup(file);
+    s->incremental = incremental;
+    s->state = SNAPSHOT_LIVE_ACTIVE;
+    s->tick_bytes = 0;
+    s->bytes = 0;
+    s->start_time = qemu_get_clock_ms(rt_clock);
+    s->total_time = 0;
+    s->downtime = 0;
+
+    if (qemu_savevm_state_begin(NULL, s->file, 0, 0) < 0) {
+        snapshot_live_finish(s, SNAPSHOT_LIVE_FAILED);
+        error_set(errp, QERR_UNDEFINED_ERROR);
+        return;
+    }
+    snapshot_live_iterate(s);
+}
+
+void qmp_snapshot_live_cancel(Error **errp)
+{
+    LiveSnapshotState *s = &live_snapshot;
+
+    if (s->state == SNAPSHOT_LIVE_ACTIVE) {
+        snapshot_live_finish(s, SNAPSHOT_LIVE_CANCELLED);
+    }
+}
+
+SnapshotLiveInfo *qmp_query_snapshot_live(Error **errp)
+{
+    LiveSnapshotState *s = &live_snapshot;
+    SnapshotLiveInfo *info = g_malloc0(sizeof(*info));
+
+    switch (s->state) {
+    case SNAPSHOT_LIVE_NONE:
+        return info;
+    case SNAPSHOT_LIVE_ACTIVE:
+        info->status = g_strdup("active");
+        info->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+        break;
+    case SNAPSHOT_LIVE_COMPLETED:
+        info->status = g_strdup("completed");
+        info->total_time = s->total_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+        break;
+    case SNAPSHOT_LIVE_FAILED:
+        info->status = g_strdup("failed");
+        info->total_time = s->total_time;
+        break;
+    case SNAPSHOT_LIVE_CANCELLED:
+        info->status = g_strdup("cancelled");
+        info->total_time = s->total_time;
+        break;
+    }
+
+    info->has_status = true;
+    info->has_file = true;
+    info->file = g_strdup(s->filename);
+    info->has_incremental = true;
+    info->incremental = s->incremental;
+    info->has_bytes = true;
+    info->bytes = s->bytes;
+    info->has_total_time = true;
+
+    return info;
+}
+
+void qmp_snapshot_live_load(const char *file, Error **errp)
+{
+    int saved_vm_running = runstate_is_running();
+    QEMUFile *f;
+    int ret;
+
+    if (live_snapshot.state == SNAPSHOT_LIVE_ACTIVE ||
+        migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    f = qemu_fopen(file, "rb");
+    if (!f) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, file);
+        return;
+    }
+
+    vm_stop(RUN_STATE_RESTORE_VM);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_set(errp, QERR_UNDEFINED_ERROR);
+        return;
+    }
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
@@ -18,6 +18,25 @@ void REGPARM __stl_mmu(target_ulong addr, uint32_t val, int mmu_idx);
 uint64_t REGPARM __ldq_mmu(target_ulong addr, int mmu_idx);
 void REGPARM __stq_mmu(target_ulong addr, uint64_t val, int mmu_idx);
 
+/* Variants taking the host return address explicitly, for callers
+   that are not at the memory access itself.  */
+uint8_t REGPARM __ldb_ret_mmu(target_ulong addr, int mmu_idx,
+                              void *retaddr);
+void REGPARM __stb_ret_mmu(target_ulong addr, uint8_t val,
+                           int mmu_idx, void *retaddr);
+uint16_t REGPARM __ldw_ret_mmu(target_ulong addr, int mmu_idx,
+                               void *retaddr);
+void REGPARM __stw_ret_mmu(target_ulong addr, uint16_t val,
+                           int mmu_idx, void *retaddr);
+uint32_t REGPARM __ldl_ret_mmu(target_ulong addr, int mmu_idx,
+                               void *retaddr);
+void REGPARM __stl_ret_mmu(target_ulong addr, uint32_t val,
+                           int mmu_idx, void *retaddr);
+uint64_t REGPARM __ldq_ret_mmu(target_ulong addr, int mmu_idx,
+                               void *retaddr);
+void REGPARM __stq_ret_mmu(target_ulong addr, uint64_t val,
+                           int mmu_idx, void *retaddr);
+
 uint8_t REGPARM __ldb_cmmu(target_ulong addr, int mmu_idx);
 void REGPARM __stb_cmmu(target_ulong addr, uint8_t val, int mmu_idx);
 uint16_t REGPARM __ldw_cmmu(target_ulong addr, int mmu_idx);
@@ -27,4 +46,21 @@ void REGPARM __stl_cmmu(target_ulong addr, uint32_t val, int mmu_idx);
 uint64_t REGPARM __ldq_cmmu(target_ulong addr, int mmu_idx);
 void REGPARM __stq_cmmu(target_ulong addr, uint64_t val, int mmu_idx);
 
+uint8_t REGPARM __ldb_ret_cmmu(target_ulong addr, int mmu_idx,
+                               void *retaddr);
+void REGPARM __stb_ret_cmmu(target_ulong addr, uint8_t val,
+                            int mmu_idx, void *retaddr);
+uint16_t REGPARM __ldw_ret_cmmu(target_ulong addr, int mmu_idx,
+                                void *retaddr);
+void REGPARM __stw_ret_cmmu(target_ulong addr, uint16_t val,
+                            int mmu_idx, void *retaddr);
+uint32_t REGPARM __ldl_ret_cmmu(target_ulong addr, int mmu_idx,
+                                void *retaddr);
+void REGPARM __stl_ret_cmmu(target_ulong addr, uint32_t val,
+                            int mmu_idx, void *retaddr);
+uint64_t REGPARM __ldq_ret_cmmu(target_ulong addr, int mmu_idx,
+                                void *retaddr);
+void REGPARM __stq_ret_cmmu(target_ulong addr, uint64_t val,
+                            int mmu_idx, void *retaddr);
+
 #endif
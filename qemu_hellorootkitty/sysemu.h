@@ -62,15 +62,21 @@ void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
+bool snapshot_live_is_active(void);
 
 void qemu_announce_self(void);
 
+/* Stage passed to the live handlers on the switch to postcopy */
+#define QEMU_SAVEVM_STAGE_POSTCOPY 4
+
 bool qemu_savevm_state_blocked(Monitor *mon);
 int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared);
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f);
 int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
+int qemu_savevm_state_postcopy(Monitor *mon, QEMUFile *f);
+int qemu_savevm_state_postcopy_complete(Monitor *mon, QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
 /* SLIRP */
@@ -29,6 +29,7 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "softmmu_exec.h"
+#include "main-loop.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
 //#define DEBUG_PCALL
@@ -211,13 +212,40 @@ static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 void helper_lock(void)
 {
     spin_lock(&global_cpu_lock);
+#if !defined(CONFIG_USER_ONLY)
+    cpu_mt_atomic_lock();
+#endif
 }
 
 void helper_unlock(void)
 {
+#if !defined(CONFIG_USER_ONLY)
+    cpu_mt_atomic_unlock();
+#endif
     spin_unlock(&global_cpu_lock);
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* The APIC, FERR# and SMM callbacks belong to device emulation, which
+   VCPU threads of multi-threaded TCG must enter with the iothread mutex
+   held.  Returns true if the caller has to drop it again.  */
+static bool cpu_lock_iothread(void)
+{
+    if (mttcg_enabled && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+static void cpu_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+#endif
+
 void helper_write_eflags(target_ulong t0, uint32_t update_mask)
 {
     load_eflags(t0, update_mask);
@@ -1536,6 +1564,7 @@ void do_smm_enter(CPUState *env1)
     SegmentCache *dt;
     int i, offset;
     CPUState *saved_env;
+    bool locked;
 
     saved_env = env;
     env = env1;
@@ -1544,7 +1573,9 @@ void do_smm_enter(CPUState *env1)
     log_cpu_state_mask(CPU_LOG_INT, env, X86_DUMP_CCOP);
 
     env->hflags |= HF_SMM_MASK;
+    locked = cpu_lock_iothread();
     cpu_smm_update(env);
+    cpu_unlock_iothread(locked);
 
     sm_state = env->smbase + 0x8000;
 
@@ -1673,6 +1704,7 @@ void helper_rsm(void)
     target_ulong sm_state;
     int i, offset;
     uint32_t val;
+    bool locked;
 
     sm_state = env->smbase + 0x8000;
 #ifdef TARGET_X86_64
@@ -1780,7 +1812,9 @@ void helper_rsm(void)
 #endif
     CC_OP = CC_OP_EFLAGS;
     env->hflags &= ~HF_SMM_MASK;
+    locked = cpu_lock_iothread();
     cpu_smm_update(env);
+    cpu_unlock_iothread(locked);
 
     qemu_log_mask(CPU_LOG_INT, "SMM: after RSM\n");
     log_cpu_state_mask(CPU_LOG_INT, env, X86_DUMP_CCOP);
@@ -3046,7 +3080,9 @@ target_ulong helper_read_crN(int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = cpu_lock_iothread();
             val = cpu_get_apic_tpr(env->apic_state);
+            cpu_unlock_iothread(locked);
         } else {
             val = env->v_tpr;
         }
@@ -3070,7 +3106,9 @@ void helper_write_crN(int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = cpu_lock_iothread();
             cpu_set_apic_tpr(env->apic_state, t0);
+            cpu_unlock_iothread(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -3162,6 +3200,7 @@ void helper_rdmsr(void)
 void helper_wrmsr(void)
 {
     uint64_t val;
+    bool locked;
 
     helper_svm_check_intercept_param(SVM_EXIT_MSR, 1);
 
@@ -3178,7 +3217,9 @@ void helper_wrmsr(void)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+        locked = cpu_lock_iothread();
         cpu_set_apic_base(env->apic_state, val);
+        cpu_unlock_iothread(locked);
         break;
     case MSR_EFER:
         {
@@ -3300,6 +3341,7 @@ void helper_wrmsr(void)
 void helper_rdmsr(void)
 {
     uint64_t val;
+    bool locked;
 
     helper_svm_check_intercept_param(SVM_EXIT_MSR, 0);
 
@@ -3314,7 +3356,9 @@ void helper_rdmsr(void)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
+        locked = cpu_lock_iothread();
         val = cpu_get_apic_base(env->apic_state);
+        cpu_unlock_iothread(locked);
         break;
     case MSR_EFER:
         val = env->efer;
@@ -3635,7 +3679,9 @@ static void fpu_raise_exception(void)
     }
 #if !defined(CONFIG_USER_ONLY)
     else {
+        bool locked = cpu_lock_iothread();
         cpu_set_ferr(env);
+        cpu_unlock_iothread(locked);
     }
 #endif
 }
@@ -115,6 +115,11 @@ typedef struct DisasContext {
     int cpuid_ext_features;
     int cpuid_ext2_features;
     int cpuid_ext3_features;
+    /* superblock translation */
+    int sb_idx;         /* next block of tb->sb_trace */
+    int sb_label;       /* jump to the next block, or -1 */
+    target_ulong sb_next_eip;
+    int sb_exit;        /* next free jump slot */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2281,6 +2286,23 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
+    if (s->sb_idx < tb->sb_len && pc == tb->sb_trace[s->sb_idx] &&
+        s->sb_label < 0) {
+        /* the superblock goes on with the code at eip */
+        s->sb_label = gen_new_label();
+        s->sb_next_eip = eip;
+        tcg_gen_br(s->sb_label);
+        return;
+    }
+    if (tb->sb_len) {
+        /* a superblock has more exits than jump slots */
+        tb_num = s->sb_exit++;
+        if (tb_num > 1) {
+            gen_jmp_im(eip);
+            tcg_gen_exit_tb(0);
+            return;
+        }
+    }
     /* NOTE: we handle the case where the TB spans two pages here */
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
@@ -2762,6 +2784,10 @@ static inline void gen_sto_env_A0(int idx, int offset)
 
 static inline void gen_op_movo(int d_offset, int s_offset)
 {
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_mov_vec(16, d_offset, s_offset);
+        return;
+    }
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, s_offset);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, d_offset);
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, s_offset + 8);
@@ -3073,6 +3099,64 @@ static struct sse_op_helper_s sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Expand the MMX/SSE integer and logic operations that map onto TCG
+   vector ops.  Returns 0 if the helper must be called instead.  */
+static int gen_sse_vec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    int oprsz = is_xmm ? 16 : 8;
+
+    if (!TCG_TARGET_HAS_vec) {
+        return 0;
+    }
+    switch (b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_add_vec(oprsz, b - 0xfc, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_add_vec(oprsz, 3, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_sub_vec(oprsz, b - 0xf8, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_cmpeq_vec(oprsz, b - 0x74, op1_offset, op1_offset,
+                          op2_offset);
+        break;
+    case 0x64: /* pcmpgtb */
+    case 0x65: /* pcmpgtw */
+    case 0x66: /* pcmpgtl */
+        tcg_gen_cmpgt_vec(oprsz, b - 0x64, op1_offset, op1_offset,
+                          op2_offset);
+        break;
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_and_vec(oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_andc_vec(oprsz, op1_offset, op2_offset, op1_offset);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_or_vec(oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_xor_vec(oprsz, op1_offset, op1_offset, op2_offset);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
 static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
 {
     int b1, op1_offset, op2_offset, is_xmm, val, ot;
@@ -4025,6 +4109,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = ldub_code(s->pc++);
+            if (b == 0x70 && b1 == 1 && TCG_TARGET_HAS_vec) {
+                /* pshufd */
+                tcg_gen_shuf32_vec(16, op1_offset, op2_offset, val);
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv_i32))sse_op2)(cpu_ptr0, cpu_ptr1, tcg_const_i32(val));
@@ -4060,6 +4149,9 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
             ((void (*)(TCGv_ptr, TCGv_ptr, TCGv))sse_op2)(cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_vec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             ((void (*)(TCGv_ptr, TCGv_ptr))sse_op2)(cpu_ptr0, cpu_ptr1);
@@ -7760,6 +7852,9 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
 #endif
     dc->flags = flags;
+    dc->sb_idx = 0;
+    dc->sb_label = -1;
+    dc->sb_exit = 0;
     dc->jmp_opt = !(dc->tf || env->singlestep_enabled ||
                     (flags & HF_INHIBIT_IRQ_MASK)
 #ifndef CONFIG_SOFTMMU
@@ -7824,6 +7919,21 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 
         pc_ptr = disas_insn(dc, pc_ptr);
         num_insns++;
+        if (dc->sb_label >= 0) {
+            /* continue with the next block of the superblock; the
+               jump to it is dropped if nothing follows it */
+            if (gen_opc_ptr[-1] == INDEX_op_br &&
+                gen_opparam_ptr[-1] == dc->sb_label) {
+                gen_opc_ptr--;
+                gen_opparam_ptr--;
+            } else {
+                gen_set_label(dc->sb_label);
+            }
+            pc_ptr = dc->cs_base + dc->sb_next_eip;
+            dc->sb_label = -1;
+            dc->sb_idx++;
+            dc->is_jmp = DISAS_NEXT;
+        }
         /* stop translation if indicated */
         if (dc->is_jmp)
             break;
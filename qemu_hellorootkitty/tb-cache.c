@@ -0,0 +1,490 @@
+/*
+ * Persistent translation block cache
+ *
+ * The translated code is written to a file when QEMU exits and loaded
+ * back at the next start of the same binary with the same machine, so
+ * that a warm start does not translate the firmware and the guest kernel
+ * all over again.
+ *
+ * Host addresses embedded in the generated code are recorded by the TCG
+ * backend (see tcg_out_code_reloc) and rebased when loading.  Loaded TBs
+ * are kept aside until they are first looked up, and only then linked
+ * into the physical hash table if the guest code they were translated
+ * from is unchanged.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "config.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "sysemu.h"
+#include "tb-cache.h"
+
+#define TB_CACHE_MAGIC      0x43425451  /* "QTBC" */
+#define TB_CACHE_VERSION    1
+
+#define TB_CACHE_HASH_BITS  12
+#define TB_CACHE_HASH_SIZE  (1 << TB_CACHE_HASH_BITS)
+
+#define TB_CACHE_MAX_CODE   (TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+#define TB_CACHE_MAX_TBS    (1 << 24)
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    char arch[16];
+    uint64_t binary_id;
+    uint64_t machine_id;
+    uint32_t nb_tbs;
+    uint32_t pad;
+} TBCacheHeader;
+
+/* followed by nb_relocs relocations and code_size bytes of code */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t page_addr[2];
+    uint64_t hash;
+    uint32_t icount;
+    uint32_t code_size;
+    uint16_t size;
+    uint16_t cflags;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t nb_relocs;
+    uint16_t nb_helper_calls;
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    TranslationBlock *tb;
+    uint64_t hash;          /* of the guest code at save time */
+    int next;
+} TBCacheEntry;
+
+static char *tb_cache_filename;
+
+/* loaded TBs that are not linked yet, hashed by physical pc */
+static TBCacheEntry *tb_cache_entries;
+static int tb_cache_heads[TB_CACHE_HASH_SIZE];
+static int tb_cache_nb_pending;
+
+static int tb_cache_nb_loaded;
+static int tb_cache_nb_hits;
+static int tb_cache_nb_stale;
+
+static inline unsigned int tb_cache_hash_func(tb_page_addr_t phys_pc)
+{
+    return (phys_pc >> 2) & (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline tb_page_addr_t tb_cache_phys_pc(TranslationBlock *tb)
+{
+    return tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+}
+
+/* FNV-1a */
+static uint64_t tb_cache_hash_bytes(uint64_t h, const uint8_t *p, int len)
+{
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t tb_cache_guest_hash(TranslationBlock *tb)
+{
+    int ofs = tb->pc & ~TARGET_PAGE_MASK;
+    int len = MIN(tb->size, TARGET_PAGE_SIZE - ofs);
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = tb_cache_hash_bytes(h, (uint8_t *)qemu_safe_ram_ptr(tb->page_addr[0])
+                            + ofs, len);
+    if (tb->size > len) {
+        h = tb_cache_hash_bytes(h, qemu_safe_ram_ptr(tb->page_addr[1]),
+                                tb->size - len);
+    }
+    return h;
+}
+
+/* Host addresses in the code are stored relative to this anchor, which
+   moves with the binary when it is loaded at another address.  */
+static inline uintptr_t tb_cache_anchor(void)
+{
+    return (uintptr_t)tb_cache_save;
+}
+
+/* start and end of the text of the binary, defined by the linker */
+extern const uint8_t __executable_start[], etext[];
+
+/* The saved code calls into the helpers of this very build, so the
+   cache is keyed on all of its text, hashed once.  */
+static uint64_t tb_cache_binary_id(void)
+{
+    static uint64_t id;
+
+    if (!id) {
+        id = tb_cache_hash_bytes(0xcbf29ce484222325ULL, __executable_start,
+                                 etext - __executable_start);
+    }
+    return id;
+}
+
+/* everything beside the binary that changes the generated code */
+static uint64_t tb_cache_machine_id(void)
+{
+    uint64_t v[8];
+    int n = 0;
+
+    v[n++] = ram_size;
+    v[n++] = use_icount;
+    v[n++] = mttcg_enabled;
+#if defined(TARGET_I386)
+    v[n++] = first_cpu->cpuid_features;
+    v[n++] = first_cpu->cpuid_ext_features;
+    v[n++] = first_cpu->cpuid_ext2_features;
+    v[n++] = first_cpu->cpuid_ext3_features;
+#endif
+    return tb_cache_hash_bytes(0xcbf29ce484222325ULL, (uint8_t *)v,
+                               n * sizeof(v[0]));
+}
+
+static int *tb_cache_find(TranslationBlock *tb)
+{
+    int *pi = &tb_cache_heads[tb_cache_hash_func(tb_cache_phys_pc(tb))];
+
+    while (*pi >= 0 && tb_cache_entries[*pi].tb != tb) {
+        pi = &tb_cache_entries[*pi].next;
+    }
+    return pi;
+}
+
+/* The code region of a pending TB is being recycled.  */
+void tb_cache_forget(TranslationBlock *tb)
+{
+    int *pi = tb_cache_find(tb);
+
+    if (*pi >= 0) {
+        *pi = tb_cache_entries[*pi].next;
+        tb_cache_nb_pending--;
+    }
+    tb->cache_pending = 0;
+}
+
+void tb_cache_forget_all(void)
+{
+    memset(tb_cache_heads, -1, sizeof(tb_cache_heads));
+    tb_cache_nb_pending = 0;
+}
+
+/* Called by tb_find_slow when no linked TB matches.  Returns a loaded
+   TB for this pc if the guest code is still the one it was translated
+   from, after linking it.  */
+TranslationBlock *tb_cache_lookup(CPUState *env, target_ulong pc,
+                                  target_ulong cs_base, uint64_t flags,
+                                  tb_page_addr_t phys_pc)
+{
+    TranslationBlock *tb;
+    TBCacheEntry *e;
+    tb_page_addr_t phys_page2;
+    int *pi;
+
+    if (!tb_cache_nb_pending) {
+        return NULL;
+    }
+    pi = &tb_cache_heads[tb_cache_hash_func(phys_pc)];
+    while (*pi >= 0) {
+        e = &tb_cache_entries[*pi];
+        tb = e->tb;
+        if (tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags ||
+            tb->page_addr[0] != (phys_pc & TARGET_PAGE_MASK)) {
+            pi = &e->next;
+            continue;
+        }
+        if (tb->page_addr[1] != -1) {
+            phys_page2 = get_page_addr_code(env, (pc & TARGET_PAGE_MASK) +
+                                            TARGET_PAGE_SIZE);
+            if (tb->page_addr[1] != phys_page2) {
+                pi = &e->next;
+                continue;
+            }
+        }
+        *pi = e->next;
+        tb_cache_nb_pending--;
+        tb->cache_pending = 0;
+        if (tb_cache_guest_hash(tb) != e->hash) {
+            /* stays invalid until its region is recycled */
+            tb_cache_nb_stale++;
+            continue;
+        }
+        tb->invalid = 0;
+        tb_link_page(tb, phys_pc, tb->page_addr[1]);
+        tb_cache_nb_hits++;
+        return tb;
+    }
+    return NULL;
+}
+
+int tb_cache_init(const char *filename)
+{
+#if defined(TCG_TARGET_HAS_CODE_RELOCS) && defined(USE_DIRECT_JUMP)
+    tb_cache_filename = g_strdup(filename);
+    tcg_ctx.code_relocs_enabled = 1;
+    tb_cache_forget_all();
+    return 0;
+#else
+    fprintf(stderr, "qemu: -tb-cache is not supported on this host\n");
+    return -1;
+#endif
+}
+
+/* add delta to the address at the given relocation, returns the result */
+static uint64_t tb_cache_patch(uint8_t *code, uint32_t reloc, uint64_t delta)
+{
+    uint64_t v;
+
+    memcpy(&v, code + (reloc >> 1), sizeof(v));
+    v += delta;
+    memcpy(code + (reloc >> 1), &v, sizeof(v));
+    return v;
+}
+
+static int tb_cache_load_one(FILE *f, TBCacheEntry *e)
+{
+    static uint32_t relocs[TCG_MAX_CODE_RELOCS];
+    TranslationBlock *tb;
+    TBCacheRecord rec;
+    int i;
+
+    if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+        rec.nb_relocs > TCG_MAX_CODE_RELOCS ||
+        rec.code_size > TB_CACHE_MAX_CODE ||
+        fread(relocs, sizeof(uint32_t), rec.nb_relocs, f) != rec.nb_relocs) {
+        return -1;
+    }
+    for (i = 0; i < rec.nb_relocs; i++) {
+        if ((relocs[i] >> 1) + sizeof(uint64_t) > rec.code_size) {
+            return -1;
+        }
+    }
+    tb = tb_alloc_code(rec.pc, rec.code_size);
+    if (!tb) {
+        return -1;
+    }
+    if (fread(tb->tc_ptr, rec.code_size, 1, f) != 1) {
+        tb_free(tb);
+        return -1;
+    }
+    tb->cs_base = rec.cs_base;
+    tb->flags = rec.flags;
+    tb->size = rec.size;
+    tb->cflags = rec.cflags;
+    tb->icount = rec.icount;
+    tb->nb_helper_calls = rec.nb_helper_calls;
+    tb->page_addr[0] = rec.page_addr[0];
+    tb->page_addr[1] = rec.page_addr[1];
+    for (i = 0; i < 2; i++) {
+        tb->tb_next_offset[i] = rec.tb_next_offset[i];
+#ifdef USE_DIRECT_JUMP
+        tb->tb_jmp_offset[i] = rec.tb_jmp_offset[i];
+#endif
+        tb->jmp_next[i] = NULL;
+    }
+    tb->jmp_first = (TranslationBlock *)((long)tb | 2);
+
+    for (i = 0; i < rec.nb_relocs; i++) {
+        tb_cache_patch(tb->tc_ptr, relocs[i],
+                       (relocs[i] & 1) == TCG_CODE_RELOC_TB ?
+                       (uintptr_t)tb : tb_cache_anchor());
+    }
+    tb->nb_relocs = rec.nb_relocs;
+    tb->relocs = g_realloc(tb->relocs, rec.nb_relocs * sizeof(uint32_t));
+    memcpy(tb->relocs, relocs, rec.nb_relocs * sizeof(uint32_t));
+    flush_icache_range((unsigned long)tb->tc_ptr,
+                       (unsigned long)tb->tc_ptr + rec.code_size);
+
+    /* not executable until tb_cache_lookup has checked the guest code */
+    tb->invalid = 1;
+    tb->cache_pending = 1;
+    e->tb = tb;
+    e->hash = rec.hash;
+    return 0;
+}
+
+/* Must be called after the machine is created and reset, before any
+   code is translated.  */
+void tb_cache_load(void)
+{
+    TBCacheHeader hdr;
+    TBCacheEntry *e;
+    FILE *f;
+    int *head;
+    uint32_t i;
+
+    if (!tb_cache_filename) {
+        return;
+    }
+    f = fopen(tb_cache_filename, "rb");
+    if (!f) {
+        /* first run */
+        return;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != TB_CACHE_MAGIC || hdr.version != TB_CACHE_VERSION ||
+        hdr.nb_tbs > TB_CACHE_MAX_TBS ||
+        strncmp(hdr.arch, TARGET_ARCH, sizeof(hdr.arch)) != 0 ||
+        hdr.binary_id != tb_cache_binary_id() ||
+        hdr.machine_id != tb_cache_machine_id()) {
+        fprintf(stderr, "qemu: ignoring TB cache %s, it was written by "
+                "another QEMU binary or for another machine\n",
+                tb_cache_filename);
+        fclose(f);
+        return;
+    }
+
+    tb_cache_entries = g_malloc(hdr.nb_tbs * sizeof(TBCacheEntry));
+    for (i = 0; i < hdr.nb_tbs; i++) {
+        e = &tb_cache_entries[tb_cache_nb_loaded];
+        if (tb_cache_load_one(f, e) < 0) {
+            break;
+        }
+        head = &tb_cache_heads[tb_cache_hash_func(tb_cache_phys_pc(e->tb))];
+        e->next = *head;
+        *head = tb_cache_nb_loaded++;
+    }
+    tb_cache_nb_pending = tb_cache_nb_loaded;
+    fclose(f);
+}
+
+typedef struct TBCacheSaveState {
+    FILE *f;
+    uint32_t nb_tbs;
+    int error;
+} TBCacheSaveState;
+
+static void tb_cache_save_one(TranslationBlock *tb, int code_size,
+                              void *opaque)
+{
+    TBCacheSaveState *s = opaque;
+    TBCacheRecord rec;
+    uint8_t *code;
+    uint64_t v;
+    int i, *pi;
+
+    /* superblocks cannot be regenerated without their trace */
+    if ((tb->invalid && !tb->cache_pending) || tb->nb_relocs == 0xffff ||
+        tb->sb_len ||
+        code_size <= 0 || code_size > TB_CACHE_MAX_CODE || s->error) {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    if (tb->cache_pending) {
+        pi = tb_cache_find(tb);
+        if (*pi < 0) {
+            return;
+        }
+        rec.hash = tb_cache_entries[*pi].hash;
+    } else {
+        rec.hash = tb_cache_guest_hash(tb);
+    }
+
+    code = g_malloc(code_size);
+    memcpy(code, tb->tc_ptr, code_size);
+    for (i = 0; i < tb->nb_relocs; i++) {
+        if ((tb->relocs[i] & 1) == TCG_CODE_RELOC_TB) {
+            v = tb_cache_patch(code, tb->relocs[i], -(uintptr_t)tb);
+            if (v > 3) {
+                g_free(code);
+                return;
+            }
+        } else {
+            tb_cache_patch(code, tb->relocs[i], -tb_cache_anchor());
+        }
+    }
+
+    rec.pc = tb->pc;
+    rec.cs_base = tb->cs_base;
+    rec.flags = tb->flags;
+    rec.page_addr[0] = tb->page_addr[0];
+    rec.page_addr[1] = tb->page_addr[1];
+    rec.icount = tb->icount;
+    rec.code_size = code_size;
+    rec.size = tb->size;
+    rec.cflags = tb->cflags;
+    for (i = 0; i < 2; i++) {
+        rec.tb_next_offset[i] = tb->tb_next_offset[i];
+#ifdef USE_DIRECT_JUMP
+        rec.tb_jmp_offset[i] = tb->tb_jmp_offset[i];
+#endif
+    }
+    rec.nb_relocs = tb->nb_relocs;
+    rec.nb_helper_calls = tb->nb_helper_calls;
+
+    if (fwrite(&rec, sizeof(rec), 1, s->f) != 1 ||
+        fwrite(tb->relocs, sizeof(uint32_t), tb->nb_relocs, s->f) !=
+        tb->nb_relocs ||
+        fwrite(code, code_size, 1, s->f) != 1) {
+        s->error = 1;
+    }
+    s->nb_tbs++;
+    g_free(code);
+}
+
+/* Must be called with the VCPUs stopped.  */
+void tb_cache_save(void)
+{
+    TBCacheSaveState s;
+    TBCacheHeader hdr;
+    char tmp[PATH_MAX];
+
+    if (!tb_cache_filename) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", tb_cache_filename);
+    s.f = fopen(tmp, "wb");
+    if (!s.f) {
+        fprintf(stderr, "qemu: could not write TB cache %s: %s\n",
+                tmp, strerror(errno));
+        return;
+    }
+    s.nb_tbs = 0;
+    s.error = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TB_CACHE_MAGIC;
+    hdr.version = TB_CACHE_VERSION;
+    pstrcpy(hdr.arch, sizeof(hdr.arch), TARGET_ARCH);
+    hdr.binary_id = tb_cache_binary_id();
+    hdr.machine_id = tb_cache_machine_id();
+    if (fwrite(&hdr, sizeof(hdr), 1, s.f) != 1) {
+        s.error = 1;
+    }
+    tb_foreach(tb_cache_save_one, &s);
+    hdr.nb_tbs = s.nb_tbs;
+    if (fseek(s.f, 0, SEEK_SET) != 0 ||
+        fwrite(&hdr, sizeof(hdr), 1, s.f) != 1) {
+        s.error = 1;
+    }
+    if (fclose(s.f) != 0 || s.error ||
+        rename(tmp, tb_cache_filename) != 0) {
+        fprintf(stderr, "qemu: could not write TB cache %s\n",
+                tb_cache_filename);
+        unlink(tmp);
+    }
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache_filename) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %d loaded, %d used, %d stale, "
+                "%d pending\n", tb_cache_nb_loaded, tb_cache_nb_hits,
+                tb_cache_nb_stale, tb_cache_nb_pending);
+}
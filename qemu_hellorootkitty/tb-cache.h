@@ -0,0 +1,19 @@
+/*
+ * Persistent translation block cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_TB_CACHE_H
+#define QEMU_TB_CACHE_H
+
+TranslationBlock *tb_cache_lookup(CPUState *env, target_ulong pc,
+                                  target_ulong cs_base, uint64_t flags,
+                                  tb_page_addr_t phys_pc);
+void tb_cache_forget(TranslationBlock *tb);
+void tb_cache_forget_all(void);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+#endif
@@ -240,11 +240,13 @@ static inline int tcg_target_const_match(tcg_target_long val,
 # define P_REXW		0x800		/* Set REX.W = 1 */
 # define P_REXB_R	0x1000		/* REG field as byte register */
 # define P_REXB_RM	0x2000		/* R/M field as byte register */
+# define P_SIMDF3	0x4000		/* 0xf3 opcode prefix */
 #else
 # define P_ADDR32	0
 # define P_REXW		0
 # define P_REXB_R	0
 # define P_REXB_RM	0
+# define P_SIMDF3	0
 #endif
 
 #define OPC_ARITH_EvIz	(0x81)
@@ -289,6 +291,31 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
+/* SSE2, used for the vector ops */
+#define OPC_MOVDQU_VxWx	(0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx	(0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq	(0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq	(0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN	(0xdf | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
+#define OPC_PCMPEQB	(0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW	(0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD	(0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB	(0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW	(0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD	(0x66 | P_EXT | P_DATA16)
+#define OPC_PSHUFD	(0x70 | P_EXT | P_DATA16)
+
 /* Group 1 opcode extensions for 0x80-0x83.
    These are also used as modifiers for OPC_ARITH.  */
 #define ARITH_ADD 0
@@ -366,6 +393,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) >> 8;		/* REX.W */
@@ -938,10 +968,31 @@ static void tcg_out_setcond2(TCGContext *s, const TCGArg *args,
 }
 #endif
 
+#if TCG_TARGET_REG_BITS == 64
+/* Load a host address with a fixed-size instruction whose immediate
+   can be patched by the persistent TB cache.  */
+static void tcg_out_movi_reloc(TCGContext *s, int ret, tcg_target_long arg,
+                               int type)
+{
+    tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_out_code_reloc(s, type);
+    tcg_out32(s, arg);
+    tcg_out32(s, arg >> 31 >> 1);
+}
+#endif
+
 static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 {
     tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
 
+#if TCG_TARGET_REG_BITS == 64
+    if (s->code_relocs_enabled) {
+        tcg_out_movi_reloc(s, TCG_REG_R10, dest, TCG_CODE_RELOC_HOST);
+        tcg_out_modrm(s, OPC_GRP5,
+                      call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
+        return;
+    }
+#endif
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
@@ -966,18 +1017,20 @@ static void tcg_out_jmp(TCGContext *s, tcg_target_long dest)
 
 #include "../../softmmu_defs.h"
 
+/* The TLB miss paths are not at the access, so the helpers get the
+   fast path address as an explicit argument.  */
 static void *qemu_ld_helpers[4] = {
-    __ldb_mmu,
-    __ldw_mmu,
-    __ldl_mmu,
-    __ldq_mmu,
+    __ldb_ret_mmu,
+    __ldw_ret_mmu,
+    __ldl_ret_mmu,
+    __ldq_ret_mmu,
 };
 
 static void *qemu_st_helpers[4] = {
-    __stb_mmu,
-    __stw_mmu,
-    __stl_mmu,
-    __stq_mmu,
+    __stb_ret_mmu,
+    __stw_ret_mmu,
+    __stl_ret_mmu,
+    __stq_ret_mmu,
 };
 
 /* Perform the TLB load and compare.
@@ -993,7 +1046,8 @@ static void *qemu_st_helpers[4] = {
 
    Outputs:
    LABEL_PTRS is filled with 1 (32-bit addresses) or 2 (64-bit addresses)
-   positions of the displacements of forward jumps to the TLB miss case.
+   positions of the 32-bit displacements of forward jumps to the TLB miss
+   case, which is emitted after the end of the TB.
 
    First argument register is loaded with the low part of the address.
    In the TLB hit case, it has been adjusted as indicated by the TLB
@@ -1026,8 +1080,9 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tgen_arithi(s, ARITH_AND + rexw, r0,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + rexw, r1,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* and tlb_mask(env), r1 -- the TLB size changes at flush time */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + rexw, r1,
+                         TCG_AREG0, offsetof(CPUState, tlb_mask));
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + P_REXW, r1, TCG_AREG0, r1, 0,
                              offsetof(CPUState, tlb_table[mem_index][0])
@@ -1038,19 +1093,19 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
 
     tcg_out_mov(s, type, r0, addrlo);
 
-    /* jne label1 */
-    tcg_out8(s, OPC_JCC_short + JCC_JNE);
+    /* jne slow_path */
+    tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
     label_ptr[0] = s->code_ptr;
-    s->code_ptr++;
+    s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
         /* cmp 4(r1), addrhi */
         tcg_out_modrm_offset(s, OPC_CMP_GvEv, args[addrlo_idx+1], r1, 4);
 
-        /* jne label1 */
-        tcg_out8(s, OPC_JCC_short + JCC_JNE);
+        /* jne slow_path */
+        tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
         label_ptr[1] = s->code_ptr;
-        s->code_ptr++;
+        s->code_ptr += 4;
     }
 
     /* TLB Hit.  */
@@ -1059,6 +1114,33 @@ static inline void tcg_out_tlb_load(TCGContext *s, int addrlo_idx,
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + P_REXW, r0, r1,
                          offsetof(CPUTLBEntry, addend) - which);
 }
+
+/* Record the TLB miss path of a qemu_ld/st op.  The fast path resumes
+   at the current code position once the helper has returned.  */
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                                int datalo_reg, int datahi_reg,
+                                int addrlo_reg, int addrhi_reg,
+                                int mem_index, uint8_t **label_ptr)
+{
+    TCGLabelQemuLdst *l;
+
+    if (s->nb_qemu_ldst >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+    l = &s->qemu_ldst[s->nb_qemu_ldst++];
+    l->is_ld = is_ld;
+    l->opc = opc;
+    l->datalo_reg = datalo_reg;
+    l->datahi_reg = datahi_reg;
+    l->addrlo_reg = addrlo_reg;
+    l->addrhi_reg = addrhi_reg;
+    l->mem_index = mem_index;
+    l->raddr = s->code_ptr;
+    l->label_ptr[0] = label_ptr[0];
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        l->label_ptr[1] = label_ptr[1];
+    }
+}
 #endif
 
 static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
@@ -1147,8 +1229,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     int data_reg, data_reg2 = 0;
     int addrlo_idx;
 #if defined(CONFIG_SOFTMMU)
-    int mem_index, s_bits, arg_idx;
-    uint8_t *label_ptr[3];
+    int mem_index, s_bits;
+    uint8_t *label_ptr[2];
 #endif
 
     data_reg = args[0];
@@ -1169,69 +1251,9 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_qemu_ld_direct(s, data_reg, data_reg2,
                            tcg_target_call_iarg_regs[0], 0, opc);
 
-    /* jmp label2 */
-    tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
-
-    /* TLB Miss.  */
-
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
-    }
-
-    /* XXX: move that code at the end of the TB */
-    /* The first argument is already loaded with addrlo.  */
-    arg_idx = 1;
-    if (TCG_TARGET_REG_BITS == 32 && TARGET_LONG_BITS == 64) {
-        tcg_out_mov(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx++],
-                    args[addrlo_idx + 1]);
-    }
-    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx],
-                 mem_index);
-    tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
-
-    switch(opc) {
-    case 0 | 4:
-        tcg_out_ext8s(s, data_reg, TCG_REG_EAX, P_REXW);
-        break;
-    case 1 | 4:
-        tcg_out_ext16s(s, data_reg, TCG_REG_EAX, P_REXW);
-        break;
-    case 0:
-        tcg_out_ext8u(s, data_reg, TCG_REG_EAX);
-        break;
-    case 1:
-        tcg_out_ext16u(s, data_reg, TCG_REG_EAX);
-        break;
-    case 2:
-        tcg_out_mov(s, TCG_TYPE_I32, data_reg, TCG_REG_EAX);
-        break;
-#if TCG_TARGET_REG_BITS == 64
-    case 2 | 4:
-        tcg_out_ext32s(s, data_reg, TCG_REG_EAX);
-        break;
-#endif
-    case 3:
-        if (TCG_TARGET_REG_BITS == 64) {
-            tcg_out_mov(s, TCG_TYPE_I64, data_reg, TCG_REG_RAX);
-        } else if (data_reg == TCG_REG_EDX) {
-            /* xchg %edx, %eax */
-            tcg_out_opc(s, OPC_XCHG_ax_r32 + TCG_REG_EDX, 0, 0, 0);
-            tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_EAX);
-        } else {
-            tcg_out_mov(s, TCG_TYPE_I32, data_reg, TCG_REG_EAX);
-            tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_EDX);
-        }
-        break;
-    default:
-        tcg_abort();
-    }
-
-    /* label2: */
-    *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
+    /* TLB Miss: the helper call is emitted after the end of the TB.  */
+    add_qemu_ldst_label(s, 1, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, label_ptr);
 #else
     {
         int32_t offset = GUEST_BASE;
@@ -1322,8 +1344,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     int addrlo_idx;
 #if defined(CONFIG_SOFTMMU)
     int mem_index, s_bits;
-    int stack_adjust;
-    uint8_t *label_ptr[3];
+    uint8_t *label_ptr[2];
 #endif
 
     data_reg = args[0];
@@ -1344,44 +1365,185 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_qemu_st_direct(s, data_reg, data_reg2,
                            tcg_target_call_iarg_regs[0], 0, opc);
 
-    /* jmp label2 */
-    tcg_out8(s, OPC_JMP_short);
-    label_ptr[2] = s->code_ptr;
-    s->code_ptr++;
+    /* TLB Miss: the helper call is emitted after the end of the TB.  */
+    add_qemu_ldst_label(s, 0, opc, data_reg, data_reg2, args[addrlo_idx],
+                        args[addrlo_idx + 1], mem_index, label_ptr);
+#else
+    {
+        int32_t offset = GUEST_BASE;
+        int base = args[addrlo_idx];
+
+        if (TCG_TARGET_REG_BITS == 64) {
+            /* ??? We assume all operations have left us with register
+               contents that are zero extended.  So far this appears to
+               be true.  If we want to enforce this, we can either do
+               an explicit zero-extension here, or (if GUEST_BASE == 0)
+               use the ADDR32 prefix.  For now, do nothing.  */
+
+            if (offset != GUEST_BASE) {
+                tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_RDI, GUEST_BASE);
+                tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_RDI, base);
+                base = TCG_REG_RDI, offset = 0;
+            }
+        }
 
-    /* TLB Miss.  */
+        tcg_out_qemu_st_direct(s, data_reg, data_reg2, base, offset, opc);
+    }
+#endif
+}
 
-    /* label1: */
-    *label_ptr[0] = s->code_ptr - label_ptr[0] - 1;
+#if defined(CONFIG_SOFTMMU)
+/* Resolve the jumps from the TLB compare to the current position.  */
+static void tcg_out_ldst_label_here(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    *(int32_t *)l->label_ptr[0] = s->code_ptr - l->label_ptr[0] - 4;
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        *label_ptr[1] = s->code_ptr - label_ptr[1] - 1;
+        *(int32_t *)l->label_ptr[1] = s->code_ptr - l->label_ptr[1] - 4;
     }
+}
+
+/* Load the retaddr argument of the helper: the host pc that GETPC()
+   would return for a call made from within the fast path, so that
+   cpu_restore_state finds the guest instruction of the access.  */
+static void tcg_out_ldst_retaddr(TCGContext *s, int reg, TCGLabelQemuLdst *l)
+{
+    tcg_target_long raddr = (tcg_target_long)l->raddr - 1;
 
-    /* XXX: move that code at the end of the TB */
+    if (TCG_TARGET_REG_BITS == 64) {
+        /* lea raddr(%rip), reg.  The displacement is relative to the end
+           of the 7-byte instruction, i.e. 4 bytes after the modrm.  */
+        tcg_out_opc(s, OPC_LEA + P_REXW, reg, 0, 0);
+        tcg_out8(s, (LOWREGMASK(reg) << 3) | 5);
+        tcg_out32(s, raddr - ((tcg_target_long)s->code_ptr + 4));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I32, reg, raddr);
+    }
+}
+
+static void tcg_out_ldst_resume(TCGContext *s, TCGLabelQemuLdst *l,
+                                int stack_adjust)
+{
+    /* Not a pop: the result of a load may already be in any register.  */
+    if (stack_adjust != 0) {
+        tcg_out_addi(s, TCG_REG_CALL_STACK, stack_adjust);
+    }
+
+    /* jmp raddr, always within the TB */
+    tcg_out_opc(s, OPC_JMP_long, 0, 0, 0);
+    tcg_out32(s, l->raddr - s->code_ptr - 4);
+}
+
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    int opc = l->opc;
+    int s_bits = opc & 3;
+    int data_reg = l->datalo_reg;
+    int data_reg2 = l->datahi_reg;
+    int stack_adjust = 0;
+    int arg_idx;
+
+    tcg_out_ldst_label_here(s, l);
+    /* the helper may fault and leave the TB */
+    tcg_out_pinned_globals(s, 0);
+
+    /* The first argument is already loaded with addrlo.  */
+    arg_idx = 1;
+    if (TCG_TARGET_REG_BITS == 32 && TARGET_LONG_BITS == 64) {
+        tcg_out_mov(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx++],
+                    l->addrhi_reg);
+    }
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg_idx++],
+                 l->mem_index);
+    if (arg_idx < ARRAY_SIZE(tcg_target_call_iarg_regs)) {
+        tcg_out_ldst_retaddr(s, tcg_target_call_iarg_regs[arg_idx], l);
+    } else {
+        tcg_out_pushi(s, (tcg_target_long)l->raddr - 1);
+        stack_adjust = 4;
+    }
+    tcg_out_calli(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
+
+    switch(opc) {
+    case 0 | 4:
+        tcg_out_ext8s(s, data_reg, TCG_REG_EAX, P_REXW);
+        break;
+    case 1 | 4:
+        tcg_out_ext16s(s, data_reg, TCG_REG_EAX, P_REXW);
+        break;
+    case 0:
+        tcg_out_ext8u(s, data_reg, TCG_REG_EAX);
+        break;
+    case 1:
+        tcg_out_ext16u(s, data_reg, TCG_REG_EAX);
+        break;
+    case 2:
+        tcg_out_mov(s, TCG_TYPE_I32, data_reg, TCG_REG_EAX);
+        break;
+#if TCG_TARGET_REG_BITS == 64
+    case 2 | 4:
+        tcg_out_ext32s(s, data_reg, TCG_REG_EAX);
+        break;
+#endif
+    case 3:
+        if (TCG_TARGET_REG_BITS == 64) {
+            tcg_out_mov(s, TCG_TYPE_I64, data_reg, TCG_REG_RAX);
+        } else if (data_reg == TCG_REG_EDX) {
+            /* xchg %edx, %eax */
+            tcg_out_opc(s, OPC_XCHG_ax_r32 + TCG_REG_EDX, 0, 0, 0);
+            tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_EAX);
+        } else {
+            tcg_out_mov(s, TCG_TYPE_I32, data_reg, TCG_REG_EAX);
+            tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_EDX);
+        }
+        break;
+    default:
+        tcg_abort();
+    }
+
+    tcg_out_ldst_resume(s, l, stack_adjust);
+}
+
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    int opc = l->opc;
+    int s_bits = opc;
+    int data_reg = l->datalo_reg;
+    int data_reg2 = l->datahi_reg;
+    int mem_index = l->mem_index;
+    tcg_target_long raddr = (tcg_target_long)l->raddr - 1;
+    int stack_adjust;
+
+    tcg_out_ldst_label_here(s, l);
+    /* the helper may fault and leave the TB */
+    tcg_out_pinned_globals(s, 0);
+
+    /* The first argument is already loaded with addrlo.  */
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_out_mov(s, (opc == 3 ? TCG_TYPE_I64 : TCG_TYPE_I32),
                     TCG_REG_RSI, data_reg);
         tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
+        tcg_out_ldst_retaddr(s, TCG_REG_RCX, l);
         stack_adjust = 0;
     } else if (TARGET_LONG_BITS == 32) {
         tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, data_reg);
+        tcg_out_pushi(s, raddr);
         if (opc == 3) {
             tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_ECX, data_reg2);
             tcg_out_pushi(s, mem_index);
-            stack_adjust = 4;
+            stack_adjust = 8;
         } else {
             tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_ECX, mem_index);
-            stack_adjust = 0;
+            stack_adjust = 4;
         }
     } else {
+        tcg_out_pushi(s, raddr);
         if (opc == 3) {
-            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, args[addrlo_idx + 1]);
+            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, l->addrhi_reg);
             tcg_out_pushi(s, mem_index);
             tcg_out_push(s, data_reg2);
             tcg_out_push(s, data_reg);
-            stack_adjust = 12;
+            stack_adjust = 16;
         } else {
-            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, args[addrlo_idx + 1]);
+            tcg_out_mov(s, TCG_TYPE_I32, TCG_REG_EDX, l->addrhi_reg);
             switch(opc) {
             case 0:
                 tcg_out_ext8u(s, TCG_REG_ECX, data_reg);
@@ -1394,45 +1556,123 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
                 break;
             }
             tcg_out_pushi(s, mem_index);
-            stack_adjust = 4;
+            stack_adjust = 8;
         }
     }
 
     tcg_out_calli(s, (tcg_target_long)qemu_st_helpers[s_bits]);
 
-    if (stack_adjust == (TCG_TARGET_REG_BITS / 8)) {
-        /* Pop and discard.  This is 2 bytes smaller than the add.  */
-        tcg_out_pop(s, TCG_REG_ECX);
-    } else if (stack_adjust != 0) {
-        tcg_out_addi(s, TCG_REG_CALL_STACK, stack_adjust);
-    }
+    tcg_out_ldst_resume(s, l, stack_adjust);
+}
+#endif
 
-    /* label2: */
-    *label_ptr[2] = s->code_ptr - label_ptr[2] - 1;
-#else
-    {
-        int32_t offset = GUEST_BASE;
-        int base = args[addrlo_idx];
+/* Emit the TLB miss paths of the qemu_ld/st ops of the TB.  */
+static void tcg_out_qemu_ldst_slow_paths(TCGContext *s)
+{
+#if defined(CONFIG_SOFTMMU)
+    int i;
 
-        if (TCG_TARGET_REG_BITS == 64) {
-            /* ??? We assume all operations have left us with register
-               contents that are zero extended.  So far this appears to
-               be true.  If we want to enforce this, we can either do
-               an explicit zero-extension here, or (if GUEST_BASE == 0)
-               use the ADDR32 prefix.  For now, do nothing.  */
+    for (i = 0; i < s->nb_qemu_ldst; i++) {
+        TCGLabelQemuLdst *l = &s->qemu_ldst[i];
 
-            if (offset != GUEST_BASE) {
-                tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_RDI, GUEST_BASE);
-                tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_RDI, base);
-                base = TCG_REG_RDI, offset = 0;
-            }
+        if (l->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, l);
+        } else {
+            tcg_out_qemu_st_slow_path(s, l);
         }
-
-        tcg_out_qemu_st_direct(s, data_reg, data_reg2, base, offset, opc);
     }
 #endif
 }
 
+#if TCG_TARGET_HAS_vec
+/* The vector ops work on CPUState memory through %xmm0 and %xmm1.  These
+   are call-clobbered and not otherwise used by generated code, so they
+   need no register allocation.  */
+#define TCG_VEC_TMP0 0
+#define TCG_VEC_TMP1 1
+
+static void tcg_out_vec_ld(TCGContext *s, int oprsz, int xmm,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, oprsz == 16 ? OPC_MOVDQU_VxWx : OPC_MOVQ_VqWq,
+                         xmm, TCG_AREG0, ofs);
+}
+
+static void tcg_out_vec_st(TCGContext *s, int oprsz, int xmm,
+                           tcg_target_long ofs)
+{
+    tcg_out_modrm_offset(s, oprsz == 16 ? OPC_MOVDQU_WxVx : OPC_MOVQ_WqVq,
+                         xmm, TCG_AREG0, ofs);
+}
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[4] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD, 0
+    };
+    static const int cmpgt_insn[4] = {
+        OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD, 0
+    };
+    int oprsz = args[0];
+    tcg_target_long dofs, aofs, bofs;
+    int insn;
+
+    switch (opc) {
+    case INDEX_op_mov_vec:
+        tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP0, args[2]);
+        tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, args[1]);
+        return;
+    case INDEX_op_shuf32_vec:
+        if (oprsz != 16) {
+            tcg_abort();
+        }
+        tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP1, args[2]);
+        tcg_out_modrm(s, OPC_PSHUFD, TCG_VEC_TMP0, TCG_VEC_TMP1);
+        tcg_out8(s, args[3]);
+        tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, args[1]);
+        return;
+    case INDEX_op_andc_vec:
+        /* pandn computes ~dst & src */
+        dofs = args[1], aofs = args[3], bofs = args[2];
+        insn = OPC_PANDN;
+        break;
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+        dofs = args[1], aofs = args[2], bofs = args[3];
+        insn = (opc == INDEX_op_and_vec ? OPC_PAND
+                : opc == INDEX_op_or_vec ? OPC_POR : OPC_PXOR);
+        break;
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_cmpeq_vec:
+    case INDEX_op_cmpgt_vec:
+        dofs = args[2], aofs = args[3], bofs = args[4];
+        insn = (opc == INDEX_op_add_vec ? add_insn
+                : opc == INDEX_op_sub_vec ? sub_insn
+                : opc == INDEX_op_cmpeq_vec ? cmpeq_insn
+                : cmpgt_insn)[args[1] & 3];
+        break;
+    default:
+        tcg_abort();
+    }
+    if (insn == 0) {
+        tcg_abort();
+    }
+
+    tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP0, aofs);
+    tcg_out_vec_ld(s, oprsz, TCG_VEC_TMP1, bofs);
+    tcg_out_modrm(s, insn, TCG_VEC_TMP0, TCG_VEC_TMP1);
+    tcg_out_vec_st(s, oprsz, TCG_VEC_TMP0, dofs);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1450,12 +1690,24 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+#if TCG_TARGET_REG_BITS == 64
+        if (s->code_relocs_enabled && args[0]) {
+            tcg_out_movi_reloc(s, TCG_REG_EAX, args[0], TCG_CODE_RELOC_TB);
+        } else
+#endif
+        {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement so that tb_set_jmp_target1 can
+               patch it atomically while another thread executes it */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1767,6 +2019,21 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+#if TCG_TARGET_HAS_vec
+    case INDEX_op_mov_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_cmpeq_vec:
+    case INDEX_op_cmpgt_vec:
+    case INDEX_op_shuf32_vec:
+        tcg_out_vec_op(s, opc, args);
+        break;
+#endif
+
     default:
         tcg_abort();
     }
@@ -1918,6 +2185,19 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_st32, { "L", "L", "L" } },
     { INDEX_op_qemu_st64, { "L", "L", "L", "L" } },
 #endif
+
+#if TCG_TARGET_HAS_vec
+    { INDEX_op_mov_vec, { } },
+    { INDEX_op_and_vec, { } },
+    { INDEX_op_or_vec, { } },
+    { INDEX_op_xor_vec, { } },
+    { INDEX_op_andc_vec, { } },
+    { INDEX_op_add_vec, { } },
+    { INDEX_op_sub_vec, { } },
+    { INDEX_op_cmpeq_vec, { } },
+    { INDEX_op_cmpgt_vec, { } },
+    { INDEX_op_shuf32_vec, { } },
+#endif
     { -1 },
 };
 
@@ -1937,6 +2217,14 @@ static int tcg_target_callee_save_regs[] = {
 #endif
 };
 
+#if TCG_TARGET_NB_PIN_REGS > 0
+static const int tcg_target_pin_regs[TCG_TARGET_NB_PIN_REGS] = {
+    TCG_REG_R15,
+    TCG_REG_R13,
+    TCG_REG_R12,
+};
+#endif
+
 /* Generate global QEMU prologue and epilogue code */
 static void tcg_target_qemu_prologue(TCGContext *s)
 {
@@ -1964,6 +2252,7 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_addi(s, TCG_REG_ESP, -stack_addend);
 
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
+    tcg_out_pinned_globals(s, 1);
 
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
@@ -1971,6 +2260,7 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
+    tcg_out_pinned_globals(s, 0);
     tcg_out_addi(s, TCG_REG_CALL_STACK, stack_addend);
 
     for (i = ARRAY_SIZE(tcg_target_callee_save_regs) - 1; i >= 0; i--) {
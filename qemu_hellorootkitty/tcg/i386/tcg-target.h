@@ -92,6 +92,13 @@ enum {
 #define TCG_TARGET_HAS_nor_i32          0
 #define TCG_TARGET_HAS_deposit_i32      1
 
+/* vector ops on CPU state, lowered to SSE2 which x86-64 always has */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_HAS_vec              1
+#else
+#define TCG_TARGET_HAS_vec              0
+#endif
+
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
 #define TCG_TARGET_HAS_rot_i64          1
@@ -121,6 +128,19 @@ enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* host addresses in generated code can be recorded and relocated */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_HAS_CODE_RELOCS
+#endif
+
+/* qemu_ld/st TLB miss paths are emitted after the end of the TB */
+#define TCG_TARGET_HAS_LDST_SLOW_PATH
+
+/* callee-saved registers left for globals pinned across TBs */
+#if TCG_TARGET_REG_BITS == 64
+#define TCG_TARGET_NB_PIN_REGS 3
+#endif
+
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
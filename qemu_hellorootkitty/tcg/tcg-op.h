@@ -2118,6 +2118,106 @@ static inline void tcg_gen_deposit_i64(TCGv_i64 ret, TCGv_i64 arg1,
     tcg_temp_free_i64(t1);
 }
 
+/***************************************/
+/* vector operations.  The operands are OPRSZ-byte vectors (8 or 16)
+   at the given offsets from env, VECE is log2 of the element size.
+   Only available when TCG_TARGET_HAS_vec is set; otherwise the
+   front end must fall back to helpers.  */
+
+static inline void tcg_gen_mov_vec(int oprsz, tcg_target_long dofs,
+                                   tcg_target_long aofs)
+{
+    *gen_opc_ptr++ = INDEX_op_mov_vec;
+    *gen_opparam_ptr++ = oprsz;
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = aofs;
+}
+
+static inline void tcg_gen_vec_op3(TCGOpcode opc, int oprsz,
+                                   tcg_target_long dofs, tcg_target_long aofs,
+                                   TCGArg b)
+{
+    *gen_opc_ptr++ = opc;
+    *gen_opparam_ptr++ = oprsz;
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = aofs;
+    *gen_opparam_ptr++ = b;
+}
+
+static inline void tcg_gen_vec_op3e(TCGOpcode opc, int oprsz, int vece,
+                                    tcg_target_long dofs, tcg_target_long aofs,
+                                    tcg_target_long bofs)
+{
+    *gen_opc_ptr++ = opc;
+    *gen_opparam_ptr++ = oprsz;
+    *gen_opparam_ptr++ = vece;
+    *gen_opparam_ptr++ = dofs;
+    *gen_opparam_ptr++ = aofs;
+    *gen_opparam_ptr++ = bofs;
+}
+
+static inline void tcg_gen_and_vec(int oprsz, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3(INDEX_op_and_vec, oprsz, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_or_vec(int oprsz, tcg_target_long dofs,
+                                  tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3(INDEX_op_or_vec, oprsz, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_xor_vec(int oprsz, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3(INDEX_op_xor_vec, oprsz, dofs, aofs, bofs);
+}
+
+/* d = a & ~b */
+static inline void tcg_gen_andc_vec(int oprsz, tcg_target_long dofs,
+                                    tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3(INDEX_op_andc_vec, oprsz, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_add_vec(int oprsz, int vece, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3e(INDEX_op_add_vec, oprsz, vece, dofs, aofs, bofs);
+}
+
+static inline void tcg_gen_sub_vec(int oprsz, int vece, tcg_target_long dofs,
+                                   tcg_target_long aofs, tcg_target_long bofs)
+{
+    tcg_gen_vec_op3e(INDEX_op_sub_vec, oprsz, vece, dofs, aofs, bofs);
+}
+
+/* Elements are set to all ones where the comparison is true.  VECE
+   must be at most 2.  */
+static inline void tcg_gen_cmpeq_vec(int oprsz, int vece, tcg_target_long dofs,
+                                     tcg_target_long aofs,
+                                     tcg_target_long bofs)
+{
+    tcg_gen_vec_op3e(INDEX_op_cmpeq_vec, oprsz, vece, dofs, aofs, bofs);
+}
+
+/* Signed greater-than.  */
+static inline void tcg_gen_cmpgt_vec(int oprsz, int vece, tcg_target_long dofs,
+                                     tcg_target_long aofs,
+                                     tcg_target_long bofs)
+{
+    tcg_gen_vec_op3e(INDEX_op_cmpgt_vec, oprsz, vece, dofs, aofs, bofs);
+}
+
+/* 32-bit element I of d is element (imm >> (2 * I)) & 3 of a.  OPRSZ
+   must be 16.  */
+static inline void tcg_gen_shuf32_vec(int oprsz, tcg_target_long dofs,
+                                      tcg_target_long aofs, int imm)
+{
+    tcg_gen_vec_op3(INDEX_op_shuf32_vec, oprsz, dofs, aofs, imm & 0xff);
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -158,6 +158,20 @@ DEF(eqv_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_eqv_i64))
 DEF(nand_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nand_i64))
 DEF(nor_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nor_i64))
 
+/* vector ops: operands are env offsets of 8 or 16 byte vectors */
+#define IMPLVEC (IMPL(TCG_TARGET_HAS_vec) | TCG_OPF_SIDE_EFFECTS)
+DEF(mov_vec, 0, 0, 3, IMPLVEC)      /* oprsz, d, a */
+DEF(and_vec, 0, 0, 4, IMPLVEC)      /* oprsz, d, a, b */
+DEF(or_vec, 0, 0, 4, IMPLVEC)
+DEF(xor_vec, 0, 0, 4, IMPLVEC)
+DEF(andc_vec, 0, 0, 4, IMPLVEC)
+DEF(add_vec, 0, 0, 5, IMPLVEC)      /* oprsz, vece, d, a, b */
+DEF(sub_vec, 0, 0, 5, IMPLVEC)
+DEF(cmpeq_vec, 0, 0, 5, IMPLVEC)
+DEF(cmpgt_vec, 0, 0, 5, IMPLVEC)
+DEF(shuf32_vec, 0, 0, 4, IMPLVEC)   /* oprsz, d, a, imm8 */
+#undef IMPLVEC
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, 0)
@@ -83,6 +83,13 @@ static void tcg_out_st(TCGContext *s, TCGType type, int arg, int arg1,
 static int tcg_target_const_match(tcg_target_long val,
                                   const TCGArgConstraint *arg_ct);
 static int tcg_target_get_call_iarg_regs_count(int flags);
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATH
+static void tcg_out_qemu_ldst_slow_paths(TCGContext *s);
+#endif
+
+/* Forward declarations for functions declared here and used in
+   tcg-target.c.  */
+static void tcg_out_pinned_globals(TCGContext *s, int load);
 
 TCGOpDef tcg_op_defs[] = {
 #define DEF(s, oargs, iargs, cargs, flags) { #s, oargs, iargs, cargs, iargs + oargs + cargs, flags },
@@ -267,6 +274,103 @@ void tcg_prologue_init(TCGContext *s)
     tcg_target_qemu_prologue(s);
     flush_icache_range((unsigned long)s->code_buf, 
                        (unsigned long)s->code_ptr);
+    s->prologue_ready = 1;
+}
+
+/* Keep the globals named in 'names' (separated by ':') in callee-saved
+   host registers between TBs, instead of storing them back to memory at
+   the end of each TB.  The prologue loads them and the epilogue stores
+   them; in between, they are only written to memory before helper
+   calls and qemu_ld/st slow paths, and reloaded after helpers that may
+   modify them.  Must be called before the globals are created.  */
+int tcg_pin_globals(TCGContext *s, const char *names)
+{
+    const char *p;
+    int n = 1;
+
+    for (p = names; *p; p++) {
+        if (*p == ':') {
+            n++;
+        }
+    }
+    if (n > TCG_TARGET_NB_PIN_REGS) {
+        return -1;
+    }
+    s->pin_names = g_strdup(names);
+    return 0;
+}
+
+/* Once the globals are created, print the names given to tcg_pin_globals
+   that no pinned global matched, and return how many there are.  */
+int tcg_check_pinned_globals(TCGContext *s)
+{
+    const char *p = s->pin_names;
+    const char *end, *name;
+    size_t len;
+    int i, n = 0;
+
+    while (p) {
+        end = strchr(p, ':');
+        len = end ? end - p : strlen(p);
+        for (i = 0; i < s->nb_pinned_globals; i++) {
+            name = s->temps[s->pinned_globals[i]].name;
+            if (strlen(name) == len && !strncmp(name, p, len)) {
+                break;
+            }
+        }
+        if (i == s->nb_pinned_globals) {
+            fprintf(stderr, "tcg: no global named '%.*s' can be pinned\n",
+                    (int)len, p);
+            n++;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return n;
+}
+
+/* Return the host register for the global 'name' if it must be pinned,
+   -1 otherwise.  */
+static int tcg_global_pin_reg(TCGContext *s, TCGType type, const char *name)
+{
+#if TCG_TARGET_NB_PIN_REGS > 0
+    const char *p = s->pin_names;
+    size_t len = strlen(name);
+
+    if (!p || s->nb_pinned_globals == TCG_TARGET_NB_PIN_REGS) {
+        return -1;
+    }
+    if (TCG_TARGET_REG_BITS == 32 && type == TCG_TYPE_I64) {
+        return -1;
+    }
+    for (;;) {
+        if (!strncmp(p, name, len) && (p[len] == ':' || p[len] == '\0')) {
+            return tcg_target_pin_regs[s->nb_pinned_globals];
+        }
+        p = strchr(p, ':');
+        if (!p) {
+            return -1;
+        }
+        p++;
+    }
+#else
+    return -1;
+#endif
+}
+
+/* Store the pinned globals to memory, or load them back.  */
+static void tcg_out_pinned_globals(TCGContext *s, int load)
+{
+    TCGTemp *ts;
+    int i;
+
+    for (i = 0; i < s->nb_pinned_globals; i++) {
+        ts = &s->temps[s->pinned_globals[i]];
+        if (load) {
+            tcg_out_ld(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+        } else {
+            tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+        }
+    }
 }
 
 void tcg_set_frame(TCGContext *s, int reg,
@@ -290,6 +394,22 @@ void tcg_func_start(TCGContext *s)
 
     gen_opc_ptr = gen_opc_buf;
     gen_opparam_ptr = gen_opparam_buf;
+    s->nb_code_relocs = 0;
+}
+
+/* Record that the host address about to be emitted at s->code_ptr must
+   be relocated when the code is moved to another process.  */
+void tcg_out_code_reloc(TCGContext *s, int type)
+{
+    if (s->nb_code_relocs < 0) {
+        return;
+    }
+    if (s->nb_code_relocs >= TCG_MAX_CODE_RELOCS) {
+        s->nb_code_relocs = -1;
+        return;
+    }
+    s->code_relocs[s->nb_code_relocs++] =
+        ((s->code_ptr - s->code_buf) << 1) | type;
 }
 
 static inline void tcg_temp_alloc(TCGContext *s, int n)
@@ -346,7 +466,22 @@ static inline int tcg_global_mem_new_internal(TCGType type, int reg,
 {
     TCGContext *s = &tcg_ctx;
     TCGTemp *ts;
-    int idx;
+    int idx, pin_reg;
+
+    pin_reg = reg == TCG_AREG0 ? tcg_global_pin_reg(s, type, name) : -1;
+    if (pin_reg >= 0) {
+        idx = tcg_global_reg_new_internal(type, pin_reg, name);
+        ts = &s->temps[idx];
+        ts->mem_allocated = 1;
+        ts->mem_reg = reg;
+        ts->mem_offset = offset;
+        s->pinned_globals[s->nb_pinned_globals++] = idx;
+        /* the prologue must load the new global */
+        if (s->prologue_ready) {
+            tcg_prologue_init(s);
+        }
+        return idx;
+    }
 
     idx = s->nb_globals;
 #if TCG_TARGET_REG_BITS == 32
@@ -1991,10 +2126,15 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
        can modify any global. */
     if (!(flags & TCG_CALL_CONST)) {
         save_globals(s, allocated_regs);
+        tcg_out_pinned_globals(s, 0);
     }
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
 
+    if (!(flags & (TCG_CALL_CONST | TCG_CALL_PURE))) {
+        tcg_out_pinned_globals(s, 1);
+    }
+
     /* assign output registers and emit moves if needed */
     for(i = 0; i < nb_oargs; i++) {
         arg = args[i];
@@ -2081,6 +2221,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATH
+    s->nb_qemu_ldst = 0;
+#endif
 
     args = gen_opparam_buf;
     op_index = 0;
@@ -2142,6 +2285,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
             args += tcg_reg_alloc_call(s, def, opc, args, dead_args);
             goto next;
         case INDEX_op_end:
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATH
+            tcg_out_qemu_ldst_slow_paths(s);
+#endif
             goto the_end;
         default:
             /* Sanity check that we've not introduced any unhandled opcodes. */
@@ -88,6 +88,15 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_deposit_i64_valid(ofs, len) 1
 #endif
 
+#ifndef TCG_TARGET_HAS_vec
+#define TCG_TARGET_HAS_vec              0
+#endif
+
+/* number of callee-saved host registers that can hold pinned globals */
+#ifndef TCG_TARGET_NB_PIN_REGS
+#define TCG_TARGET_NB_PIN_REGS          0
+#endif
+
 /* Only one of DIV or DIV2 should be defined.  */
 #if defined(TCG_TARGET_HAS_div_i32)
 #define TCG_TARGET_HAS_div2_i32         0
@@ -142,6 +151,9 @@ typedef struct TCGPool {
 #define TCG_POOL_CHUNK_SIZE 32768
 
 #define TCG_MAX_LABELS 512
+#define TCG_MAX_CODE_RELOCS 1024
+#define TCG_MAX_QEMU_LDST 640
+#define TCG_MAX_PINNED_GLOBALS 8
 
 #define TCG_MAX_TEMPS 512
 
@@ -333,6 +345,25 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* code relocation types, stored in the low bit of the code offset */
+#define TCG_CODE_RELOC_HOST 0   /* address in the QEMU binary */
+#define TCG_CODE_RELOC_TB   1   /* TB pointer ORed with an exit index */
+
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATH
+/* TLB miss path of a qemu_ld/st op, emitted after the end of the TB */
+typedef struct TCGLabelQemuLdst {
+    int is_ld;
+    int opc;
+    int datalo_reg;
+    int datahi_reg;
+    int addrlo_reg;
+    int addrhi_reg;
+    int mem_index;
+    uint8_t *raddr;         /* fast path code following the access */
+    uint8_t *label_ptr[2];  /* branches from the TLB compare */
+} TCGLabelQemuLdst;
+#endif
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -368,6 +399,23 @@ struct TCGContext {
     uint8_t *code_ptr;
     TCGTemp static_temps[TCG_MAX_TEMPS];
 
+    /* host addresses embedded in the generated code, recorded for the
+       persistent TB cache.  nb_code_relocs is -1 on overflow.  */
+    int code_relocs_enabled;
+    int nb_code_relocs;
+    uint32_t code_relocs[TCG_MAX_CODE_RELOCS];
+
+#ifdef TCG_TARGET_HAS_LDST_SLOW_PATH
+    int nb_qemu_ldst;
+    TCGLabelQemuLdst qemu_ldst[TCG_MAX_QEMU_LDST];
+#endif
+
+    /* globals kept in host registers between TBs, see tcg_pin_globals */
+    char *pin_names;
+    int nb_pinned_globals;
+    int pinned_globals[TCG_MAX_PINNED_GLOBALS];
+    int prologue_ready;
+
     TCGHelperInfo *helpers;
     int nb_helpers;
     int allocated_helpers;
@@ -405,6 +453,7 @@ extern TCGArg gen_opparam_buf[];
 /* pool based memory allocation */
 
 void *tcg_malloc_internal(TCGContext *s, int size);
+void tcg_out_code_reloc(TCGContext *s, int type);
 void tcg_pool_reset(TCGContext *s);
 void tcg_pool_delete(TCGContext *s);
 
@@ -425,6 +474,8 @@ static inline void *tcg_malloc(int size)
 
 void tcg_context_init(TCGContext *s);
 void tcg_prologue_init(TCGContext *s);
+int tcg_pin_globals(TCGContext *s, const char *names);
+int tcg_check_pinned_globals(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
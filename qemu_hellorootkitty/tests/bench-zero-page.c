@@ -0,0 +1,102 @@
+/*
+ * Zero and duplicate page detection speed test
+ *
+ * Times buffer_is_zero() and buffer_is_dup() against the word-at-a-time
+ * loop they replaced, on pages that are filled, that differ in their
+ * first bytes and that only differ in their last bytes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "qemu-common.h"
+
+#define PAGE_SIZE 4096
+#define ITERATIONS 2000000
+
+static int is_dup_page_old(uint8_t *page, uint8_t ch)
+{
+    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
+    uint32_t *array = (uint32_t *)page;
+    int i;
+
+    for (i = 0; i < (PAGE_SIZE / 4); i++) {
+        if (array[i] != val) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench(const char *name, uint8_t *page)
+{
+    double t0, t_old, t_zero, t_dup;
+    int i, r_old = 0, r_zero = 0, r_dup = 0;
+
+    t0 = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        r_old += is_dup_page_old(page, *page);
+        /* keep the compiler from hoisting the call out of the loop */
+        asm volatile("" : : "r"(page) : "memory");
+    }
+    t_old = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        r_zero += buffer_is_zero(page, PAGE_SIZE);
+        asm volatile("" : : "r"(page) : "memory");
+    }
+    t_zero = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        r_dup += buffer_is_dup(page, PAGE_SIZE);
+        asm volatile("" : : "r"(page) : "memory");
+    }
+    t_dup = now() - t0;
+
+    printf("%-16s old %7.1f ns  zero %7.1f ns (%c)  dup %7.1f ns (%c)\n",
+           name,
+           t_old * 1e9 / ITERATIONS,
+           t_zero * 1e9 / ITERATIONS, r_zero ? 'y' : 'n',
+           t_dup * 1e9 / ITERATIONS, r_dup ? 'y' : 'n');
+    if (!!r_old != !!r_dup) {
+        fprintf(stderr, "%s: buffer_is_dup disagrees with the old loop\n",
+                name);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *page = qemu_memalign(PAGE_SIZE, PAGE_SIZE);
+
+    memset(page, 0, PAGE_SIZE);
+    bench("zero", page);
+
+    memset(page, 0x5a, PAGE_SIZE);
+    bench("dup", page);
+
+    memset(page, 0, PAGE_SIZE);
+    page[5] = 1;
+    bench("nonzero-head", page);
+
+    memset(page, 0, PAGE_SIZE);
+    page[PAGE_SIZE - 1] = 1;
+    bench("nonzero-tail", page);
+
+    return 0;
+}
@@ -89,6 +89,16 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     gen_code_size = tcg_gen_code(s, gen_code_buf);
     *gen_code_size_ptr = gen_code_size;
+    tb->nb_helper_calls = 0;
+    if (tb_profile_enabled) {
+        uint16_t *opc_ptr;
+
+        for (opc_ptr = gen_opc_buf; opc_ptr < gen_opc_ptr; opc_ptr++) {
+            if (*opc_ptr == INDEX_op_call) {
+                tb->nb_helper_calls++;
+            }
+        }
+    }
 #ifdef CONFIG_PROFILER
     s->code_time += profile_getclock();
     s->code_in_len += tb->size;
@@ -108,8 +118,8 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 
 /* The cpu state corresponding to 'searched_pc' is restored.
  */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUState *env, unsigned long searched_pc)
+static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUState *env,
+                                     unsigned long searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -161,3 +171,15 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUState *env, unsigned long searched_pc)
+{
+    int ret;
+
+    /* tcg_ctx is shared with tb_gen_code() */
+    tb_mt_lock();
+    ret = cpu_restore_state_from_tb(tb, env, searched_pc);
+    tb_mt_unlock();
+    return ret;
+}
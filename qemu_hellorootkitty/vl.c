@@ -266,6 +266,7 @@ int xen_allowed = 0;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static const char *tcg_tb_cache;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -1987,7 +1988,23 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    const char *threads = NULL, *pin = NULL;
+    bool superblocks = false;
+    QemuOptsList *list = qemu_find_opts("machine");
+
+    if (!QTAILQ_EMPTY(&list->head)) {
+        threads = qemu_opt_get(QTAILQ_FIRST(&list->head), "tcg_threads");
+        superblocks = qemu_opt_get_bool(QTAILQ_FIRST(&list->head),
+                                        "tcg_superblocks", false);
+        pin = qemu_opt_get(QTAILQ_FIRST(&list->head), "tcg_pin");
+    }
+    configure_tcg_threads(threads);
+    configure_tcg_superblocks(superblocks);
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
+    configure_tcg_pinned_globals(pin);
+    if (tcg_tb_cache && tb_cache_init(tcg_tb_cache) < 0) {
+        exit(1);
+    }
     return 0;
 }
 
@@ -2964,6 +2981,9 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_rtc(opts);
                 break;
+            case QEMU_OPTION_tb_cache:
+                tcg_tb_cache = optarg;
+                break;
             case QEMU_OPTION_tb_size:
                 tcg_tb_size = strtol(optarg, NULL, 0);
                 if (tcg_tb_size < 0) {
@@ -3340,6 +3360,7 @@ int main(int argc, char **argv, char **envp)
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
 
+    check_tcg_pinned_globals();
     cpu_synchronize_all_post_init();
 
     set_numa_modes();
@@ -3450,6 +3471,7 @@ int main(int argc, char **argv, char **envp)
     qemu_run_machine_init_done_notifiers();
 
     qemu_system_reset(VMRESET_SILENT);
+    tb_cache_load();
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
@@ -3474,6 +3496,7 @@ int main(int argc, char **argv, char **envp)
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
+    tb_cache_save();
     net_cleanup();
     res_free();
 
@@ -0,0 +1,98 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * The XOR of the old and new contents of a page is a sequence of zero
+ * runs (unchanged bytes) and non-zero runs (changed bytes).  It is
+ * encoded as pairs of
+ *
+ *   zero run length     ULEB128
+ *   non-zero run length ULEB128
+ *   the new contents of the non-zero run
+ *
+ * and the zero run at the end of the page is left out.  Decoding thus
+ * needs the old contents, which are patched in place.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    bool aligned = !(((uintptr_t)old_buf | (uintptr_t)new_buf) %
+                     sizeof(long));
+    int i = 0, d = 0, start;
+
+    while (i < slen) {
+        /* zero run, skipped a word at a time when possible */
+        start = i;
+        for (;;) {
+            if (aligned && !(i % sizeof(long)) && i + sizeof(long) <= slen &&
+                *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+                i += sizeof(long);
+            } else if (i < slen && old_buf[i] == new_buf[i]) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        if (i == slen) {
+            break;
+        }
+        /* two ULEB128 numbers take at most 10 bytes */
+        if (d + 10 > dlen) {
+            return -1;
+        }
+        d += uleb128_encode(dst + d, i - start);
+
+        /* non-zero run */
+        start = i;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        d += uleb128_encode(dst + d, i - start);
+        if (d + i - start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen)
+{
+    uint32_t count;
+    int i = 0, d = 0, ret;
+
+    while (i < slen) {
+        /* zero run */
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count > dlen - d) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* non-zero run */
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count > dlen - d) {
+            return -1;
+        }
+        i += ret;
+        if (count > slen - i) {
+            return -1;
+        }
+        memcpy(dst + d, src + i, count);
+        i += count;
+        d += count;
+    }
+
+    return d;
+}
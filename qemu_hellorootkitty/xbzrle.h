@@ -0,0 +1,30 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+#include "qemu-common.h"
+
+/*
+ * Encode the difference between old_buf and new_buf (slen bytes each)
+ * into dst.  Returns the encoded length, 0 if the buffers are equal, or
+ * -1 if the encoding would not fit in dlen bytes.
+ */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/*
+ * Apply the slen bytes of encoded difference in src to the dlen bytes
+ * of dst.  Returns the number of bytes of dst covered by the encoding,
+ * or -1 if src is malformed.
+ */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen);
+
+#endif